@@ -6,19 +6,60 @@ echo "-------------------------------"
 # Exit on first error.
 set -e
 
-INPUT_FILE="none"
 PAL_MODE="no"
+RAW_MODE="no"
+SPECIALISE="no"
+CHECKPOINT_SECONDS="0"
+SUB_FRAMES="1"
+STREAM_MODE="no"
+BANKED_MODE="no"
+RASTER_PROFILE="no"
 
 sdcc="${HOME}/Code/sdcc-4.3.0/bin/sdcc"
 devkitSMS="${HOME}/Code/devkitSMS"
 SMSlib="${devkitSMS}/SMSlib"
 SGlib="${devkitSMS}/SGlib"
-ihx2sms="${devkitSMS}/ihx2sms/Linux/ihx2sms"
 sneptile="./tools/Sneptile-0.4.0/Sneptile"
 
 # SC-3000 Tape Support
 tapewave="./tools/SC-TapeWave/tapewave"
 
+# Converted tile and music data are cached, keyed by a hash of the
+# inputs, the converter options, and the converter and checker source.
+# Music data is only cached once it has passed vgm_check, so a change to
+# the checker re-checks the music.
+CACHE_DIR="${VGM_TAPEPLAY_CACHE:-./cache}"
+
+# Pre-built player images
+PLAYER_DIR="${VGM_TAPEPLAY_PLAYER:-./build/player}"
+
+
+# Output a cache key for the given options string and input files.
+cache_key ()
+{
+    (
+        echo "${1}"
+        shift
+        for file in "$@"
+        do
+            sha256sum < "${file}"
+        done
+    ) | sha256sum | cut -d ' ' -f 1
+}
+
+
+# Copy a directory into the cache under the given key.
+# A temporary name is used so that a partial entry is never visible.
+# If another build stored the key first, mv -T fails rather than moving
+# the copy inside the existing entry, and the copy is thrown away.
+cache_store ()
+{
+    mkdir -p "${CACHE_DIR}"
+    rm -rf "${CACHE_DIR}/${1}.tmp.$$"
+    cp -r "${2}" "${CACHE_DIR}/${1}.tmp.$$"
+    mv -T "${CACHE_DIR}/${1}.tmp.$$" "${CACHE_DIR}/${1}" 2> /dev/null || rm -rf "${CACHE_DIR}/${1}.tmp.$$"
+}
+
 build_sneptile ()
 {
     # Early return if we've already got an up-to-date build
@@ -55,78 +96,388 @@ build_tapewave ()
 }
 
 
+# Library for the conversion pipeline, with each stage working in-memory.
+LIBTAPEPLAY_SOURCES="source/vgm_convert/vgm_convert.c \
+                     source/vgm_convert/vgm_read.c \
+                     source/vgm_check/vgm_decode.c \
+                     source/vgm_check/vgm_check.c \
+                     source/vgm_inject/vgm_inject.c \
+                     source/tape_wave/tape_wave.c"
+
+build_libtapeplay ()
+{
+    # Early return if we've already got an up-to-date build
+    UP_TO_DATE="yes"
+    for file in ${LIBTAPEPLAY_SOURCES} source/*/*.h
+    do
+        if [ ! -e libtapeplay.a -o ! "${file}" -ot libtapeplay.a ]
+        then
+            UP_TO_DATE="no"
+        fi
+    done
+    if [ "${UP_TO_DATE}" = "yes" ]
+    then
+        return
+    fi
+
+    echo "Building libtapeplay..."
+    rm -rf build/libtapeplay
+    mkdir -p build/libtapeplay
+    for file in ${LIBTAPEPLAY_SOURCES}
+    do
+        gcc -c -O2 "${file}" -o "build/libtapeplay/$(basename "${file}" .c).o"
+    done
+    rm -f libtapeplay.a
+    ar rcs libtapeplay.a build/libtapeplay/*.o
+}
+
+
 build_vgm_convert ()
 {
-    gcc source/vgm_convert/vgm_convert.c \
-    source/vgm_convert/vgm_read.c \
-    -o vgm_convert -lz
+    # Early return if we've already got an up-to-date build
+    if [ -e vgm_convert -a libtapeplay.a -ot vgm_convert -a "./source/vgm_convert/main.c" -ot vgm_convert ]
+    then
+        return
+    fi
+
+    echo "Building vgm_convert..."
+    gcc source/vgm_convert/main.c libtapeplay.a -o vgm_convert -lz
 }
 
 
-build_vgm_tapeplay ()
+build_vgm_check ()
 {
-    echo "Building VGM-TapePlay for SC-3000 Tape..."
-    rm -rf build tile_data music_data
+    # Early return if we've already got an up-to-date build
+    if [ -e vgm_check -a libtapeplay.a -ot vgm_check -a "./source/vgm_check/main.c" -ot vgm_check ]
+    then
+        return
+    fi
 
-    echo "  Generating tile data..."
-    mkdir -p tile_data
-    $sneptile --mode-2 --output tile_data tiles/player.png
+    echo "Building vgm_check..."
+    gcc source/vgm_check/main.c libtapeplay.a -o vgm_check -lz
+}
 
-    echo "  Generating music data... (${INPUT_FILE})"
-    mkdir -p music_data
-    if [ "${PAL_MODE}" = "yes" ]
+
+build_vgm_inject ()
+{
+    # Early return if we've already got an up-to-date build
+    if [ -e vgm_inject -a libtapeplay.a -ot vgm_inject -a "./source/vgm_inject/main.c" -ot vgm_inject ]
     then
-        ./vgm_convert --pal "${INPUT_FILE}" > music_data/music.h
-    else
-        ./vgm_convert "${INPUT_FILE}" > music_data/music.h
+        return
     fi
 
-    mkdir -p build
-    echo "  Compiling..."
-    for file in main
-    do
-        echo "   -> ${file}.c"
-        ${sdcc} -c -mz80 -I ${SGlib}/src -o "build/${file}.rel" "source/${file}.c"
-    done
+    echo "Building vgm_inject..."
+    gcc source/vgm_inject/main.c libtapeplay.a -o vgm_inject -lz
+}
+
+
+# Single tool for converting VGM files into a ROM and tape .wav, for bulk conversion.
+build_tapeplay ()
+{
+    # Early return if we've already got an up-to-date build
+    if [ -e tapeplay -a libtapeplay.a -ot tapeplay -a "./source/tapeplay/main.c" -ot tapeplay ]
+    then
+        return
+    fi
+
+    echo "Building tapeplay..."
+    gcc source/tapeplay/main.c libtapeplay.a -o tapeplay -lz
+}
+
+
+# Generator for the player's frame handlers.
+build_frame_gen ()
+{
+    # Early return if we've already got an up-to-date build
+    if [ -e frame_gen -a "./source/frame_gen/main.c" -ot frame_gen ]
+    then
+        return
+    fi
+
+    echo "Building frame_gen..."
+    gcc source/frame_gen/main.c -o frame_gen
+}
+
+
+# Headless SG-1000 / SC-3000 for measuring the player.
+build_sg_bench ()
+{
+    # Early return if we've already got an up-to-date build
+    if [ -e sg_bench -a "./source/sg_bench/main.c" -ot sg_bench \
+         -a "./source/sg_bench/z80.c" -ot sg_bench -a "./source/sg_bench/z80.h" -ot sg_bench ]
+    then
+        return
+    fi
+
+    echo "Building sg_bench..."
+    gcc -O2 source/sg_bench/main.c source/sg_bench/z80.c -o sg_bench
+}
+
+
+# Check that the tape player's variables end before the RAM window, using
+# the symbols from the link. Music unpacked into the window at startup would
+# otherwise overwrite them. Each RAM area starts at s__<area> and is
+# l__<area> bytes long.
+check_tape_variables ()
+{
+    DATA_END=$(awk -v ram_start=32768 -v ram_limit=38912 '
+        function hex (text,    value, i)
+        {
+            value = 0
+            text = tolower (text)
+            sub (/^0x/, "", text)
+            for (i = 1; i <= length (text); i++)
+            {
+                value = value * 16 + index ("0123456789abcdef", substr (text, i, 1)) - 1
+            }
+            return value
+        }
+        $1 == "DEF" && $2 ~ /^s__/ { area_start [substr ($2, 4)] = hex($3) }
+        $1 == "DEF" && $2 ~ /^l__/ { area_length [substr ($2, 4)] = hex($3) }
+        END {
+            end = 0
+            for (area in area_start)
+            {
+                if (area_start [area] >= ram_start && area_start [area] < ram_limit &&
+                    area_start [area] + area_length [area] > end)
+                {
+                    end = area_start [area] + area_length [area]
+                }
+            }
+            print end
+        }' "${1}")
+
+    if [ "${DATA_END}" -eq 0 ]
+    then
+        echo "Error: Unable to find the tape player's variables in ${1}."
+        exit 1
+    fi
+
+    if [ "${DATA_END}" -gt $((${2})) ]
+    then
+        echo "Error: Tape player variables end at $(printf '0x%04x' "${DATA_END}"), past the RAM window at ${2}."
+        exit 1
+    fi
+}
+
+
+# Compile and link the ROM and tape players into the given directory.
+# Tile data and frame handlers must already have been generated. Any
+# extra compiler flags are given as the second parameter.
+compile_player ()
+{
+    OUTPUT_DIR="${1}"
+    EXTRA_FLAGS="${2}"
+    mkdir -p "${OUTPUT_DIR}"
 
     # Also generate an SG-1000 ROM for quick testing.
-    echo ""
+    # The music descriptor sits just below where a Sega header would, and
+    # music is placed between the end of the player and the descriptor.
+    # There is room in the cartridge for a frame handler per header
+    # value, which replaces the nibble-by-nibble decoder.
+    echo "  Compiling (ROM)..."
+    ${sdcc} -c -mz80 -I ${SGlib}/src -DMUSIC_DESCRIPTOR_ADDRESS=0x7fe0 -DMUSIC_LIMIT=0x7fe0 -DFRAME_HANDLERS ${EXTRA_FLAGS} \
+        -o "${OUTPUT_DIR}/main.rel" source/main.c
+
     echo "  Linking (ROM)..."
-    ${sdcc} -o build/VGM-TapePlay.ihx -mz80 --no-std-crt0 --data-loc 0xC000 ${devkitSMS}/crt0/crt0_sg.rel build/*.rel ${SGlib}/SGlib.rel
+    ${sdcc} -o "${OUTPUT_DIR}/VGM-TapePlay.ihx" -mz80 --no-std-crt0 --data-loc 0xC000 \
+        ${devkitSMS}/crt0/crt0_sg.rel "${OUTPUT_DIR}/main.rel" ${SGlib}/SGlib.rel
 
-    echo ""
-    echo "  Generating ROM..."
-    ${ihx2sms} build/VGM-TapePlay.ihx VGM-TapePlay.sg
+    # The banked ROM is the same, but for a cartridge with a Sega mapper.
+    # The header, track table, and frames are placed after the player, and
+    # the rest of the music in 16 KiB banks from 0x8000, which the player
+    # maps into the slot at 0x8000 as it reads them.
+    echo "  Compiling (banked ROM)..."
+    ${sdcc} -c -mz80 -I ${SGlib}/src -DMUSIC_DESCRIPTOR_ADDRESS=0x7fe0 -DMUSIC_LIMIT=0x7fe0 -DBANK_WINDOW=0x8000 \
+        -DFRAME_HANDLERS ${EXTRA_FLAGS} -o "${OUTPUT_DIR}/main-banked.rel" source/main.c
+
+    echo "  Linking (banked ROM)..."
+    ${sdcc} -o "${OUTPUT_DIR}/VGM-TapePlay-banked.ihx" -mz80 --no-std-crt0 --data-loc 0xC000 \
+        ${devkitSMS}/crt0/crt0_sg.rel "${OUTPUT_DIR}/main-banked.rel" ${SGlib}/SGlib.rel
 
 
     # Tape Memory layout:
     #
     #   0x0000 -- 0x7fff BASIC ROM
     #   0x8000 -- 0x97ff RAM, previously reserved for use by BASIC
+    #                      0x8000 -- 0x83ff Player variables, checked after linking
+    #                      0x8400 -- 0x97ff Music unpacked at startup
     #   0x9800 -- 0x989f Header area. Setup code at 0x9800, interrupt vector at 0x9898.
     #   0x98a0 -- 0xc800 Program storage. 12 kB for BASIC IIIa, or 26 kB for BASIC IIIb
     #
     # A special crt0 is used to handle the new addresses and set up interrupt-mode 2.
+    # The music descriptor takes the first 18 bytes of program storage, and music
+    # is placed after the end of the player. vgm_inject may pack the end of the
+    # music, for the player to unpack into the RAM that is not part of the image.
+    # The frame handlers are left out, as every byte of player is a byte less
+    # for music with BASIC IIIa.
+
+    echo "  Compiling (tape)..."
+    ${sdcc} -c -mz80 -I ${SGlib}/src -DMUSIC_DESCRIPTOR_ADDRESS=0x98a0 -DMUSIC_LIMIT=0xfc00 \
+        -DRAM_WINDOW_START=0x8400 -DRAM_WINDOW_LIMIT=0x9800 ${EXTRA_FLAGS} \
+        -o "${OUTPUT_DIR}/main-tape.rel" source/main.c
 
-    echo ""
     echo "  Linking (tape)..."
-    ${sdcc} -o build/VGM-TapePlay-tape.ihx -mz80 --no-std-crt0 --code-loc 0x98a0 --data-loc 0x8000 \
-        ${devkitSMS}/crt0/crt0_BASIC.rel build/*.rel ${SGlib}/SGlib.rel
+    ${sdcc} -o "${OUTPUT_DIR}/VGM-TapePlay-tape.ihx" -mz80 --no-std-crt0 --code-loc 0x98b2 --data-loc 0x8000 \
+        ${devkitSMS}/crt0/crt0_BASIC.rel "${OUTPUT_DIR}/main-tape.rel" ${SGlib}/SGlib.rel
+    check_tape_variables "${OUTPUT_DIR}/VGM-TapePlay-tape.noi" 0x8400
+}
+
+
+# The player is built once, without any music. vgm_inject then places the
+# music for each song into the built image. To convert songs without SDCC,
+# point VGM_TAPEPLAY_PLAYER at a directory containing a previous build of
+# VGM-TapePlay.ihx, VGM-TapePlay-banked.ihx, and VGM-TapePlay-tape.ihx.
+build_player ()
+{
+    # Early return if we've already got an up-to-date build
+    if [ -n "${VGM_TAPEPLAY_PLAYER}" ] || [ -e "${PLAYER_DIR}/VGM-TapePlay.ihx" \
+         -a -e "${PLAYER_DIR}/VGM-TapePlay-banked.ihx" \
+         -a -e "${PLAYER_DIR}/VGM-TapePlay-tape.ihx" \
+         -a "./source/main.c" -ot "${PLAYER_DIR}/VGM-TapePlay.ihx" \
+         -a "./frame_gen" -ot "${PLAYER_DIR}/VGM-TapePlay.ihx" \
+         -a "./tiles/player.png" -ot "${PLAYER_DIR}/VGM-TapePlay.ihx" ]
+    then
+        return
+    fi
+
+    echo "Building VGM-TapePlay player..."
+    rm -rf "${PLAYER_DIR}" tile_data decoder_data
+
+    TILE_KEY="tiles-$(cache_key "--mode-2" \
+        ./tools/Sneptile-0.4.0/source/*.c ./tools/Sneptile-0.4.0/source/*.h \
+        tiles/player.png)"
+
+    if [ -d "${CACHE_DIR}/${TILE_KEY}" ]
+    then
+        echo "  Using cached tile data..."
+        cp -r "${CACHE_DIR}/${TILE_KEY}" tile_data
+    else
+        echo "  Generating tile data..."
+        mkdir -p tile_data
+        $sneptile --mode-2 --output tile_data tiles/player.png
+        cache_store "${TILE_KEY}" tile_data
+    fi
+
+    echo "  Generating frame handlers..."
+    mkdir -p decoder_data
+    ./frame_gen decoder_data/frame_handlers.h
+
+    compile_player "${PLAYER_DIR}"
 
     echo ""
-    echo "  Generating Tape..."
-    objcopy -Iihex -Obinary build/VGM-TapePlay-tape.ihx build/VGM-TapePlay-tape.bin
-    ${tapewave} "VGM-TapePlay" build/VGM-TapePlay-tape.bin VGM-TapePlay.wav
+}
+
+
+build_vgm_tapeplay ()
+{
+    echo "Building VGM-TapePlay for SC-3000 Tape..."
+    rm -rf build/song music_data
+
+    CONVERT_OPTIONS=""
+    if [ "${PAL_MODE}" = "yes" ]
+    then
+        CONVERT_OPTIONS="${CONVERT_OPTIONS} --pal"
+    fi
+    if [ "${RAW_MODE}" = "yes" ]
+    then
+        CONVERT_OPTIONS="${CONVERT_OPTIONS} --raw"
+    fi
+    if [ "${CHECKPOINT_SECONDS}" != "0" ]
+    then
+        CONVERT_OPTIONS="${CONVERT_OPTIONS} --checkpoints ${CHECKPOINT_SECONDS}"
+    fi
+    if [ "${SUB_FRAMES}" != "1" ]
+    then
+        CONVERT_OPTIONS="${CONVERT_OPTIONS} --sub-frames ${SUB_FRAMES}"
+    fi
+    if [ "${STREAM_MODE}" = "yes" ]
+    then
+        CONVERT_OPTIONS="${CONVERT_OPTIONS} --stream"
+    fi
+    if [ "${BANKED_MODE}" = "yes" ]
+    then
+        CONVERT_OPTIONS="${CONVERT_OPTIONS} --banked"
+    fi
+
+    MUSIC_KEY="music-$(cache_key "pal=${PAL_MODE} raw=${RAW_MODE} checkpoints=${CHECKPOINT_SECONDS} sub-frames=${SUB_FRAMES} stream=${STREAM_MODE} banked=${BANKED_MODE}" \
+        ./source/vgm_convert/*.c ./source/vgm_convert/*.h \
+        ./source/vgm_check/*.c ./source/vgm_check/*.h \
+        "$@")"
+
+    if [ -d "${CACHE_DIR}/${MUSIC_KEY}" ]
+    then
+        echo "  Using cached music data... (${*})"
+        cp -r "${CACHE_DIR}/${MUSIC_KEY}" music_data
+    else
+        echo "  Generating music data... (${*})"
+        mkdir -p music_data
+        ./vgm_convert ${CONVERT_OPTIONS} --profile music_data/song_profile.h --output music_data/music.bin "$@"
+
+        echo "  Checking music data against the VGM files..."
+        ./vgm_check ${CONVERT_OPTIONS} music_data/music.bin "$@"
+        cache_store "${MUSIC_KEY}" music_data
+    fi
+
+    mkdir -p build/song
+
+    # A player built for this song leaves out the features it does not use,
+    # and a player built for profiling shows its time in the border
+    SONG_PLAYER_DIR="${PLAYER_DIR}"
+    SONG_PLAYER_FLAGS=""
+    HEADER_MASK="0xff"
+    if [ "${SPECIALISE}" = "yes" ]
+    then
+        SONG_PLAYER_FLAGS="${SONG_PLAYER_FLAGS} -DSONG_PROFILE"
+        HEADER_MASK="$(sed -n 's/^#define SONG_HEADER_MASK *//p' music_data/song_profile.h)"
+    fi
+    if [ "${RASTER_PROFILE}" = "yes" ]
+    then
+        SONG_PLAYER_FLAGS="${SONG_PLAYER_FLAGS} -DRASTER_PROFILE"
+    fi
+    if [ -n "${SONG_PLAYER_FLAGS}" ]
+    then
+        echo ""
+        echo "  Building a player for this song..."
+        if [ ! -d tile_data ]
+        then
+            echo "Error: tile_data is missing, remove ${PLAYER_DIR} to rebuild it."
+            exit 1
+        fi
+        rm -rf decoder_data
+        mkdir -p decoder_data
+        ./frame_gen --header-mask "${HEADER_MASK}" decoder_data/frame_handlers.h
+        compile_player build/song/player "${SONG_PLAYER_FLAGS}"
+        SONG_PLAYER_DIR="build/song/player"
+    fi
 
-    # Sanity-check the size
-    SIZE="$(wc -c build/VGM-TapePlay-tape.bin | cut -d ' ' -f 1)"
-    echo "    Size is ${SIZE} bytes."
-    if [ ${SIZE} -gt 26624 ]
+    echo ""
+    echo "  Generating ROM..."
+    if [ "${BANKED_MODE}" = "yes" ]
     then
-        echo "    WARNING: Cassette too large for BASIC IIIa or BASIC IIIb."
-    elif [ ${SIZE} -gt 12288 ]
+        ./vgm_inject --rom "${SONG_PLAYER_DIR}/VGM-TapePlay-banked.ihx" music_data/music.bin VGM-TapePlay.sg
+    else
+        ./vgm_inject --rom "${SONG_PLAYER_DIR}/VGM-TapePlay.ihx" music_data/music.bin VGM-TapePlay.sg
+    fi
+
+    # Music laid out for banks is only for cartridges
+    if [ "${BANKED_MODE}" = "no" ]
     then
-        echo "    WARNING: Cassette too large for BASIC IIIa. Okay for BASIC IIIb."
+        echo ""
+        echo "  Generating Tape..."
+        ./vgm_inject "${SONG_PLAYER_DIR}/VGM-TapePlay-tape.ihx" music_data/music.bin build/song/VGM-TapePlay-tape.bin
+        ${tapewave} "VGM-TapePlay" build/song/VGM-TapePlay-tape.bin VGM-TapePlay.wav
+
+        # Sanity-check the size
+        SIZE="$(wc -c build/song/VGM-TapePlay-tape.bin | cut -d ' ' -f 1)"
+        echo "    Size is ${SIZE} bytes."
+        if [ ${SIZE} -gt 26624 ]
+        then
+            echo "    WARNING: Cassette too large for BASIC IIIa or BASIC IIIb."
+        elif [ ${SIZE} -gt 12288 ]
+        then
+            echo "    WARNING: Cassette too large for BASIC IIIa. Okay for BASIC IIIb."
+        fi
     fi
 
     echo ""
@@ -137,19 +488,49 @@ build_vgm_tapeplay ()
 # Check parameters.
 if [ $# -eq 0 ]
 then
-    echo  "Usage: $0 [--pal] <input_file.vgm>"
+    echo  "Usage: $0 [--pal] [--raw] [--specialise] [--checkpoints <seconds>] [--sub-frames <n>] [--stream] [--banked] [--raster-profile] <input_file.vgm> [more_input_files.vgm ...]"
     exit
 fi
 
-if [ "${1}" = "--pal" ]
-then
-    PAL_MODE="yes"
+while [ "${1}" = "--pal" -o "${1}" = "--raw" -o "${1}" = "--specialise" -o "${1}" = "--checkpoints" -o "${1}" = "--sub-frames" -o "${1}" = "--stream" -o "${1}" = "--banked" -o "${1}" = "--raster-profile" ]
+do
+    if [ "${1}" = "--pal" ]
+    then
+        PAL_MODE="yes"
+    elif [ "${1}" = "--raw" ]
+    then
+        RAW_MODE="yes"
+    elif [ "${1}" = "--checkpoints" ]
+    then
+        CHECKPOINT_SECONDS="${2}"
+        shift
+    elif [ "${1}" = "--sub-frames" ]
+    then
+        SUB_FRAMES="${2}"
+        shift
+    elif [ "${1}" = "--stream" ]
+    then
+        STREAM_MODE="yes"
+    elif [ "${1}" = "--banked" ]
+    then
+        BANKED_MODE="yes"
+    elif [ "${1}" = "--raster-profile" ]
+    then
+        RASTER_PROFILE="yes"
+    else
+        SPECIALISE="yes"
+    fi
     shift
-fi
-
-INPUT_FILE="${1}"
+done
 
 build_sneptile
 build_tapewave
+build_libtapeplay
 build_vgm_convert
-build_vgm_tapeplay
+build_vgm_check
+build_vgm_inject
+build_tapeplay
+build_sg_bench
+build_frame_gen
+build_player
+build_vgm_tapeplay "$@"
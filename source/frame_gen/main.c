@@ -0,0 +1,172 @@
+/*
+ * frame_gen
+ *
+ * Generates the frame handlers used by the player when it is built with
+ * FRAME_HANDLERS defined. There is one handler for each of the 256 frame
+ * header values, containing only the reads and PSG writes that header
+ * needs. As the position of every nibble is known from the header, each
+ * value is read directly from the frame data, without nibble_read ().
+ *
+ * A frame with low-only tones has nibble positions that depend on the
+ * extension nibble, so these frames are passed on to frame_play ().
+ *
+ * For a player built for one song, --header-mask leaves out the handlers
+ * for headers with bits that the song never uses. Their table entries
+ * point at the empty frame's handler.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Must match the player */
+#define TONE_0_BIT      0x01
+#define EXTEND_BIT      0x08
+#define VOLUME_0_BIT    0x10
+
+
+/*
+ * Output an expression for the nibble at the given position.
+ * Nibbles are packed least-significant nibble first.
+ */
+static void print_nibble (FILE *output, uint8_t position)
+{
+    if (position & 1)
+    {
+        fprintf (output, "(data [%d] >> 4)", position >> 1);
+    }
+    else
+    {
+        fprintf (output, "(data [%d] & 0x0f)", position >> 1);
+    }
+}
+
+
+/*
+ * Output the handler for one frame header value.
+ */
+static void print_handler (FILE *output, uint8_t header)
+{
+    uint8_t position = 0;
+
+    fprintf (output, "static void frame_handler_%02x (const uint8_t *data)\n", header);
+    fprintf (output, "{\n");
+
+    if (header == 0)
+    {
+        fprintf (output, "    (void) data;\n");
+    }
+
+    if (header & EXTEND_BIT)
+    {
+        fprintf (output, "    uint8_t extend = data [0] & 0x0f;\n");
+        fprintf (output, "    if (extend & EXTEND_LOW_ONLY)\n");
+        fprintf (output, "    {\n");
+        fprintf (output, "        frame_play ();\n");
+        fprintf (output, "        return;\n");
+        fprintf (output, "    }\n");
+        fprintf (output, "    psg_write (0x80 | 0x60 | extend);\n");
+        position++;
+    }
+
+    for (uint8_t channel = 0; channel < 3; channel++)
+    {
+        if (header & (TONE_0_BIT << channel))
+        {
+            fprintf (output, "    psg_write (0x%02x | ", 0x80 | (channel << 5));
+            print_nibble (output, position++);
+            fprintf (output, ");\n");
+
+            /* The two high nibbles form the data byte. When they share
+             * a byte, the upper two bits of the high nibble are zero. */
+            if (position & 1)
+            {
+                fprintf (output, "    psg_write ((data [%d] >> 4) | (data [%d] << 4));\n",
+                         position >> 1, (position >> 1) + 1);
+            }
+            else
+            {
+                fprintf (output, "    psg_write (data [%d]);\n", position >> 1);
+            }
+            position += 2;
+        }
+    }
+
+    for (uint8_t channel = 0; channel < 4; channel++)
+    {
+        if (header & (VOLUME_0_BIT << channel))
+        {
+            fprintf (output, "    psg_write (0x%02x | ", 0x90 | (channel << 5));
+            print_nibble (output, position);
+            fprintf (output, ");\n");
+            fprintf (output, "    bar_update (%d, ", channel);
+            print_nibble (output, position++);
+            fprintf (output, ");\n");
+        }
+    }
+
+    fprintf (output, "}\n\n");
+}
+
+
+/*
+ * Entry point.
+ */
+int main (int argc, char **argv)
+{
+    FILE *output = NULL;
+    uint8_t header_mask = 0xff;
+
+    /* Skip the program name */
+    argc--;
+    argv++;
+
+    /* Option to only generate handlers for headers within a mask */
+    if (argc == 3 && strcmp (argv [0], "--header-mask") == 0)
+    {
+        header_mask = strtoul (argv [1], NULL, 0);
+        argc -= 2;
+        argv += 2;
+    }
+
+    if (argc != 1)
+    {
+        fprintf (stderr, "Usage: frame_gen [--header-mask <mask>] <frame_handlers.h>\n");
+        return EXIT_FAILURE;
+    }
+
+    output = fopen (argv [0], "w");
+    if (output == NULL)
+    {
+        fprintf (stderr, "Error: Unable to open %s for writing.\n", argv [0]);
+        return EXIT_FAILURE;
+    }
+
+    fprintf (output, "/*\n");
+    fprintf (output, " * Frame handlers for VGM-TapePlay, one per frame header value.\n");
+    fprintf (output, " * Generated by frame_gen, do not edit.\n");
+    fprintf (output, " */\n\n");
+
+    for (int header = 0; header < 256; header++)
+    {
+        if ((header & ~header_mask) == 0)
+        {
+            print_handler (output, header);
+        }
+    }
+
+    fprintf (output, "static void (*const frame_handlers [256]) (const uint8_t *data) = {\n");
+    for (int header = 0; header < 256; header++)
+    {
+        fprintf (output, "%sframe_handler_%02x%s", (header % 4 == 0) ? "    " : "",
+                 (header & ~header_mask) ? 0 : header,
+                 (header == 255) ? "\n" : (header % 4 == 3) ? ",\n" : ", ");
+    }
+    fprintf (output, "};\n");
+
+    fclose (output);
+
+    return EXIT_SUCCESS;
+}
@@ -6,25 +6,176 @@
  */
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #include "SGlib.h"
 __sfr __at 0x7f psg_port;
 __sfr __at 0xbf vdp_control_port;
 
+/* SC-3000 PPI, used for the keyboard and joypads */
+__sfr __at 0xdc ppi_port_a;
+__sfr __at 0xdd ppi_port_b;
+__sfr __at 0xde ppi_port_c;
+__sfr __at 0xdf ppi_control_port;
+
 #define TONE_0_BIT      0x01
 #define TONE_1_BIT      0x02
 #define TONE_2_BIT      0x04
-#define NOISE_BIT       0x08
+#define EXTEND_BIT      0x08
 #define VOLUME_0_BIT    0x10
 #define VOLUME_1_BIT    0x20
 #define VOLUME_2_BIT    0x40
 #define VOLUME_3_BIT    0x80
 
+#define EXTEND_LOW_ONLY 0x08
+
+/* Frames are stored as ready-to-send PSG bytes */
+#define MUSIC_FLAG_RAW  0x01
+
+/* Ticks are 1/50s, rather than 1/60s */
+#define MUSIC_FLAG_PAL  0x02
+
+/* Two bits of flags hold the number of sub-frame slots, less one */
+#define MUSIC_SLOTS_SHIFT   2
+
+/* Each track's indexes are packed into a stream, unpacked during playback */
+#define MUSIC_FLAG_STREAM   0x10
+
+/* A player built for a single song includes the profile written by
+ * vgm_convert --profile, and leaves out anything the song does not use.
+ * The generic player includes everything. */
+#ifdef SONG_PROFILE
+#include "../music_data/song_profile.h"
+#else
+#define SONG_TRACK_COUNT    8
+#define SONG_RAW_FRAMES     1
+#define SONG_NIBBLE_FRAMES  1
+#define SONG_USES_TONE_0    1
+#define SONG_USES_TONE_1    1
+#define SONG_USES_TONE_2    1
+#define SONG_USES_NOISE     1
+#define SONG_USES_VOLUME_0  1
+#define SONG_USES_VOLUME_1  1
+#define SONG_USES_VOLUME_2  1
+#define SONG_USES_VOLUME_3  1
+#define SONG_USES_LOW_ONLY  1
+#define SONG_CHECKPOINTS    1
+#define SONG_SAMPLES        1
+#define SONG_STREAM         1
+#endif
+
+/* Input is only needed to change track, or to seek */
+#define PLAYER_INPUT    (SONG_TRACK_COUNT > 1 || SONG_CHECKPOINTS)
+
+/* Indexes with these frame-index bits set are long rests */
+#define REST_INDEX_MASK 0x0fc0
+
+/* Indexes with these frame-index bits trigger a sample, numbered by the
+ * low six bits. They take no time, and are followed by the tick's frame. */
+#define SAMPLE_INDEX    0x0f80
+
+#define JOYPAD_UP       0x01
+#define JOYPAD_DOWN     0x02
+#define JOYPAD_LEFT     0x04
+#define JOYPAD_RIGHT    0x08
+
+/* Position of a track within index_data. With streamed indexes, start and
+ * loop_outer are the offsets of the packed indexes before the loop point
+ * and of the packed loop, and end and loop_inner are their lengths. */
+typedef struct track_info_s
+{
+    uint16_t start;
+    uint16_t end;
+    uint16_t loop_outer;
+    uint16_t loop_inner;
+    uint16_t loop_segment_end;
+} track_info;
+
+/* Header of the music blob generated by vgm_convert */
+typedef struct music_header_s
+{
+    uint8_t track_count;
+    uint8_t flags;
+    uint16_t frame_data;        /* Offset from the start of the blob */
+    uint16_t index_data;        /* Offset from the start of the blob */
+    uint16_t checkpoint_data;   /* Offset from the start of the blob, or zero if there are none */
+    uint16_t sample_data;       /* Offset from the start of the blob, or zero if there are none */
+} music_header;
+
+/* State of the player after a number of ticks, to seek to */
+typedef struct checkpoint_s
+{
+    uint16_t outer_index;
+    uint16_t inner_index;
+    uint16_t segment_end;
+    uint16_t delay;
+    uint16_t tone [3];
+    uint8_t noise;
+    uint8_t volume [2];         /* Two volumes per byte, low nibble first */
+} checkpoint;
+
+/* Block of 4-bit samples to be written to one volume register in turn,
+ * two per byte, low nibble first. The sample data follows the header. */
+typedef struct sample_header_s
+{
+    uint8_t latch;              /* Volume register latch, 0x90 | channel << 5 */
+    uint8_t period;             /* Delay loops between samples */
+    uint16_t length;            /* Bytes of sample data */
+} sample_header;
+
+/* Descriptor used by vgm_inject to find where the music blob should go.
+ * The player is built once for each target, and vgm_inject appends the
+ * blob to the built image and writes its address into the descriptor.
+ * Where there is RAM outside of the loaded image, vgm_inject may pack the
+ * end of the blob, for the player to unpack into that RAM when it starts.
+ * On a banked cartridge, vgm_inject instead places the blob from its index
+ * data onwards in the ROM banks that follow the image. */
+typedef struct music_descriptor_s
+{
+    uint8_t magic [6];
+    uint16_t music;             /* Address of the music blob */
+    uint16_t music_limit;       /* First address past the space for music */
+    uint16_t ram_window;        /* RAM that the blob can be unpacked into, or zero if none */
+    uint16_t ram_window_limit;  /* First address past that RAM */
+    uint16_t unpack_offset;     /* Offset of the packed end of the blob, or zero if none */
+    uint16_t bank_window;       /* Slot that ROM banks of music are mapped into, or zero if none */
+} music_descriptor;
+
+#ifndef MUSIC_DESCRIPTOR_ADDRESS
+#define MUSIC_DESCRIPTOR_ADDRESS    0x7fe0
+#endif
+#ifndef MUSIC_LIMIT
+#define MUSIC_LIMIT                 0x7fe0
+#endif
+#ifndef RAM_WINDOW_START
+#define RAM_WINDOW_START            0x0000
+#define RAM_WINDOW_LIMIT            0x0000
+#endif
+#ifndef BANK_WINDOW
+#define BANK_WINDOW                 0x0000
+#endif
+
+volatile const music_descriptor __at (MUSIC_DESCRIPTOR_ADDRESS) descriptor = {
+    { 'V', 'G', 'M', 'T', 'P', 5 }, 0x0000, MUSIC_LIMIT, RAM_WINDOW_START, RAM_WINDOW_LIMIT, 0x0000, BANK_WINDOW
+};
+
+#if BANK_WINDOW
+/* Sega mapper register for the 16 KiB slot at 0x8000. The banked part of
+ * the blob starts in the bank that belongs at that address, and carries on
+ * into the banks that follow. On a console with 1 KiB of RAM, writes to
+ * the register also land in the RAM mirror at 0xc3ff. */
+#define BANK_SHIFT  14
+#define BANK_SIZE   (1 << BANK_SHIFT)
+#define BANK_FIRST  (BANK_WINDOW >> BANK_SHIFT)
+volatile uint8_t __at (0xffff) mapper_slot_2;
+static uint8_t bank_mapped = BANK_FIRST;
+static uint16_t bank_offset = 0xffff;       /* Blob offsets from here on are in the banks */
+#endif
+
 #include "../tile_data/pattern.h"
 #include "../tile_data/pattern_index.h"
 #include "../tile_data/colour_table.h"
-#include "../music_data/music.h"
 
 static const uint8_t underline [16] = {
     PATTERN_PLAYER + 1, PATTERN_PLAYER + 1, PATTERN_PLAYER + 1, PATTERN_PLAYER + 1,
@@ -44,21 +195,304 @@ static const uint8_t bar_red_1   [2] = { PATTERN_PLAYER +  8, PATTERN_PLAYER +
 static const uint8_t bar_red_2   [2] = { PATTERN_PLAYER +  9, PATTERN_PLAYER +  9 };
 static const uint8_t bar_red_3   [2] = { PATTERN_PLAYER + 10, PATTERN_PLAYER + 10 };
 
+/* Music data, found through the descriptor */
+static const uint8_t *frame_data;
+static const uint16_t *index_data;
+static const track_info *track_table;
+static uint8_t track_count = 0;
+static bool raw_frames = false;
+static bool stream_mode = false;
+#if RAM_WINDOW_START
+static uint16_t unpack_offset = 0xffff;     /* Blob offsets from here on are in the RAM window */
+#endif
+
+static const track_info *track;
+static uint8_t track_number = 0;
+
 static uint16_t outer_index = 0; /* Index into the compressed index_data */
 static uint16_t inner_index = 0; /* Index when expanding references into index_data */
+static uint16_t segment_end = 0; /* End of the segment being expanded */
 static uint16_t frame_index = 0; /* Index into frame data */
+static uint16_t delay = 0;       /* Frames remaining until the next frame is read */
+
+#if SONG_CHECKPOINTS
+static uint16_t checkpoint_interval = 0;            /* Ticks between checkpoints, or zero if there are none */
+static uint16_t checkpoint_tables;                  /* Offset of the table of each track's checkpoints */
+static uint16_t checkpoint_list = 0;                /* Offset of the count and checkpoints for the current track */
+static uint16_t track_position = 0;                 /* Ticks since the start of the track */
+#endif
+
+#if SONG_STREAM
+/* Streamed indexes are unpacked into a ring, which is also the window for
+ * the LZ matches. Each tick unpacks a few bytes ahead of the reader. Longer
+ * repeats are copied from the packed streams, which start at index_data. */
+#define STREAM_FILL_BYTES   6
+#define STREAM_AHEAD        64
+static uint8_t stream_ring [256];
+static uint8_t ring_write = 0;
+static uint8_t ring_read = 0;
+/* Position within the packed streams. On a banked cartridge, its bank
+ * is mapped in for each read, and it moves on to the start of the next
+ * bank when it reaches the end of the bank window. */
+typedef struct stream_cursor_s
+{
+    const uint8_t *address;
+#if BANK_WINDOW
+    uint8_t bank;
+#endif
+} stream_cursor;
+
+static uint16_t stream_base;        /* Offset of the packed streams within the blob */
+static stream_cursor stream_in;     /* Next byte of packed data */
+static uint16_t stream_left;        /* Bytes still to be unpacked */
+static uint16_t stream_words;       /* Indexes still to be read */
+static uint8_t lz_literals = 0;     /* Literal bytes left in the current token */
+static uint8_t lz_match = 0;        /* Match bytes left in the current token */
+static uint8_t lz_distance;
+static stream_cursor lz_copy;       /* Source of a copy, with a NULL address for a match from the ring */
+#endif
+
+#if SONG_SAMPLES
+static uint16_t sample_table;                       /* Offset of the table of each sample's offset */
+static uint16_t sample_next = 0;                    /* Offset of the sample to start when the decoded slots are sent */
+static const uint8_t *sample_data;                  /* Next byte of the sample playing */
+#if BANK_WINDOW
+static uint8_t sample_bank;                         /* Bank holding the sample playing */
+#endif
+static uint16_t sample_remaining = 0;               /* Bytes left of the sample playing */
+static uint8_t sample_latch;
+static uint8_t sample_period;
+static uint8_t sample_vblank;                       /* sample_play () returned at the start of vblank */
+static uint8_t sample_last;                         /* Last value of a sample that is cut short */
+#endif
+
+/* Frame interrupts that arrive while the previous one is still decoding */
+static bool playback_busy = false;
+static volatile uint8_t frames_missed = 0;
+uint16_t frame_overruns = 0;     /* Not static, so that sg_bench can report it */
+
+/* Tick and vblank rates, in units of 10 Hz. When music converted for one
+ * region plays on the other, part of a tick is carried between vblanks. */
+static uint8_t tick_rate = 6;
+static uint8_t vblank_rate = 6;
+static uint8_t tick_credit = 0;
+
+/* Cycles in one frame, at 228 cycles per line */
+#define FRAME_CYCLES_NTSC   (262 * 228UL)
+#define FRAME_CYCLES_PAL    (313 * 228UL)
+
+/* Loops of frame_loops () in one frame are 1757 for NTSC, and 2099
+ * for PAL, at 34 cycles per loop. Midway between: */
+#define FRAME_LOOPS_PAL 1928
+
+#ifdef RASTER_PROFILE
+/* Backdrop colours, showing in the border what the frame interrupt is doing */
+#define RASTER_COLOUR_IDLE      1   /* Black */
+#define RASTER_COLOUR_PSG       4   /* Dark blue, sending PSG bytes or a sample */
+#define RASTER_COLOUR_METERS    12  /* Dark green, copying the meter rows to VRAM */
+#define RASTER_COLOUR_DECODE    6   /* Dark red, decoding the next ticks */
+
+/* Loops of raster_idle_loops () in one frame, at 25 cycles per loop */
+#define RASTER_LOOPS_NTSC   (FRAME_CYCLES_NTSC / 25)
+#define RASTER_LOOPS_PAL    (FRAME_CYCLES_PAL / 25)
+
+/* The worst frame is drawn as a bar of up to 32 tiles for a whole frame.
+ * The first 8 tiles for NTSC, or 12 for PAL, are the 70 or 121 lines of
+ * the frame after the display, and are drawn in green. */
+#define RASTER_BAR_Y                21
+#define RASTER_VBLANK_COLUMNS_NTSC  8
+#define RASTER_VBLANK_COLUMNS_PAL   12
+
+static volatile uint8_t raster_frames = 0;  /* Frame interrupts so far */
+static uint8_t raster_frame_seen = 0;       /* Value of raster_frames when the main loop last looked */
+static uint16_t raster_frame_loops = RASTER_LOOPS_NTSC;
+static uint8_t raster_vblank_columns = RASTER_VBLANK_COLUMNS_NTSC;
+static uint16_t raster_worst = 0;           /* Loops taken by the busiest frame so far */
+static bool raster_skip = true;             /* Leave out the next measurement */
+#endif
+
+/* Input state, only needed to change track */
+#if PLAYER_INPUT
+static bool keyboard_present = false;
+static uint8_t joypad_previous = 0;
+static uint8_t key_previous = 0;
+#endif
 
 /* Flag for 'is the next nibble to the high nibble of its byte?' */
 static bool nibble_high = false;
 
+/* RAM copy of the meters' part of the name table, from (9, 7) to (24, 14).
+ * The columns between the rows of meters are always blank, and are kept so
+ * that the dirty rows can be written to VRAM in one burst at the start of
+ * vblank, with a single address set-up. */
+#define METER_X         9
+#define METER_Y         7
+#define METER_ROWS      8
+static uint8_t meter_shadow [(METER_ROWS - 1) * 32 + 16] = { 0 };
+static uint8_t meter_dirty_first = METER_ROWS;
+static uint8_t meter_dirty_last = 0;
+
+/* PSG bytes decoded ahead of the next frame interrupt, with a buffer for
+ * each sub-frame slot. The largest frame writes 11 bytes, and the reset at
+ * the start of a track writes 12. */
+#define PSG_BUFFER_SIZE 12
+#define SLOT_COUNT_MAX  4
+static uint8_t psg_buffer [SLOT_COUNT_MAX][PSG_BUFFER_SIZE];
+static uint8_t *psg_queue = psg_buffer [0];     /* Buffer being decoded into */
+
+/* Bytes for psg_write_block (). These are either in psg_buffer, or for a
+ * raw frame, in the frame data itself. */
+static const uint8_t *psg_block = psg_buffer [0];
+static uint8_t psg_block_size = 0;
+
+/* Music converted with sub-frame slots has several ticks in each frame.
+ * The first is sent at the start of vblank, and the rest at even points
+ * through the frame, timed by busy-waiting. */
+static const uint8_t *slot_block [SLOT_COUNT_MAX];
+static uint8_t slot_block_size [SLOT_COUNT_MAX];
+static uint8_t slots_decoded = 0;   /* Slots ready for the next frame interrupt */
+static uint8_t slot_count = 1;      /* Ticks in each frame */
+static uint16_t slot_cycles = 0;    /* Time from one slot to the next */
+static uint16_t slot_wait_loops = 0;
+
+/* Estimated Z80 cycles taken between sending one slot and the next, to be
+ * left out of the busy-wait. These match the converter's cost model. */
+#define CYCLES_SLOT         250     /* Calling slot_wait () and slot_send () */
+#define CYCLES_PSG_BYTE     21      /* One byte sent with otir */
+#define CYCLES_METER_FLUSH  300     /* Setting up SG_loadTileMap () in meter_flush () */
+#define CYCLES_METER_BYTE   26      /* One byte of the meter shadow sent to VRAM */
+
 
 /*
- * Write one byte of data to the sn76489.
+ * Queue one byte of data for the sn76489, to be sent
+ * with its slot at the next frame interrupt.
  */
 inline void psg_write (uint8_t data)
 {
-    psg_port = data;
+    psg_queue [psg_block_size++] = data;
+}
+
+
+/*
+ * Write psg_block_size bytes from psg_block to the sn76489, using otir.
+ * The PSG holds the Z80 in a wait state until it is ready for each byte.
+ * psg_block_size must not be zero.
+ */
+static void psg_write_block (void) __naked
+{
+    __asm
+        ld  hl, (_psg_block)
+        ld  a, (_psg_block_size)
+        ld  b, a
+        ld  c, #0x7f
+        otir
+        ret
+    __endasm;
+}
+
+
+/*
+ * Busy-wait for slot_wait_loops loops of 32 cycles.
+ */
+static void slot_wait_loop (void) __naked
+{
+    __asm
+        ld  hl, (_slot_wait_loops)
+    1$:
+        dec hl              ; 6 cycles
+        ld  a, h            ; 4 cycles
+        or  l               ; 4 cycles
+        nop                 ; 4 cycles
+        nop                 ; 4 cycles
+        jp  nz, 1$          ; 10 cycles
+        ret
+    __endasm;
+}
+
+
+/*
+ * Wait until the next slot is due, given the cycles
+ * already taken since the previous slot was sent.
+ */
+static void slot_wait (uint16_t taken)
+{
+    if (taken < slot_cycles)
+    {
+        slot_wait_loops = (slot_cycles - taken) >> 5;
+        if (slot_wait_loops)
+        {
+            slot_wait_loop ();
+        }
+    }
+}
+
+
+/*
+ * Start queueing PSG bytes into the next free slot.
+ */
+static void slot_open (void)
+{
+    psg_queue = psg_buffer [slots_decoded];
+    psg_block = psg_queue;
+    psg_block_size = 0;
+}
+
+
+/*
+ * Keep the bytes queued since slot_open (), to be sent with the slot.
+ */
+static void slot_close (void)
+{
+    slot_block [slots_decoded] = psg_block;
+    slot_block_size [slots_decoded] = psg_block_size;
+    slots_decoded++;
+}
+
+
+/*
+ * Send the bytes of one slot to the PSG.
+ */
+static void slot_send (uint8_t slot)
+{
+    psg_block = slot_block [slot];
+    psg_block_size = slot_block_size [slot];
+
+    if (psg_block_size)
+    {
+        psg_write_block ();
+    }
+}
+
+
+/*
+ * Send every decoded slot straight away, back to back.
+ */
+static void slots_send (void)
+{
+    for (uint8_t slot = 0; slot < slots_decoded; slot++)
+    {
+        slot_send (slot);
+    }
+    slots_decoded = 0;
+}
+
+
+#ifdef RASTER_PROFILE
+/*
+ * Set the backdrop colour, which fills the border. The two bytes are
+ * written with interrupts disabled, as the status read in the interrupt
+ * would reset the VDP's register latch between them. Unlike
+ * SG_setBackdropColor (), the interrupt state is restored rather than
+ * enabled, so that a sample's critical section is not broken.
+ */
+static void raster_colour (uint8_t colour) __critical
+{
+    vdp_control_port = colour;
+    vdp_control_port = 0x87;
 }
+#else
+#define raster_colour(colour)
+#endif
 
 
 /*
@@ -75,6 +509,47 @@ void clear_screen (void)
 }
 
 
+/*
+ * Set the two tiles of one row of a meter, in the RAM copy.
+ */
+static void meter_row_set (uint8_t column, uint8_t row, const uint8_t *tiles)
+{
+    uint8_t *shadow = &meter_shadow [(row << 5) + column];
+
+    shadow [0] = tiles [0];
+    shadow [1] = tiles [1];
+
+    if (row < meter_dirty_first)
+    {
+        meter_dirty_first = row;
+    }
+    if (row > meter_dirty_last)
+    {
+        meter_dirty_last = row;
+    }
+}
+
+
+/*
+ * Copy the changed rows of the meters to VRAM.
+ * Returns the number of bytes written.
+ */
+static uint8_t meter_flush (void)
+{
+    uint8_t size = 0;
+
+    if (meter_dirty_first <= meter_dirty_last)
+    {
+        size = ((meter_dirty_last - meter_dirty_first) << 5) + 16;
+        SG_loadTileMap (METER_X, METER_Y + meter_dirty_first, &meter_shadow [meter_dirty_first << 5], size);
+        meter_dirty_first = METER_ROWS;
+        meter_dirty_last = 0;
+    }
+
+    return size;
+}
+
+
 /*
  * Update a bar graph.
  *
@@ -84,7 +559,7 @@ void clear_screen (void)
 static void bar_update (uint8_t bar, uint8_t value)
 {
     static uint8_t previous [4] = { 15, 15, 15, 15 };
-    uint8_t x = 9 + (bar << 2);
+    uint8_t column = bar << 2;
 
     /* Range of tiles that need to be updated */
     uint8_t first = (((value < previous [bar]) ? value : previous [bar]) + 1) >> 1;
@@ -94,42 +569,42 @@ static void bar_update (uint8_t bar, uint8_t value)
     switch (first)
     {
         case 0:
-            SG_loadTileMap (x, 7, (value == 0) ? bar_red_3 : bar_black, 2);
+            meter_row_set (column, 0, (value == 0) ? bar_red_3 : bar_black);
             if (last == 0) break;
         case 1:
-            SG_loadTileMap (x, 8, (value < 1) ? bar_red_2 :
-                                  (value < 2) ? bar_red_1 :
-                                  (value < 3) ? bar_amber_3 : bar_black, 2);
+            meter_row_set (column, 1, (value < 1) ? bar_red_2 :
+                                      (value < 2) ? bar_red_1 :
+                                      (value < 3) ? bar_amber_3 : bar_black);
             if (last == 1) break;
         case 2:
-            SG_loadTileMap (x, 9, (value < 3) ? bar_amber_2 :
-                                  (value < 4) ? bar_amber_1 :
-                                  (value < 5) ? bar_green_1 : bar_black, 2);
+            meter_row_set (column, 2, (value < 3) ? bar_amber_2 :
+                                      (value < 4) ? bar_amber_1 :
+                                      (value < 5) ? bar_green_1 : bar_black);
             if (last == 2) break;
         case 3:
-            SG_loadTileMap (x, 10, (value < 5) ? bar_green_3 :
-                                   (value < 6) ? bar_green_2 :
-                                   (value < 7) ? bar_green_1 : bar_black, 2);
+            meter_row_set (column, 3, (value < 5) ? bar_green_3 :
+                                      (value < 6) ? bar_green_2 :
+                                      (value < 7) ? bar_green_1 : bar_black);
             if (last == 3) break;
         case 4:
-            SG_loadTileMap (x, 11, (value < 7) ? bar_green_3 :
-                                   (value < 8) ? bar_green_2 :
-                                   (value < 9) ? bar_green_1 : bar_black, 2);
+            meter_row_set (column, 4, (value < 7) ? bar_green_3 :
+                                      (value < 8) ? bar_green_2 :
+                                      (value < 9) ? bar_green_1 : bar_black);
             if (last == 4) break;
         case 5:
-            SG_loadTileMap (x, 12, (value < 9)  ? bar_green_3 :
-                                   (value < 10) ? bar_green_2 :
-                                   (value < 11) ? bar_green_1 : bar_black, 2);
+            meter_row_set (column, 5, (value < 9)  ? bar_green_3 :
+                                      (value < 10) ? bar_green_2 :
+                                      (value < 11) ? bar_green_1 : bar_black);
             if (last == 5) break;
         case 6:
-            SG_loadTileMap (x, 13, (value < 11) ? bar_green_3 :
-                                   (value < 12) ? bar_green_2 :
-                                   (value < 13) ? bar_green_1 : bar_black, 2);
+            meter_row_set (column, 6, (value < 11) ? bar_green_3 :
+                                      (value < 12) ? bar_green_2 :
+                                      (value < 13) ? bar_green_1 : bar_black);
             if (last == 6) break;
         case 7:
-            SG_loadTileMap (x, 14, (value < 13) ? bar_green_3 :
-                                   (value < 14) ? bar_green_2 :
-                                   (value < 15) ? bar_green_1 : bar_black, 2);
+            meter_row_set (column, 7, (value < 13) ? bar_green_3 :
+                                      (value < 14) ? bar_green_2 :
+                                      (value < 15) ? bar_green_1 : bar_black);
         case 8:
             break;
     }
@@ -138,6 +613,7 @@ static void bar_update (uint8_t bar, uint8_t value)
 }
 
 
+#if SONG_NIBBLE_FRAMES
 /*
  * Read the next nibble from the frame data.
  */
@@ -170,152 +646,1304 @@ static void nibble_done (void)
 
 
 /*
- * Called every 1/60s to apply the next set of register writes.
+ * Apply a nibble-packed frame, rebuilding each PSG byte from its nibbles.
  */
-static void tick (void)
+static void frame_play (void)
 {
-    static uint8_t delay = 0;
-    static uint16_t segment_end = 0;
+    uint8_t frame;
+    uint8_t low_only;
+    uint8_t data;
 
-    /* Read and process the next frame */
-    if (delay == 0)
-    {
-        uint16_t element;
-        uint8_t frame;
-        uint8_t data;
+    /* Read the frame header from the frame_data */
+    frame = frame_data[frame_index++];
 
-        /* If we are not already processing a segment of referenced
-         * data, read a new element from the compressed index_data */
-        if (inner_index == segment_end)
+    /* The extension nibble holds either a new noise value,
+     * or flags for tones that only update their low nibble. */
+    low_only = 0;
+#if SONG_USES_NOISE || SONG_USES_LOW_ONLY
+    if (frame & EXTEND_BIT)
+    {
+        data = nibble_read ();
+#if SONG_USES_LOW_ONLY
+        if (data & EXTEND_LOW_ONLY)
         {
-            element = index_data[outer_index++];
-
-            if (element & 0x8000)
-            {
-                /* Segment */
-                inner_index = element & 0x0fff;
-                segment_end = inner_index + ((element >> 12) & 0x0007) + 2;
-            }
-            else
-            {
-                /* Single index */
-                inner_index = outer_index - 1;
-                segment_end = outer_index;
-            }
+            low_only = data;
         }
+        else
+#endif
+        {
+            psg_write (0x80 | 0x60 | data);
+        }
+    }
+#endif
 
-        /* Read the delay and frame_index from the index_data */
-        frame_index = index_data[inner_index++];
-        delay = ((frame_index >> 12) & 0x0007) + 1;
-        frame_index &= 0x0fff;
-
-        /* Read the frame header from the frame_data */
-        frame = frame_data[frame_index++];
+#if SONG_USES_TONE_0
+    if (frame & TONE_0_BIT)
+    {
+        data = nibble_read ();
+        psg_write (0x80 | 0x00 | data);
 
-        if (frame & TONE_0_BIT)
+        if (!(low_only & TONE_0_BIT))
         {
-            data = nibble_read ();
-            psg_write (0x80 | 0x00 | data);
-
             data = nibble_read ();
             data |= nibble_read () << 4;
             psg_write (data);
         }
-        if (frame & TONE_1_BIT)
-        {
-            data = nibble_read ();
-            psg_write (0x80 | 0x20 | data);
+    }
+#endif
+#if SONG_USES_TONE_1
+    if (frame & TONE_1_BIT)
+    {
+        data = nibble_read ();
+        psg_write (0x80 | 0x20 | data);
 
+        if (!(low_only & TONE_1_BIT))
+        {
             data = nibble_read ();
             data |= nibble_read () << 4;
             psg_write (data);
         }
-        if (frame & TONE_2_BIT)
-        {
-            data = nibble_read ();
-            psg_write (0x80 | 0x40 | data);
+    }
+#endif
+#if SONG_USES_TONE_2
+    if (frame & TONE_2_BIT)
+    {
+        data = nibble_read ();
+        psg_write (0x80 | 0x40 | data);
 
+        if (!(low_only & TONE_2_BIT))
+        {
             data = nibble_read ();
             data |= nibble_read () << 4;
             psg_write (data);
         }
-        if (frame & NOISE_BIT)
-        {
-            data = nibble_read ();
-            psg_write (0x80 | 0x60 | data);
-        }
-        if (frame & VOLUME_0_BIT)
-        {
-            data = nibble_read ();
-            psg_write (0x80 | 0x10 | data);
-            bar_update (0, data);
-        }
-        if (frame & VOLUME_1_BIT)
+    }
+#endif
+#if SONG_USES_VOLUME_0
+    if (frame & VOLUME_0_BIT)
+    {
+        data = nibble_read ();
+        psg_write (0x80 | 0x10 | data);
+        bar_update (0, data);
+    }
+#endif
+#if SONG_USES_VOLUME_1
+    if (frame & VOLUME_1_BIT)
+    {
+        data = nibble_read ();
+        psg_write (0x80 | 0x30 | data);
+        bar_update (1, data);
+    }
+#endif
+#if SONG_USES_VOLUME_2
+    if (frame & VOLUME_2_BIT)
+    {
+        data = nibble_read ();
+        psg_write (0x80 | 0x50 | data);
+        bar_update (2, data);
+    }
+#endif
+#if SONG_USES_VOLUME_3
+    if (frame & VOLUME_3_BIT)
+    {
+        data = nibble_read ();
+        psg_write (0x80 | 0x70 | data);
+        bar_update (3, data);
+    }
+#endif
+
+    nibble_done ();
+}
+
+
+#ifdef FRAME_HANDLERS
+/* Handlers for each frame header value, generated by frame_gen */
+#include "../decoder_data/frame_handlers.h"
+#endif
+
+
+/*
+ * Apply a nibble-packed frame, using the frame handlers if they are built in.
+ */
+inline void frame_play_nibbles (void)
+{
+#ifdef FRAME_HANDLERS
+    frame_handlers [frame_data [frame_index]] (&frame_data [frame_index + 1]);
+#else
+    frame_play ();
+#endif
+}
+#endif /* SONG_NIBBLE_FRAMES */
+
+
+#if SONG_RAW_FRAMES
+/*
+ * Apply a raw frame. Its bytes are sent to the PSG straight from the
+ * frame data, so psg_block is pointed at them rather than copied.
+ *
+ * The header holds the byte count and which volumes are written.
+ * The volume bytes come last, so the meters are updated from the
+ * end of the frame.
+ */
+static void frame_play_raw (void)
+{
+    uint8_t frame = frame_data [frame_index++];
+    const uint8_t *volume;
+
+    psg_block = &frame_data [frame_index];
+    psg_block_size = frame & 0x0f;
+
+    volume = psg_block + psg_block_size;
+    for (int8_t bar = 3; bar >= 0; bar--)
+    {
+        if (frame & (VOLUME_0_BIT << bar))
         {
-            data = nibble_read ();
-            psg_write (0x80 | 0x30 | data);
-            bar_update (1, data);
+            bar_update (bar, *--volume & 0x0f);
         }
-        if (frame & VOLUME_2_BIT)
+    }
+}
+#endif
+
+
+#if RAM_WINDOW_START
+/*
+ * Unpack the end of the blob, which vgm_inject has packed, into the
+ * RAM window. The packed data starts with its unpacked size.
+ *
+ * Tokens 0x00-0x7f are followed by token + 1 literal bytes. Tokens
+ * 0x80-0xff copy (token & 0x7f) + 4 bytes from the distance given
+ * by the next two bytes, back from the output position.
+ */
+static void music_unpack (const uint8_t *packed, uint8_t *output)
+{
+    const uint8_t *output_end = output + (packed [0] | (packed [1] << 8));
+
+    packed += 2;
+
+    while (output != output_end)
+    {
+        uint8_t token = *packed++;
+
+        if (token & 0x80)
         {
-            data = nibble_read ();
-            psg_write (0x80 | 0x50 | data);
-            bar_update (2, data);
+            const uint8_t *source = output - (packed [0] | (packed [1] << 8));
+            uint8_t count = (token & 0x7f) + 4;
+
+            packed += 2;
+            while (count--)
+            {
+                *output++ = *source++;
+            }
         }
-        if (frame & VOLUME_3_BIT)
+        else
         {
-            data = nibble_read ();
-            psg_write (0x80 | 0x70 | data);
-            bar_update (3, data);
-        }
+            uint8_t count = token + 1;
 
-        nibble_done ();
+            while (count--)
+            {
+                *output++ = *packed++;
+            }
+        }
     }
+}
+#endif
+
 
-    /* Check for end of data and loop */
-    if (outer_index == END_FRAME_INDEX)
+#if BANK_WINDOW
+/*
+ * Map a ROM bank into the bank window, if it is not already there.
+ */
+static void bank_map (uint8_t bank)
+{
+    if (bank != bank_mapped)
     {
-        outer_index = LOOP_FRAME_INDEX_OUTER;
-        inner_index = LOOP_FRAME_INDEX_INNER;
-        segment_end = LOOP_FRAME_SEGMENT_END;
+        mapper_slot_2 = bank;
+        bank_mapped = bank;
     }
+}
+#endif
 
-    /* Decrement the delay counter */
-    if (delay > 0)
+
+/*
+ * Find the address of an offset within the music blob.
+ *
+ * On a banked cartridge, an offset in the banked part of the blob has its
+ * bank mapped in, and the address is only valid until another is mapped.
+ */
+static const uint8_t *music_address (uint16_t offset)
+{
+#if RAM_WINDOW_START
+    if (offset >= unpack_offset)
     {
-        delay--;
+        return (const uint8_t *) descriptor.ram_window + (offset - unpack_offset);
     }
+#endif
+#if BANK_WINDOW
+    if (offset >= bank_offset)
+    {
+        offset -= bank_offset;
+        bank_map (BANK_FIRST + (offset >> BANK_SHIFT));
+        return (const uint8_t *) BANK_WINDOW + (offset & (BANK_SIZE - 1));
+    }
+#endif
+
+    return (const uint8_t *) descriptor.music + offset;
 }
 
 
+#if SONG_STREAM
 /*
- * Entry point.
+ * Point a cursor at an offset within the blob.
  */
-int main (void)
+static void stream_seek (stream_cursor *cursor, uint16_t offset)
 {
-    /* Default PSG register values */
-    psg_write (0x80 | 0x1f); /* Mute Tone0 */
-    psg_write (0x80 | 0x3f); /* Mute Tone1 */
-    psg_write (0x80 | 0x5f); /* Mute Tone2 */
-    psg_write (0x80 | 0x7f); /* Mute Noise */
+    cursor->address = music_address (offset);
+#if BANK_WINDOW
+    cursor->bank = bank_mapped;
+#endif
+}
 
-    /* Load tiles for all three screen-slices */
-    for (uint16_t slice = 0x000; slice < 0x300; slice += 0x100)
+
+/*
+ * Read the next byte through a cursor.
+ */
+static inline uint8_t stream_read (stream_cursor *cursor)
+{
+#if BANK_WINDOW
+    uint8_t data;
+
+    bank_map (cursor->bank);
+    data = *cursor->address++;
+    if (cursor->address == (const uint8_t *) (BANK_WINDOW + BANK_SIZE))
     {
-        SG_loadTilePatterns (patterns, slice, sizeof (patterns));
-        SG_loadTileColours (colour_table, slice, sizeof (colour_table));
+        cursor->address = (const uint8_t *) BANK_WINDOW;
+        cursor->bank++;
     }
-    SG_setBackdropColor (1); /* Black */
 
-    /* Set up the display */
-    clear_screen ();
-    SG_loadTileMap (8, 16, underline, sizeof (underline));
+    return data;
+#else
+    return *cursor->address++;
+#endif
+}
+
+
+/*
+ * Unpack one byte of the index stream into the ring.
+ *
+ * Tokens 0x00-0x7f are followed by token + 1 literal bytes. Tokens
+ * 0x80-0xbf copy (token & 0x3f) + 3 bytes from the distance given by
+ * the next byte, back from the write position. Tokens 0xc0-0xff copy
+ * (token & 0x3f) + 4 bytes from the packed streams, at the offset given
+ * by the next two bytes.
+ */
+static void stream_unpack (void)
+{
+    uint8_t data;
+
+    if (lz_literals == 0 && lz_match == 0)
+    {
+        uint8_t token = stream_read (&stream_in);
+
+        if (token >= 0xc0)
+        {
+            uint16_t offset = stream_read (&stream_in);
+
+            offset |= stream_read (&stream_in) << 8;
+            lz_match = (token & 0x3f) + 4;
+            stream_seek (&lz_copy, stream_base + offset);
+        }
+        else if (token & 0x80)
+        {
+            lz_match = (token & 0x3f) + 3;
+            lz_distance = stream_read (&stream_in);
+            lz_copy.address = NULL;
+        }
+        else
+        {
+            lz_literals = token + 1;
+        }
+    }
+
+    if (lz_literals)
+    {
+        data = stream_read (&stream_in);
+        lz_literals--;
+    }
+    else if (lz_copy.address)
+    {
+        data = stream_read (&lz_copy);
+        lz_match--;
+    }
+    else
+    {
+        data = stream_ring [(uint8_t) (ring_write - lz_distance)];
+        lz_match--;
+    }
+
+    stream_ring [ring_write++] = data;
+    stream_left--;
+}
+
+
+/*
+ * Unpack a few bytes ahead of the reader, once each tick.
+ */
+static void stream_fill (void)
+{
+    for (uint8_t i = 0; i < STREAM_FILL_BYTES && stream_left &&
+                        (uint8_t) (ring_write - ring_read) < STREAM_AHEAD; i++)
+    {
+        stream_unpack ();
+    }
+}
+
+
+/*
+ * Read the next index from the ring, unpacking it now if
+ * stream_fill () has not kept ahead.
+ */
+static uint16_t stream_word (void)
+{
+    uint16_t word;
+
+    while ((uint8_t) (ring_write - ring_read) < 2)
+    {
+        stream_unpack ();
+    }
+
+    word = stream_ring [ring_read++];
+    word |= stream_ring [ring_read++] << 8;
+    stream_words--;
+
+    return word;
+}
+
+
+/*
+ * Start unpacking the current track's indexes, from the
+ * start of the track or from its loop point.
+ */
+static void stream_open (bool loop)
+{
+    /* Nothing before the loop point */
+    if (track->end == 0)
+    {
+        loop = true;
+    }
+
+    stream_seek (&stream_in, loop ? track->loop_outer : track->start);
+    stream_words = loop ? track->loop_inner : track->end;
+    stream_left = stream_words << 1;
+    lz_literals = 0;
+    lz_match = 0;
+    ring_read = ring_write;
+}
+#endif
+
+
+/*
+ * Read one entry of index_data. On a banked cartridge, the index data
+ * starts a bank, so an entry never spans two banks.
+ */
+static inline uint16_t index_read (uint16_t index)
+{
+#if BANK_WINDOW
+    bank_map (BANK_FIRST + (index >> (BANK_SHIFT - 1)));
+    return ((const uint16_t *) BANK_WINDOW) [index & (BANK_SIZE / 2 - 1)];
+#else
+    return index_data [index];
+#endif
+}
+
+
+/*
+ * Read the next entry of index_data, expanding references to segments.
+ */
+static uint16_t index_next (void)
+{
+    uint16_t element;
+
+#if SONG_STREAM
+    if (stream_mode)
+    {
+        return stream_word ();
+    }
+#endif
+
+    /* If we are not already processing a segment of referenced
+     * data, read a new element from the compressed index_data */
+    if (inner_index == segment_end)
+    {
+        element = index_read (outer_index++);
+
+        if (element & 0x8000)
+        {
+            /* Segment */
+            inner_index = element & 0x0fff;
+            segment_end = inner_index + ((element >> 12) & 0x0007) + 2;
+        }
+        else
+        {
+            /* Single index */
+            inner_index = outer_index - 1;
+            segment_end = outer_index;
+        }
+    }
+
+    return index_read (inner_index++);
+}
+
+
+/*
+ * Called for each tick, from the frame interrupt, to decode the next set of
+ * register writes. These are sent with their slot at the following frame
+ * interrupt, so the time taken to decode does not delay them.
+ *
+ * Not static, so that sg_bench can find it in the symbol table.
+ */
+void tick (void)
+{
+    /* Read and process the next frame */
+    if (delay == 0)
+    {
+        /* Read the delay and frame_index from the index_data */
+        frame_index = index_next ();
+#if SONG_SAMPLES
+        while ((frame_index & REST_INDEX_MASK) == SAMPLE_INDEX)
+        {
+            sample_next = ((const uint16_t *) music_address (sample_table)) [frame_index & 0x003f];
+            frame_index = index_next ();
+        }
+#endif
+        if ((frame_index & REST_INDEX_MASK) == REST_INDEX_MASK)
+        {
+            /* Long rest, nine bits of length. Play the empty frame. */
+            delay = (((frame_index >> 6) & 0x01c0) | (frame_index & 0x003f)) + 1;
+            frame_index = 0;
+        }
+        else
+        {
+            delay = ((frame_index >> 12) & 0x0007) + 1;
+            frame_index &= 0x0fff;
+        }
+
+#if SONG_RAW_FRAMES && SONG_NIBBLE_FRAMES
+        if (raw_frames)
+        {
+            frame_play_raw ();
+        }
+        else
+        {
+            frame_play_nibbles ();
+        }
+#elif SONG_RAW_FRAMES
+        frame_play_raw ();
+#else
+        frame_play_nibbles ();
+#endif
+    }
+
+    /* Check for end of data and loop, once the final segment has been played */
+    if (stream_mode)
+    {
+#if SONG_STREAM
+        if (stream_words == 0)
+        {
+            stream_open (true);
+        }
+        stream_fill ();
+#endif
+    }
+    else if (outer_index == track->end && inner_index == segment_end)
+    {
+        outer_index = track->loop_outer;
+        inner_index = track->loop_inner;
+        segment_end = track->loop_segment_end;
+    }
+
+    /* Decrement the delay counter */
+    if (delay > 0)
+    {
+        delay--;
+    }
+
+#if SONG_CHECKPOINTS
+    track_position++;
+#endif
+}
+
+
+/*
+ * Decode the next tick into a free slot. If every slot for the
+ * coming frame is already full, as when catching up or seeking,
+ * they are sent first.
+ */
+static void slot_decode (void)
+{
+    if (slots_decoded == slot_count)
+    {
+        slots_send ();
+    }
+
+    slot_open ();
+    tick ();
+    slot_close ();
+}
+
+
+/*
+ * Show which track is playing, as a row of markers under the bars.
+ */
+static void track_markers_update (void)
+{
+    for (uint8_t i = 0; i < track_count; i++)
+    {
+        SG_loadTileMap (8 + (i << 1), 18, (i == track_number) ? bar_green_3 : underline, 1);
+    }
+}
+
+
+/*
+ * Locate the music data within the blob that vgm_inject has placed.
+ */
+static void music_init (void)
+{
+    const music_header *header = (const music_header *) descriptor.music;
+
+#if BANK_WINDOW
+    /* On a banked cartridge, the blob is in the banks from the index data on */
+    bank_offset = header->index_data;
+    mapper_slot_2 = BANK_FIRST;
+#endif
+
+#if RAM_WINDOW_START
+    /* On tape, the end of the blob may be packed, to unpack into the RAM
+     * that BASIC used, which is not part of the loaded image */
+    if (descriptor.unpack_offset)
+    {
+        music_unpack (music_address (descriptor.unpack_offset), (uint8_t *) descriptor.ram_window);
+        unpack_offset = descriptor.unpack_offset;
+    }
+#endif
+
+    track_count = header->track_count;
+    raw_frames = header->flags & MUSIC_FLAG_RAW;
+    stream_mode = header->flags & MUSIC_FLAG_STREAM;
+    slot_count = ((header->flags >> MUSIC_SLOTS_SHIFT) & 0x03) + 1;
+    tick_rate = ((header->flags & MUSIC_FLAG_PAL) ? 5 : 6) * slot_count;
+    slot_cycles = ((vblank_rate == 5) ? FRAME_CYCLES_PAL : FRAME_CYCLES_NTSC) / slot_count;
+    frame_data = music_address (header->frame_data);
+    index_data = (const uint16_t *) music_address (header->index_data);
+    track_table = (const track_info *) music_address (sizeof (music_header));
+
+#if SONG_CHECKPOINTS
+    if (header->checkpoint_data)
+    {
+        checkpoint_interval = *(const uint16_t *) music_address (header->checkpoint_data);
+        checkpoint_tables = header->checkpoint_data + 2;
+    }
+#endif
+#if SONG_SAMPLES
+    sample_table = header->sample_data;
+#endif
+#if SONG_STREAM
+    stream_base = header->index_data;
+#endif
+}
+
+
+/*
+ * Start playback of a track from its beginning.
+ *
+ * Runs with interrupts disabled, so that tick () never sees a half-started
+ * track, and so that the frame interrupt does not use the VDP while the
+ * track markers are being drawn.
+ */
+static void track_start (uint8_t number) __critical
+{
+    track_number = number;
+    track = &track_table [number];
+
+    outer_index = track->start;
+    inner_index = 0;
+    segment_end = 0;
+    delay = 0;
+    nibble_high = false;
+
+#if SONG_SAMPLES
+    sample_next = 0;
+    sample_remaining = 0;
+#endif
+
+#if SONG_STREAM
+    if (stream_mode)
+    {
+        stream_open (false);
+    }
+#endif
+
+#if SONG_CHECKPOINTS
+    track_position = 0;
+    if (checkpoint_interval)
+    {
+        checkpoint_list = ((const uint16_t *) music_address (checkpoint_tables)) [number];
+    }
+#endif
+
+    /* Discard any writes decoded from the previous track */
+    slots_decoded = 0;
+    slot_open ();
+
+    /* Set the register values the converter assumes at the start of a track */
+    psg_write (0x80 | 0x00); psg_write (0x00); /* Tone0 */
+    psg_write (0x80 | 0x20); psg_write (0x00); /* Tone1 */
+    psg_write (0x80 | 0x40); psg_write (0x00); /* Tone2 */
+    psg_write (0x80 | 0x60);                   /* Noise */
+    psg_write (0x80 | 0x1f); /* Mute Tone0 */
+    psg_write (0x80 | 0x3f); /* Mute Tone1 */
+    psg_write (0x80 | 0x5f); /* Mute Tone2 */
+    psg_write (0x80 | 0x7f); /* Mute Noise */
+    slot_close ();
+
+    for (uint8_t bar = 0; bar < 4; bar++)
+    {
+        bar_update (bar, 15);
+    }
+
+    track_markers_update ();
+}
+
+
+#if SONG_CHECKPOINTS
+/*
+ * Seek to a position within the current track, in ticks from its start.
+ *
+ * Playback jumps to the last checkpoint at or before the position, by
+ * writing its registers and taking on its place in the index data, and
+ * then plays the remaining ticks without waiting for vblank.
+ */
+static void track_seek (uint16_t position) __critical
+{
+    const uint8_t *list;
+    uint16_t number;
+
+    if (checkpoint_list == 0)
+    {
+        return;
+    }
+
+    list = music_address (checkpoint_list);
+    number = position / checkpoint_interval;
+    if (number > list [0])
+    {
+        number = list [0];
+    }
+
+    if (number == 0)
+    {
+        track_start (track_number);
+    }
+    else
+    {
+        const checkpoint *point = &((const checkpoint *) (list + 1)) [number - 1];
+
+        outer_index = point->outer_index;
+        inner_index = point->inner_index;
+        segment_end = point->segment_end;
+        delay = point->delay;
+        track_position = number * checkpoint_interval;
+#if SONG_SAMPLES
+        sample_next = 0;
+        sample_remaining = 0;
+#endif
+
+        /* Discard any writes decoded from before the seek */
+        slots_decoded = 0;
+        slot_open ();
+
+        for (uint8_t channel = 0; channel < 3; channel++)
+        {
+            psg_write (0x80 | (channel << 5) | (point->tone [channel] & 0x0f));
+            psg_write (point->tone [channel] >> 4);
+        }
+        psg_write (0x80 | 0x60 | point->noise);
+
+        for (uint8_t channel = 0; channel < 4; channel++)
+        {
+            uint8_t volume = (channel & 1) ? (point->volume [channel >> 1] >> 4)
+                                           : (point->volume [channel >> 1] & 0x0f);
+            psg_write (0x80 | 0x10 | (channel << 5) | volume);
+            bar_update (channel, volume);
+        }
+        slot_close ();
+    }
+
+    /* Play up to the position */
+    while (track_position < position)
+    {
+        slot_decode ();
+    }
+}
+
+
+/*
+ * Skip to the next checkpoint, or back to the one before the current
+ * position. Skipping on from the last checkpoint returns to the start.
+ */
+static void checkpoint_skip (bool forwards) __critical
+{
+    uint16_t number;
+
+    if (checkpoint_list == 0)
+    {
+        return;
+    }
+
+    if (forwards)
+    {
+        number = track_position / checkpoint_interval + 1;
+        if (number > music_address (checkpoint_list) [0])
+        {
+            number = 0;
+        }
+    }
+    else
+    {
+        number = (track_position > 0) ? (track_position - 1) / checkpoint_interval : 0;
+    }
+
+    track_seek (number * checkpoint_interval);
+}
+#endif
+
+
+#if PLAYER_INPUT
+/*
+ * Detect the SC-3000 keyboard.
+ *
+ * On the SC-3000, the PPI's port-C holds the keyboard row that was
+ * written to it. On the SG-1000, reading port 0xde instead returns
+ * the state of the first joypad, with released buttons reading as 1.
+ */
+static bool keyboard_detect (void)
+{
+    ppi_control_port = 0x92; /* Ports A and B as inputs, port C as output */
+    ppi_port_c = 0x05;
+
+    return (ppi_port_c & 0x07) == 0x05;
+}
+
+
+/*
+ * Poll the joypad and the number keys, and change track when requested.
+ *
+ * Left / right on the joypad step through the tracks.
+ * On the SC-3000, keys 1 to 8 select a track directly.
+ * Up / down skip between the checkpoints within a track.
+ */
+static void input_update (void)
+{
+    uint8_t joypad;
+    uint8_t key = 0;
+
+    /* The joypads are on keyboard row 7. On the SG-1000 the row is ignored. */
+    ppi_port_c = 0x07;
+    joypad = ~ppi_port_a;
+
+    if (keyboard_present)
+    {
+        /* Keys 1 to 7 are in column 0 of port A for rows 0 to 6,
+         * key 8 is in column 0 of port B for row 0. */
+        for (uint8_t row = 0; row < 7; row++)
+        {
+            ppi_port_c = row;
+            if (!(ppi_port_a & 0x01))
+            {
+                key = row + 1;
+            }
+        }
+        ppi_port_c = 0x00;
+        if (!(ppi_port_b & 0x01))
+        {
+            key = 8;
+        }
+    }
+
+    /* Only act on newly pressed inputs */
+    if (key != 0 && key != key_previous && key <= track_count)
+    {
+        track_start (key - 1);
+    }
+    else if ((joypad & ~joypad_previous) & JOYPAD_RIGHT)
+    {
+        track_start ((track_number + 1 < track_count) ? track_number + 1 : 0);
+    }
+    else if ((joypad & ~joypad_previous) & JOYPAD_LEFT)
+    {
+        track_start ((track_number > 0) ? track_number - 1 : track_count - 1);
+    }
+#if SONG_CHECKPOINTS
+    else if ((joypad & ~joypad_previous) & JOYPAD_UP)
+    {
+        checkpoint_skip (true);
+    }
+    else if ((joypad & ~joypad_previous) & JOYPAD_DOWN)
+    {
+        checkpoint_skip (false);
+    }
+#endif
+
+    joypad_previous = joypad;
+    key_previous = key;
+}
+#endif
+
+
+/*
+ * Count loops of 34 cycles through one frame, polling the VDP status
+ * register with interrupts disabled. The count is returned in both DE
+ * and HL, to suit either sdcc calling convention.
+ */
+static uint16_t frame_loops (void) __naked
+{
+    __asm
+        di
+        ld  c, #0xbf
+        in  a, (c)          ; Clear any frame flag already set
+    1$:
+        in  a, (c)          ; Wait for the start of a frame
+        rlca
+        jr  nc, 1$
+        ld  de, #0
+    2$:
+        inc de              ; 6 cycles
+        in  a, (c)          ; 12 cycles
+        rlca                ; 4 cycles
+        jr  nc, 2$          ; 12 cycles
+        ld  h, d
+        ld  l, e
+        ei
+        ret
+    __endasm;
+}
+
+
+/*
+ * Measure the vblank rate, to tell a PAL console from an NTSC console.
+ *
+ * The TMS9918 can fail to report the frame flag if it is set just as
+ * the status is read, making a frame look twice as long, so the
+ * shortest of a few measurements is used.
+ */
+static bool pal_detect (void)
+{
+    uint16_t loops = 0xffff;
+
+    for (uint8_t i = 0; i < 3; i++)
+    {
+        uint16_t measured = frame_loops ();
+
+        if (measured < loops)
+        {
+            loops = measured;
+        }
+    }
+
+    return loops > FRAME_LOOPS_PAL;
+}
+
+
+/*
+ * Take one of the frames that were missed while decoding.
+ * Once there are none left, playback is no longer busy.
+ */
+static bool missed_frame_take (void) __critical
+{
+    if (frames_missed)
+    {
+        frames_missed--;
+        return true;
+    }
+
+    playback_busy = false;
+    return false;
+}
+
+
+#if SONG_SAMPLES
+/*
+ * Write the active sample to its volume register, one nibble at a time,
+ * until it ends or the VDP frame flag is seen. Must be called with
+ * interrupts disabled. Reading the status register clears the flag, so
+ * the vblank is reported in sample_vblank rather than by an interrupt.
+ *
+ * The rate is fixed by the delay loops: 103 + 13 * period cycles from a
+ * low nibble to its high nibble, and 100 + 13 * period cycles from a high
+ * nibble to the next low nibble. The converter chooses the period from
+ * these counts, so any change here must be made there too.
+ */
+static void sample_play (void) __naked
+{
+    __asm
+        ld  hl, (_sample_data)
+        ld  de, (_sample_remaining)
+        ld  a, (_sample_latch)
+        ld  c, a
+    1$:
+        ld  a, (hl)                 ; 7 cycles
+        and a, #0x0f                ; 7 cycles
+        or  a, c                    ; 4 cycles
+        out (#0x7f), a              ; 11 cycles, low nibble
+        ld  a, (_sample_period)     ; 13 cycles
+        add a, #3                   ; 7 cycles
+        ld  b, a                    ; 4 cycles
+    2$:
+        djnz 2$                     ; 13 cycles, 8 on the last loop
+        ld  a, (hl)                 ; 7 cycles
+        rrca                        ; 4 cycles
+        rrca                        ; 4 cycles
+        rrca                        ; 4 cycles
+        rrca                        ; 4 cycles
+        and a, #0x0f                ; 7 cycles
+        or  a, c                    ; 4 cycles
+        out (#0x7f), a              ; 11 cycles, high nibble
+        inc hl                      ; 6 cycles
+        dec de                      ; 6 cycles
+        in  a, (#0xbf)              ; 11 cycles
+        rlca                        ; 4 cycles
+        jr  c, 4$                   ; 7 cycles
+        ld  a, d                    ; 4 cycles
+        or  a, e                    ; 4 cycles
+        jr  z, 4$                   ; 7 cycles
+        ld  a, (_sample_period)     ; 13 cycles
+        ld  b, a                    ; 4 cycles
+    3$:
+        djnz 3$                     ; 13 cycles, 8 on the last loop
+        jp  1$                      ; 10 cycles
+    4$:
+        ld  (_sample_data), hl
+        ld  (_sample_remaining), de
+        ld  a, #0                   ; Carry is set if the frame flag was seen
+        rla
+        ld  (_sample_vblank), a
+        ret
+    __endasm;
+}
+
+
+/*
+ * Make the sample triggered by the slots just sent the active sample.
+ * A sample that is still playing is cut short, leaving its last value
+ * in its register, as the converter expects once it has ended.
+ */
+static void sample_start (void)
+{
+    const sample_header *next;
+
+    if (sample_remaining)
+    {
+#if BANK_WINDOW
+        bank_map (sample_bank);
+#endif
+        sample_last = sample_latch | (sample_data [sample_remaining - 1] >> 4);
+        psg_block = &sample_last;
+        psg_block_size = 1;
+        psg_write_block ();
+    }
+
+    next = (const sample_header *) music_address (sample_next);
+#if BANK_WINDOW
+    sample_bank = bank_mapped;
+#endif
+    sample_latch = next->latch;
+    sample_period = next->period;
+    sample_remaining = next->length;
+    sample_data = (const uint8_t *) (next + 1);
+    sample_next = 0;
+}
+#endif
+
+
+/*
+ * Decode the ticks due for one vblank.
+ *
+ * This is one tick for each slot when the music was converted for the
+ * console's region. Otherwise, 50 Hz music on a 60 Hz console has one
+ * slot fewer every sixth vblank, and 60 Hz music on a 50 Hz console has
+ * one tick more every fifth vblank, sent as soon as it is decoded.
+ */
+static void vblank_ticks (void)
+{
+    raster_colour (RASTER_COLOUR_DECODE);
+
+    tick_credit += tick_rate;
+
+    while (tick_credit >= vblank_rate)
+    {
+        tick_credit -= vblank_rate;
+        slot_decode ();
+    }
+}
+
+
+/*
+ * Send the slots decoded for this frame. The first is sent at the start of
+ * vblank, followed by the meter rows. The rest are sent at even points
+ * through the frame, each after a busy-wait that leaves out the estimated
+ * time taken since the previous slot.
+ */
+static void slots_play (void)
+{
+    uint16_t taken;
+
+    raster_colour (RASTER_COLOUR_PSG);
+
+    if (slots_decoded)
+    {
+        slot_send (0);
+    }
+
+#if SONG_SAMPLES
+    /* While a sample plays, the meters are left alone and any
+     * other slots are sent straight away, to keep the gap short */
+    if (sample_next)
+    {
+        sample_start ();
+    }
+    if (sample_remaining)
+    {
+        for (uint8_t slot = 1; slot < slots_decoded; slot++)
+        {
+            slot_send (slot);
+        }
+        slots_decoded = 0;
+        return;
+    }
+#endif
+
+    raster_colour (RASTER_COLOUR_METERS);
+    taken = CYCLES_METER_FLUSH + meter_flush () * CYCLES_METER_BYTE;
+
+    for (uint8_t slot = 1; slot < slots_decoded; slot++)
+    {
+        raster_colour (RASTER_COLOUR_IDLE);
+        slot_wait (taken + CYCLES_SLOT + slot_block_size [slot - 1] * CYCLES_PSG_BYTE);
+        raster_colour (RASTER_COLOUR_PSG);
+        slot_send (slot);
+        taken = 0;
+    }
+
+    slots_decoded = 0;
+}
+
+
+#if SONG_SAMPLES
+/*
+ * Play the active sample through to its end, with interrupts disabled.
+ * Each time sample_play () stops at the start of vblank, the frame's slots
+ * are sent and the next ticks decoded, as the frame interrupt would do, and
+ * the sample carries on. The main loop and the meters wait until it ends.
+ */
+static void sample_run (void) __critical
+{
+    while (sample_remaining)
+    {
+#if BANK_WINDOW
+        /* Decoding the ticks may have mapped in another bank */
+        bank_map (sample_bank);
+#endif
+        raster_colour (RASTER_COLOUR_PSG);
+        sample_play ();
+
+        if (sample_vblank)
+        {
+            slots_play ();
+            vblank_ticks ();
+        }
+    }
+}
+#endif
+
+
+/*
+ * Frame interrupt handler, called by SGlib at the start of each vblank.
+ *
+ * The music is stepped here, rather than in the main loop, so that the
+ * PSG writes are made at the same point after vblank on every frame, no
+ * matter what the main loop is doing. The PSG bytes and meter rows for
+ * this frame were prepared by the previous calls to tick (), so they are
+ * sent first, before decoding the next frame.
+ *
+ * Interrupts are enabled again while decoding. If decoding runs past the
+ * next vblank, that interrupt only counts the missed frame. The missed
+ * frames are then caught up back to back, sending their PSG bytes as soon
+ * as they are decoded, so that the tempo stays locked to the vblank rate.
+ * Their meter rows are left in the shadow, to be drawn at the next vblank.
+ *
+ * A sample started by this frame's slots is played from here, after the
+ * next ticks are decoded, and keeps the interrupt until it ends.
+ */
+static void frame_interrupt (void)
+{
+#ifdef RASTER_PROFILE
+    raster_frames++;
+#endif
+
+    if (playback_busy)
+    {
+        frames_missed++;
+        frame_overruns++;
+        return;
+    }
+    playback_busy = true;
+
+    slots_play ();
+
+    __asm
+        ei
+    __endasm;
+
+    vblank_ticks ();
+
+#if SONG_SAMPLES
+    if (sample_remaining)
+    {
+        sample_run ();
+    }
+#endif
+
+    while (missed_frame_take ())
+    {
+        vblank_ticks ();
+    }
+
+    raster_colour (RASTER_COLOUR_IDLE);
+}
+
+
+#ifdef RASTER_PROFILE
+/*
+ * Count loops of 25 cycles until the next frame interrupt, as the main
+ * loop's way of waiting for vblank. The time not counted was taken by the
+ * frame interrupt and the rest of the main loop. The count is returned in
+ * both DE and HL, to suit either sdcc calling convention.
+ */
+static uint16_t raster_idle_loops (void) __naked
+{
+    __asm
+        ld  hl, #_raster_frames
+        ld  a, (_raster_frame_seen)
+        ld  de, #0
+    1$:
+        inc de              ; 6 cycles
+        cp  (hl)            ; 7 cycles
+        jr  z, 1$           ; 12 cycles
+        ld  h, d
+        ld  l, e
+        ret
+    __endasm;
+}
+
+
+/*
+ * Draw the busiest frame so far as a bar across the screen, in green for
+ * the part of the frame after the display and in red beyond it. This runs
+ * with interrupts disabled, as meter_flush () in the interrupt would move
+ * the VDP address part way through the row.
+ */
+static void raster_bar_draw (void) __critical
+{
+    uint8_t row [32];
+    uint8_t columns = raster_worst / (raster_frame_loops >> 5);
+
+    for (uint8_t column = 0; column < 32; column++)
+    {
+        row [column] = (column >= columns) ? 0 :
+                       (column < raster_vblank_columns) ? bar_green_3 [0] : bar_red_3 [0];
+    }
+
+    SG_loadTileMap (0, RASTER_BAR_Y, row, sizeof (row));
+}
+
+
+/*
+ * Wait for the next frame interrupt, and update the busiest frame from the
+ * loops counted while waiting. If more than one interrupt has passed, the
+ * previous one ran past the next vblank, and took the whole frame.
+ */
+static void raster_wait (void)
+{
+    uint16_t idle = raster_idle_loops ();
+    uint8_t frames = raster_frames;
+    uint16_t busy = raster_frame_loops;
+
+    if ((uint8_t) (frames - raster_frame_seen) == 1 && idle < raster_frame_loops)
+    {
+        busy = raster_frame_loops - idle;
+    }
+    raster_frame_seen = frames;
+
+    /* Starting up, and drawing the bar, are not part of playback */
+    if (raster_skip)
+    {
+        raster_skip = false;
+    }
+    else if (busy > raster_worst)
+    {
+        raster_worst = busy;
+        raster_bar_draw ();
+        raster_skip = true;
+    }
+}
+#endif
+
+
+/*
+ * Entry point.
+ */
+int main (void)
+{
+#if PLAYER_INPUT
+    keyboard_present = keyboard_detect ();
+#endif
+    vblank_rate = pal_detect () ? 5 : 6;
+    music_init ();
+#ifdef RASTER_PROFILE
+    if (vblank_rate == 5)
+    {
+        raster_frame_loops = RASTER_LOOPS_PAL;
+        raster_vblank_columns = RASTER_VBLANK_COLUMNS_PAL;
+    }
+#endif
+
+    /* Load tiles for all three screen-slices */
+    for (uint16_t slice = 0x000; slice < 0x300; slice += 0x100)
+    {
+        SG_loadTilePatterns (patterns, slice, sizeof (patterns));
+        SG_loadTileColours (colour_table, slice, sizeof (colour_table));
+    }
+    SG_setBackdropColor (1); /* Black */
+
+    /* Set up the display */
+    clear_screen ();
+    SG_loadTileMap (8, 16, underline, sizeof (underline));
+
+    track_start (0);
 
+    SG_setFrameInterruptHandler (frame_interrupt);
     SG_displayOn ();
 
+    /* Playback runs from the frame interrupt, leaving
+     * the main loop free for everything else */
     while (true)
     {
+#ifdef RASTER_PROFILE
+        raster_wait ();
+#else
         SG_waitForVBlank ();
-        tick ();
+#endif
+#if PLAYER_INPUT
+        input_update ();
+#endif
     }
 }
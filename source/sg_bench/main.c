@@ -0,0 +1,551 @@
+/*
+ * sg_bench
+ *
+ * Headless SG-1000 / SC-3000 for benchmarking the player.
+ *
+ * Runs a built ROM or tape image with a Z80 core, a minimal
+ * TMS9918 and a PSG that only records writes, and reports the
+ * cycles taken by each call to tick (), the VRAM bytes written
+ * each frame, and the stream of PSG writes.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "z80.h"
+
+#define MEMORY_SIZE         65536
+#define ROM_SIZE_MAX        0xc000
+#define CARTRIDGE_SIZE_MAX  0x100000    /* Larger cartridges use a Sega mapper */
+#define BANK_SIZE           0x4000
+#define TAPE_ADDRESS        0x9800
+#define TAPE_STACK          0xfff0
+
+#define CYCLES_PER_LINE     228
+#define LINES_NTSC          262
+#define LINES_PAL           313
+#define VBLANK_LINE         192
+
+#define VDP_STATUS_FRAME    0x80
+#define VDP_REG1_IE         0x20
+#define VDP_REG1_BLANK      0x40    /* Display enabled when set */
+
+#define SAMPLE_MAX          65536
+
+/* Machine state */
+static z80 cpu;
+static uint8_t memory [MEMORY_SIZE] = { 0 };
+static uint8_t cartridge [CARTRIDGE_SIZE_MAX] = { 0 };
+static uint32_t cartridge_size = 0;
+static uint8_t slot_2_bank = 2;                /* Bank mapped at 0x8000, for cartridges larger than 48 KiB */
+static uint32_t write_limit = ROM_SIZE_MAX;    /* Writes below this address are to ROM */
+static bool keyboard = false;                  /* SC-3000, with a PPI for the keyboard */
+static uint8_t ppi_port_c = 0;
+
+static uint8_t vram [0x4000] = { 0 };
+static uint8_t vdp_registers [8] = { 0 };
+static uint16_t vdp_address = 0;
+static uint8_t vdp_latch = 0;
+static bool vdp_latch_full = false;
+static uint8_t vdp_read_buffer = 0;
+static uint8_t vdp_status = 0;
+
+/* Measurements */
+static uint32_t frame_number = 0;
+static uint64_t frame_start = 0;
+static uint32_t frame_vram_bytes = 0;
+static uint32_t psg_writes = 0;
+static FILE *psg_log = NULL;
+
+static uint32_t tick_cycles [SAMPLE_MAX] = { 0 };
+static uint32_t tick_count = 0;
+static uint32_t tick_late = 0;                 /* Ticks that ran past the end of vblank */
+static uint32_t vram_bytes [SAMPLE_MAX] = { 0 };
+static uint32_t vram_frames = 0;
+
+
+/*
+ * Memory and I/O callbacks for the Z80.
+ */
+static uint8_t machine_read (void *context, uint16_t address)
+{
+    (void) context;
+
+    if (cartridge_size > ROM_SIZE_MAX && address >= 0x8000 && address < 0xc000)
+    {
+        uint32_t offset = slot_2_bank * BANK_SIZE + (address & (BANK_SIZE - 1));
+
+        return (offset < cartridge_size) ? cartridge [offset] : 0xff;
+    }
+
+    return memory [address];
+}
+
+static void machine_write (void *context, uint16_t address, uint8_t value)
+{
+    (void) context;
+
+    /* Sega mapper register for the slot at 0x8000, over the top of RAM */
+    if (cartridge_size > ROM_SIZE_MAX && address == 0xffff)
+    {
+        slot_2_bank = value;
+    }
+
+    if (address >= write_limit)
+    {
+        memory [address] = value;
+    }
+}
+
+static uint8_t machine_in (void *context, uint16_t port)
+{
+    uint8_t value = 0xff;
+
+    (void) context;
+
+    switch (port & 0xc0)
+    {
+        case 0x80: /* VDP */
+            vdp_latch_full = false;
+            if (port & 0x01)
+            {
+                value = vdp_status;
+                vdp_status &= ~VDP_STATUS_FRAME;
+            }
+            else
+            {
+                value = vdp_read_buffer;
+                vdp_read_buffer = vram [vdp_address];
+                vdp_address = (vdp_address + 1) & 0x3fff;
+            }
+            break;
+
+        case 0xc0: /* Joypads, and the keyboard PPI on the SC-3000 */
+            if (keyboard && (port & 0x03) == 0x02)
+            {
+                value = ppi_port_c;
+            }
+            break;
+    }
+
+    return value;
+}
+
+static void machine_out (void *context, uint16_t port, uint8_t value)
+{
+    (void) context;
+
+    switch (port & 0xc0)
+    {
+        case 0x40: /* PSG */
+            psg_writes++;
+            if (psg_log != NULL)
+            {
+                fprintf (psg_log, "%d %d %02x\n", frame_number, (uint32_t) (cpu.cycles - frame_start), value);
+            }
+            break;
+
+        case 0x80: /* VDP */
+            if (port & 0x01)
+            {
+                if (!vdp_latch_full)
+                {
+                    vdp_latch = value;
+                    vdp_latch_full = true;
+                }
+                else
+                {
+                    vdp_latch_full = false;
+                    if (value & 0x80)
+                    {
+                        vdp_registers [value & 0x07] = vdp_latch;
+                    }
+                    else
+                    {
+                        vdp_address = ((value << 8) | vdp_latch) & 0x3fff;
+                        if (!(value & 0x40))
+                        {
+                            vdp_read_buffer = vram [vdp_address];
+                            vdp_address = (vdp_address + 1) & 0x3fff;
+                        }
+                    }
+                }
+            }
+            else
+            {
+                vdp_latch_full = false;
+                vram [vdp_address] = value;
+                vdp_read_buffer = value;
+                vdp_address = (vdp_address + 1) & 0x3fff;
+                frame_vram_bytes++;
+            }
+            break;
+
+        case 0xc0:
+            if (keyboard && (port & 0x03) == 0x02)
+            {
+                ppi_port_c = value;
+            }
+            break;
+    }
+}
+
+
+/*
+ * Load a ROM or tape image into a buffer.
+ * Returns the size, or -1 on error.
+ */
+static int32_t load_image (const char *filename, uint8_t *buffer, uint32_t size_max)
+{
+    FILE *image_file = fopen (filename, "rb");
+    uint32_t size;
+
+    if (image_file == NULL)
+    {
+        fprintf (stderr, "Error: Unable to open %s.\n", filename);
+        return -1;
+    }
+
+    size = fread (buffer, 1, size_max, image_file);
+    if (!feof (image_file))
+    {
+        fprintf (stderr, "Error: %s is too large.\n", filename);
+        fclose (image_file);
+        return -1;
+    }
+
+    fclose (image_file);
+
+    if (size == 0)
+    {
+        fprintf (stderr, "Error: %s is empty.\n", filename);
+        return -1;
+    }
+
+    return size;
+}
+
+
+/*
+ * Find the address of a symbol in an sdcc .noi or .map file.
+ * Returns the address, or -1 if not found, which is
+ * only reported as an error for a required symbol.
+ */
+static int32_t find_symbol (const char *filename, const char *symbol, bool required)
+{
+    FILE *symbol_file = fopen (filename, "r");
+    char line [256] = { 0 };
+    char name [128] = { 0 };
+    uint32_t address;
+
+    if (symbol_file == NULL)
+    {
+        fprintf (stderr, "Error: Unable to open %s.\n", filename);
+        return -1;
+    }
+
+    while (fgets (line, sizeof (line), symbol_file) != NULL)
+    {
+        /* .noi lines are "DEF _name 0x1234", .map lines are "00001234  _name  module" */
+        if (sscanf (line, "DEF %127s %x", name, &address) == 2 ||
+            sscanf (line, "%x %127s", &address, name) == 2)
+        {
+            if (strcmp (name, symbol) == 0)
+            {
+                fclose (symbol_file);
+                return address & 0xffff;
+            }
+        }
+    }
+
+    fclose (symbol_file);
+
+    if (required)
+    {
+        fprintf (stderr, "Error: Symbol %s not found in %s.\n", symbol, filename);
+    }
+    return -1;
+}
+
+
+/*
+ * Run the machine for a number of frames.
+ *
+ * Calls to the function at tick_address are timed from the call
+ * until it returns to its caller. A negative address disables timing.
+ */
+static void run (uint32_t frames, uint32_t lines, int32_t tick_address)
+{
+    uint32_t frame_cycles = lines * CYCLES_PER_LINE;
+    uint32_t vblank_cycles = VBLANK_LINE * CYCLES_PER_LINE;
+    bool in_tick = false;
+    uint64_t tick_start = 0;
+    uint16_t tick_return = 0;
+    uint16_t tick_return_sp = 0;
+
+    for (frame_number = 0; frame_number < frames; frame_number++)
+    {
+        bool vblank = false;
+
+        frame_start = cpu.cycles;
+        frame_vram_bytes = 0;
+
+        while (cpu.cycles - frame_start < frame_cycles)
+        {
+            /* Start of vblank */
+            if (!vblank && cpu.cycles - frame_start >= vblank_cycles)
+            {
+                vblank = true;
+                vdp_status |= VDP_STATUS_FRAME;
+            }
+
+            /* The data bus floats high during the interrupt acknowledge */
+            if ((vdp_status & VDP_STATUS_FRAME) && (vdp_registers [1] & VDP_REG1_IE))
+            {
+                z80_interrupt (&cpu, 0xff);
+            }
+
+            if (!in_tick && cpu.pc == tick_address)
+            {
+                in_tick = true;
+                tick_start = cpu.cycles;
+                tick_return = memory [cpu.sp] | (memory [cpu.sp + 1] << 8);
+                tick_return_sp = cpu.sp + 2;
+            }
+
+            z80_step (&cpu);
+
+            if (in_tick && cpu.pc == tick_return && cpu.sp == tick_return_sp)
+            {
+                uint64_t end = cpu.cycles - frame_start;
+
+                in_tick = false;
+                if (tick_count < SAMPLE_MAX)
+                {
+                    tick_cycles [tick_count++] = cpu.cycles - tick_start;
+                }
+
+                /* vblank runs from line 192 to the end of the frame */
+                if (end < vblank_cycles)
+                {
+                    tick_late++;
+                }
+            }
+        }
+
+        /* Frames are only counted once set-up is complete and the display is on */
+        if ((vdp_registers [1] & VDP_REG1_BLANK) && vram_frames < SAMPLE_MAX)
+        {
+            vram_bytes [vram_frames++] = frame_vram_bytes;
+        }
+    }
+}
+
+
+/*
+ * Sort helper for the percentile.
+ */
+static int compare_u32 (const void *a, const void *b)
+{
+    uint32_t x = * (const uint32_t *) a;
+    uint32_t y = * (const uint32_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+
+/*
+ * Print the minimum, average, maximum and 99th percentile of a set of samples.
+ */
+static void report (const char *name, uint32_t *samples, uint32_t count)
+{
+    uint64_t total = 0;
+
+    if (count == 0)
+    {
+        fprintf (stdout, "%s: no samples.\n", name);
+        return;
+    }
+
+    qsort (samples, count, sizeof (uint32_t), compare_u32);
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        total += samples [i];
+    }
+
+    fprintf (stdout, "%s: min %d, avg %d, max %d, p99 %d (%d samples).\n", name,
+             samples [0], (uint32_t) (total / count), samples [count - 1],
+             samples [(count * 99) / 100], count);
+}
+
+
+/*
+ * Entry point.
+ */
+int main (int argc, char **argv)
+{
+    bool tape = false;
+    bool pal = false;
+    uint32_t seconds = 10;
+    char *symbols = NULL;
+    char *function = "_tick";
+    char *psg_log_filename = NULL;
+    int32_t tick_address = -1;
+    int32_t overruns_address = -1;
+    uint32_t lines;
+    uint32_t frames;
+
+    /* Skip the program name */
+    argc--;
+    argv++;
+
+    while (argc > 0 && argv [0][0] == '-')
+    {
+        if (strcmp (argv [0], "--tape") == 0)
+        {
+            tape = true;
+            keyboard = true;
+        }
+        else if (strcmp (argv [0], "--keyboard") == 0)
+        {
+            keyboard = true;
+        }
+        else if (strcmp (argv [0], "--pal") == 0)
+        {
+            pal = true;
+        }
+        else if (strcmp (argv [0], "--seconds") == 0 && argc >= 2)
+        {
+            seconds = strtoul (argv [1], NULL, 0);
+            argc--;
+            argv++;
+        }
+        else if (strcmp (argv [0], "--symbols") == 0 && argc >= 2)
+        {
+            symbols = argv [1];
+            argc--;
+            argv++;
+        }
+        else if (strcmp (argv [0], "--function") == 0 && argc >= 2)
+        {
+            function = argv [1];
+            argc--;
+            argv++;
+        }
+        else if (strcmp (argv [0], "--psg-log") == 0 && argc >= 2)
+        {
+            psg_log_filename = argv [1];
+            argc--;
+            argv++;
+        }
+        else
+        {
+            fprintf (stderr, "Error: Unknown option %s.\n", argv [0]);
+            return EXIT_FAILURE;
+        }
+        argc--;
+        argv++;
+    }
+
+    if (argc != 1)
+    {
+        fprintf (stderr, "Usage: sg_bench [options] <VGM-TapePlay.sg | VGM-TapePlay-tape.bin>\n");
+        fprintf (stderr, "Options:\n");
+        fprintf (stderr, "  --tape              Load a tape image at 0x%04x, as on the SC-3000\n", TAPE_ADDRESS);
+        fprintf (stderr, "  --keyboard          Emulate the SC-3000 keyboard with a ROM image\n");
+        fprintf (stderr, "  --pal               Run at 50 Hz\n");
+        fprintf (stderr, "  --seconds <n>       Length of playback to run, default 10\n");
+        fprintf (stderr, "  --symbols <file>    sdcc .noi or .map file for the image\n");
+        fprintf (stderr, "  --function <name>   Function to time, default _tick\n");
+        fprintf (stderr, "  --psg-log <file>    Write each PSG write as: frame cycle value\n");
+        return EXIT_FAILURE;
+    }
+
+    /* Set up the machine */
+    z80_reset (&cpu);
+    cpu.read = machine_read;
+    cpu.write = machine_write;
+    cpu.in = machine_in;
+    cpu.out = machine_out;
+
+    if (tape)
+    {
+        /* BASIC jumps to the program with CALL &H9800 */
+        write_limit = 0x8000;
+        if (load_image (argv [0], &memory [TAPE_ADDRESS], MEMORY_SIZE - TAPE_ADDRESS) < 0)
+        {
+            return EXIT_FAILURE;
+        }
+        cpu.pc = TAPE_ADDRESS;
+        cpu.sp = TAPE_STACK;
+    }
+    else
+    {
+        /* The first 48 KiB are always present. Past that, the slot
+         * at 0x8000 shows whichever bank the mapper selects. */
+        int32_t size = load_image (argv [0], cartridge, CARTRIDGE_SIZE_MAX);
+
+        write_limit = ROM_SIZE_MAX;
+        if (size < 0)
+        {
+            return EXIT_FAILURE;
+        }
+        cartridge_size = size;
+        memcpy (memory, cartridge, (cartridge_size < ROM_SIZE_MAX) ? cartridge_size : ROM_SIZE_MAX);
+    }
+
+    if (symbols != NULL)
+    {
+        tick_address = find_symbol (symbols, function, true);
+        if (tick_address < 0)
+        {
+            return EXIT_FAILURE;
+        }
+
+        /* Players from before the overrun counter do not have it */
+        overruns_address = find_symbol (symbols, "_frame_overruns", false);
+    }
+
+    if (psg_log_filename != NULL)
+    {
+        psg_log = fopen (psg_log_filename, "w");
+        if (psg_log == NULL)
+        {
+            fprintf (stderr, "Error: Unable to open %s for writing.\n", psg_log_filename);
+            return EXIT_FAILURE;
+        }
+    }
+
+    lines = pal ? LINES_PAL : LINES_NTSC;
+    frames = seconds * (pal ? 50 : 60);
+
+    run (frames, lines, tick_address);
+
+    if (psg_log != NULL)
+    {
+        fclose (psg_log);
+    }
+
+    fprintf (stdout, "Ran %d frames (%d seconds, %s).\n", frames, seconds, pal ? "PAL" : "NTSC");
+
+    if (tick_address >= 0)
+    {
+        report (function, tick_cycles, tick_count);
+        fprintf (stdout, "Calls that ran past the end of vblank: %d.\n", tick_late);
+    }
+
+    if (overruns_address >= 0)
+    {
+        fprintf (stdout, "Frames missed by the player and caught up: %d.\n",
+                 memory [overruns_address] | (memory [(overruns_address + 1) & 0xffff] << 8));
+    }
+
+    report ("VRAM bytes per frame", vram_bytes, vram_frames);
+    fprintf (stdout, "PSG writes: %d.\n", psg_writes);
+
+    return EXIT_SUCCESS;
+}
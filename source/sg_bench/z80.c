@@ -0,0 +1,1196 @@
+/*
+ * Z80 processor core, for benchmarking the player on the host.
+ *
+ * Covers the full documented instruction set, with the undocumented
+ * IXH / IXL / IYH / IYL forms and flag bits 3 and 5 that sdcc output
+ * may rely on. Timings are in T-states, without memory wait-states.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "z80.h"
+
+#define FLAG_C      Z80_FLAG_C
+#define FLAG_N      Z80_FLAG_N
+#define FLAG_PV     Z80_FLAG_PV
+#define FLAG_X      Z80_FLAG_X
+#define FLAG_H      Z80_FLAG_H
+#define FLAG_Y      Z80_FLAG_Y
+#define FLAG_Z      Z80_FLAG_Z
+#define FLAG_S      Z80_FLAG_S
+
+#define A       (cpu->af >> 8)
+#define F       (cpu->af & 0xff)
+#define SET_A(v)    (cpu->af = (cpu->af & 0x00ff) | ((uint8_t) (v) << 8))
+#define SET_F(v)    (cpu->af = (cpu->af & 0xff00) | (uint8_t) (v))
+
+/* Register indexes used in opcodes */
+#define REG_B       0
+#define REG_C       1
+#define REG_D       2
+#define REG_E       3
+#define REG_H       4
+#define REG_L       5
+#define REG_MEMORY  6
+#define REG_A       7
+
+/* Index register selected by a DD or FD prefix */
+#define INDEX_HL    0
+#define INDEX_IX    1
+#define INDEX_IY    2
+
+/* T-states for unprefixed opcodes. Conditional jumps,
+ * calls, and returns are listed as not taken. */
+static const uint8_t cycles_main [256] = {
+     4, 10,  7,  6,  4,  4,  7,  4,  4, 11,  7,  6,  4,  4,  7,  4,
+     8, 10,  7,  6,  4,  4,  7,  4, 12, 11,  7,  6,  4,  4,  7,  4,
+     7, 10, 16,  6,  4,  4,  7,  4,  7, 11, 16,  6,  4,  4,  7,  4,
+     7, 10, 13,  6, 11, 11, 10,  4,  7, 11, 13,  6,  4,  4,  7,  4,
+     4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,
+     4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,
+     4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,
+     7,  7,  7,  7,  7,  7,  4,  7,  4,  4,  4,  4,  4,  4,  7,  4,
+     4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,
+     4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,
+     4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,
+     4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,
+     5, 10, 10, 10, 10, 11,  7, 11,  5, 10, 10,  0, 10, 17,  7, 11,
+     5, 10, 10, 11, 10, 11,  7, 11,  5,  4, 10, 11, 10,  0,  7, 11,
+     5, 10, 10, 19, 10, 11,  7, 11,  5,  4, 10,  4, 10,  0,  7, 11,
+     5, 10, 10,  4, 10, 11,  7, 11,  5,  6, 10,  4, 10,  0,  7, 11
+};
+
+/* Sign, zero, bits 3 and 5, and parity flags for each result */
+static uint8_t flags_sz53p [256];
+static bool flags_ready = false;
+
+
+/*
+ * Fill in the flags table.
+ */
+static void flags_init (void)
+{
+    for (int i = 0; i < 256; i++)
+    {
+        uint8_t parity = 0;
+
+        for (int bit = 0; bit < 8; bit++)
+        {
+            parity ^= (i >> bit) & 1;
+        }
+
+        flags_sz53p [i] = (i & (FLAG_S | FLAG_Y | FLAG_X)) |
+                          ((i == 0) ? FLAG_Z : 0) |
+                          (parity ? 0 : FLAG_PV);
+    }
+
+    flags_ready = true;
+}
+
+
+/*
+ * Memory access helpers.
+ */
+static uint8_t read8 (z80 *cpu, uint16_t address)
+{
+    return cpu->read (cpu->context, address);
+}
+
+static uint16_t read16 (z80 *cpu, uint16_t address)
+{
+    return read8 (cpu, address) | (read8 (cpu, address + 1) << 8);
+}
+
+static void write8 (z80 *cpu, uint16_t address, uint8_t value)
+{
+    cpu->write (cpu->context, address, value);
+}
+
+static void write16 (z80 *cpu, uint16_t address, uint16_t value)
+{
+    write8 (cpu, address, value & 0xff);
+    write8 (cpu, address + 1, value >> 8);
+}
+
+static uint8_t fetch8 (z80 *cpu)
+{
+    return read8 (cpu, cpu->pc++);
+}
+
+static uint16_t fetch16 (z80 *cpu)
+{
+    uint16_t value = read16 (cpu, cpu->pc);
+    cpu->pc += 2;
+    return value;
+}
+
+static uint8_t fetch_opcode (z80 *cpu)
+{
+    cpu->r = (cpu->r & 0x80) | ((cpu->r + 1) & 0x7f);
+    return fetch8 (cpu);
+}
+
+static void push16 (z80 *cpu, uint16_t value)
+{
+    cpu->sp -= 2;
+    write16 (cpu, cpu->sp, value);
+}
+
+static uint16_t pop16 (z80 *cpu)
+{
+    uint16_t value = read16 (cpu, cpu->sp);
+    cpu->sp += 2;
+    return value;
+}
+
+
+/*
+ * Register access. With a DD or FD prefix, H and L refer to the high
+ * and low halves of IX or IY. Pass INDEX_HL for the real H and L.
+ */
+static uint16_t *index_register (z80 *cpu, uint8_t index)
+{
+    return (index == INDEX_IX) ? &cpu->ix :
+           (index == INDEX_IY) ? &cpu->iy : &cpu->hl;
+}
+
+static uint8_t get_reg8 (z80 *cpu, uint8_t reg, uint8_t index)
+{
+    switch (reg)
+    {
+        case REG_B: return cpu->bc >> 8;
+        case REG_C: return cpu->bc & 0xff;
+        case REG_D: return cpu->de >> 8;
+        case REG_E: return cpu->de & 0xff;
+        case REG_H: return *index_register (cpu, index) >> 8;
+        case REG_L: return *index_register (cpu, index) & 0xff;
+        default:    return A;
+    }
+}
+
+static void set_reg8 (z80 *cpu, uint8_t reg, uint8_t index, uint8_t value)
+{
+    uint16_t *pair;
+
+    switch (reg)
+    {
+        case REG_B: cpu->bc = (cpu->bc & 0x00ff) | (value << 8); break;
+        case REG_C: cpu->bc = (cpu->bc & 0xff00) | value;        break;
+        case REG_D: cpu->de = (cpu->de & 0x00ff) | (value << 8); break;
+        case REG_E: cpu->de = (cpu->de & 0xff00) | value;        break;
+        case REG_H:
+            pair = index_register (cpu, index);
+            *pair = (*pair & 0x00ff) | (value << 8);
+            break;
+        case REG_L:
+            pair = index_register (cpu, index);
+            *pair = (*pair & 0xff00) | value;
+            break;
+        default:
+            SET_A (value);
+            break;
+    }
+}
+
+/* Register pairs, as numbered in opcodes. With af set, pair 3 is AF rather than SP. */
+static uint16_t *reg16 (z80 *cpu, uint8_t pair, uint8_t index, bool af)
+{
+    switch (pair)
+    {
+        case 0:  return &cpu->bc;
+        case 1:  return &cpu->de;
+        case 2:  return index_register (cpu, index);
+        default: return af ? &cpu->af : &cpu->sp;
+    }
+}
+
+
+/*
+ * Check a condition code.
+ */
+static bool condition (z80 *cpu, uint8_t cc)
+{
+    switch (cc)
+    {
+        case 0:  return !(F & FLAG_Z);
+        case 1:  return  (F & FLAG_Z);
+        case 2:  return !(F & FLAG_C);
+        case 3:  return  (F & FLAG_C);
+        case 4:  return !(F & FLAG_PV);
+        case 5:  return  (F & FLAG_PV);
+        case 6:  return !(F & FLAG_S);
+        default: return  (F & FLAG_S);
+    }
+}
+
+
+/*
+ * 8-bit arithmetic and logic, operating on A.
+ */
+static void alu8 (z80 *cpu, uint8_t operation, uint8_t value)
+{
+    uint8_t a = A;
+    uint16_t result;
+    uint8_t carry = F & FLAG_C;
+
+    switch (operation)
+    {
+        case 0: /* ADD */
+        case 1: /* ADC */
+            result = a + value + ((operation == 1) ? carry : 0);
+            SET_F ((result & (FLAG_S | FLAG_Y | FLAG_X)) |
+                   (((result & 0xff) == 0) ? FLAG_Z : 0) |
+                   ((a ^ value ^ result) & FLAG_H) |
+                   ((((a ^ ~value) & (a ^ result)) & 0x80) >> 5) |
+                   ((result >> 8) & FLAG_C));
+            SET_A (result);
+            break;
+
+        case 2: /* SUB */
+        case 3: /* SBC */
+        case 7: /* CP */
+            result = a - value - ((operation == 3) ? carry : 0);
+            SET_F ((result & FLAG_S) |
+                   (((result & 0xff) == 0) ? FLAG_Z : 0) |
+                   ((a ^ value ^ result) & FLAG_H) |
+                   ((((a ^ value) & (a ^ result)) & 0x80) >> 5) |
+                   FLAG_N |
+                   ((result >> 8) & FLAG_C));
+
+            if (operation == 7)
+            {
+                /* CP takes bits 3 and 5 from the operand */
+                SET_F (F | (value & (FLAG_Y | FLAG_X)));
+            }
+            else
+            {
+                SET_F (F | (result & (FLAG_Y | FLAG_X)));
+                SET_A (result);
+            }
+            break;
+
+        case 4: /* AND */
+            SET_A (a & value);
+            SET_F (flags_sz53p [A] | FLAG_H);
+            break;
+
+        case 5: /* XOR */
+            SET_A (a ^ value);
+            SET_F (flags_sz53p [A]);
+            break;
+
+        case 6: /* OR */
+            SET_A (a | value);
+            SET_F (flags_sz53p [A]);
+            break;
+    }
+}
+
+
+/*
+ * 8-bit increment and decrement.
+ */
+static uint8_t inc8 (z80 *cpu, uint8_t value)
+{
+    uint8_t result = value + 1;
+
+    SET_F ((F & FLAG_C) | (flags_sz53p [result] & ~FLAG_PV) |
+           (((value & 0x0f) == 0x0f) ? FLAG_H : 0) |
+           ((value == 0x7f) ? FLAG_PV : 0));
+
+    return result;
+}
+
+static uint8_t dec8 (z80 *cpu, uint8_t value)
+{
+    uint8_t result = value - 1;
+
+    SET_F ((F & FLAG_C) | (flags_sz53p [result] & ~FLAG_PV) | FLAG_N |
+           (((value & 0x0f) == 0x00) ? FLAG_H : 0) |
+           ((value == 0x80) ? FLAG_PV : 0));
+
+    return result;
+}
+
+
+/*
+ * 16-bit arithmetic.
+ */
+static uint16_t add16 (z80 *cpu, uint16_t a, uint16_t b)
+{
+    uint32_t result = a + b;
+
+    SET_F ((F & (FLAG_S | FLAG_Z | FLAG_PV)) |
+           ((result >> 8) & (FLAG_Y | FLAG_X)) |
+           (((a ^ b ^ result) >> 8) & FLAG_H) |
+           ((result >> 16) & FLAG_C));
+
+    return result;
+}
+
+static uint16_t adc16 (z80 *cpu, uint16_t a, uint16_t b)
+{
+    uint32_t result = a + b + (F & FLAG_C);
+
+    SET_F (((result >> 8) & (FLAG_S | FLAG_Y | FLAG_X)) |
+           (((result & 0xffff) == 0) ? FLAG_Z : 0) |
+           (((a ^ b ^ result) >> 8) & FLAG_H) |
+           ((((a ^ ~b) & (a ^ result)) & 0x8000) >> 13) |
+           ((result >> 16) & FLAG_C));
+
+    return result;
+}
+
+static uint16_t sbc16 (z80 *cpu, uint16_t a, uint16_t b)
+{
+    uint32_t result = a - b - (F & FLAG_C);
+
+    SET_F (((result >> 8) & (FLAG_S | FLAG_Y | FLAG_X)) |
+           (((result & 0xffff) == 0) ? FLAG_Z : 0) |
+           (((a ^ b ^ result) >> 8) & FLAG_H) |
+           ((((a ^ b) & (a ^ result)) & 0x8000) >> 13) |
+           FLAG_N |
+           ((result >> 16) & FLAG_C));
+
+    return result;
+}
+
+
+/*
+ * Rotates and shifts from the CB page.
+ */
+static uint8_t rotate_shift (z80 *cpu, uint8_t operation, uint8_t value)
+{
+    uint8_t result;
+    uint8_t carry;
+
+    switch (operation)
+    {
+        case 0: /* RLC */
+            carry = value >> 7;
+            result = (value << 1) | carry;
+            break;
+        case 1: /* RRC */
+            carry = value & 1;
+            result = (value >> 1) | (carry << 7);
+            break;
+        case 2: /* RL */
+            carry = value >> 7;
+            result = (value << 1) | (F & FLAG_C);
+            break;
+        case 3: /* RR */
+            carry = value & 1;
+            result = (value >> 1) | ((F & FLAG_C) << 7);
+            break;
+        case 4: /* SLA */
+            carry = value >> 7;
+            result = value << 1;
+            break;
+        case 5: /* SRA */
+            carry = value & 1;
+            result = (value >> 1) | (value & 0x80);
+            break;
+        case 6: /* SLL, undocumented */
+            carry = value >> 7;
+            result = (value << 1) | 1;
+            break;
+        default: /* SRL */
+            carry = value & 1;
+            result = value >> 1;
+            break;
+    }
+
+    SET_F (flags_sz53p [result] | carry);
+
+    return result;
+}
+
+
+/*
+ * Decimal adjust.
+ */
+static void daa (z80 *cpu)
+{
+    uint8_t a = A;
+    uint8_t correction = 0;
+    uint8_t carry = F & FLAG_C;
+    uint8_t result;
+
+    if ((F & FLAG_H) || (a & 0x0f) > 9)
+    {
+        correction |= 0x06;
+    }
+    if (carry || a > 0x99)
+    {
+        correction |= 0x60;
+        carry = FLAG_C;
+    }
+
+    result = (F & FLAG_N) ? a - correction : a + correction;
+
+    SET_F (flags_sz53p [result] | carry | (F & FLAG_N) | ((a ^ result) & FLAG_H));
+    SET_A (result);
+}
+
+
+/*
+ * Run an instruction from the CB page. For DDCB and FDCB, the
+ * displacement has already been read and address points at the
+ * operand, which is written back to a register as well unless
+ * the register is (HL).
+ */
+static uint32_t execute_cb (z80 *cpu, uint8_t index, uint16_t address)
+{
+    uint8_t opcode;
+    uint8_t x, y, z;
+    uint8_t value;
+    uint8_t result;
+    bool memory;
+
+    if (index == INDEX_HL)
+    {
+        opcode = fetch_opcode (cpu);
+        address = cpu->hl;
+    }
+    else
+    {
+        /* The opcode follows the displacement, and is not an M1 cycle */
+        opcode = fetch8 (cpu);
+    }
+
+    x = opcode >> 6;
+    y = (opcode >> 3) & 7;
+    z = opcode & 7;
+    memory = (index != INDEX_HL) || (z == REG_MEMORY);
+
+    value = memory ? read8 (cpu, address) : get_reg8 (cpu, z, INDEX_HL);
+
+    switch (x)
+    {
+        case 0: /* Rotates and shifts */
+            result = rotate_shift (cpu, y, value);
+            break;
+
+        case 1: /* BIT */
+            result = value & (1 << y);
+            SET_F ((F & FLAG_C) | FLAG_H |
+                   (result ? 0 : (FLAG_Z | FLAG_PV)) |
+                   (result & FLAG_S) |
+                   ((memory ? (address >> 8) : value) & (FLAG_Y | FLAG_X)));
+
+            if (index != INDEX_HL)
+            {
+                return 20;
+            }
+            return memory ? 12 : 8;
+
+        case 2: /* RES */
+            result = value & ~(1 << y);
+            break;
+
+        default: /* SET */
+            result = value | (1 << y);
+            break;
+    }
+
+    if (memory)
+    {
+        write8 (cpu, address, result);
+    }
+    if (z != REG_MEMORY)
+    {
+        set_reg8 (cpu, z, INDEX_HL, result);
+    }
+
+    if (index != INDEX_HL)
+    {
+        return 23;
+    }
+    return memory ? 15 : 8;
+}
+
+
+/*
+ * Block transfer, compare, and I/O instructions.
+ * Returns the extra T-states if the instruction repeats.
+ */
+static uint32_t execute_block (z80 *cpu, uint8_t opcode)
+{
+    int8_t step = (opcode & 0x08) ? -1 : 1;
+    bool repeat = (opcode & 0x10);
+    uint8_t value;
+    uint8_t n;
+
+    switch (opcode & 0x03)
+    {
+        case 0: /* LDI, LDD, LDIR, LDDR */
+            value = read8 (cpu, cpu->hl);
+            write8 (cpu, cpu->de, value);
+            cpu->hl += step;
+            cpu->de += step;
+            cpu->bc--;
+            n = value + A;
+            SET_F ((F & (FLAG_S | FLAG_Z | FLAG_C)) |
+                   (cpu->bc ? FLAG_PV : 0) |
+                   (n & FLAG_X) | ((n << 4) & FLAG_Y));
+            if (repeat && cpu->bc)
+            {
+                cpu->pc -= 2;
+                return 5;
+            }
+            break;
+
+        case 1: /* CPI, CPD, CPIR, CPDR */
+        {
+            uint8_t result;
+            uint8_t half;
+
+            value = read8 (cpu, cpu->hl);
+            result = A - value;
+            half = (A ^ value ^ result) & FLAG_H;
+            cpu->hl += step;
+            cpu->bc--;
+            n = result - (half ? 1 : 0);
+            SET_F ((F & FLAG_C) | FLAG_N | half |
+                   (result & FLAG_S) |
+                   ((result == 0) ? FLAG_Z : 0) |
+                   (cpu->bc ? FLAG_PV : 0) |
+                   (n & FLAG_X) | ((n << 4) & FLAG_Y));
+            if (repeat && cpu->bc && result != 0)
+            {
+                cpu->pc -= 2;
+                return 5;
+            }
+            break;
+        }
+
+        case 2: /* INI, IND, INIR, INDR */
+            value = cpu->in (cpu->context, cpu->bc);
+            write8 (cpu, cpu->hl, value);
+            cpu->hl += step;
+            cpu->bc -= 0x100;
+            SET_F ((flags_sz53p [cpu->bc >> 8] & ~FLAG_PV) | FLAG_N | (F & FLAG_C));
+            if (repeat && (cpu->bc >> 8))
+            {
+                cpu->pc -= 2;
+                return 5;
+            }
+            break;
+
+        default: /* OUTI, OUTD, OTIR, OTDR */
+            value = read8 (cpu, cpu->hl);
+            cpu->bc -= 0x100;
+            cpu->out (cpu->context, cpu->bc, value);
+            cpu->hl += step;
+            SET_F ((flags_sz53p [cpu->bc >> 8] & ~FLAG_PV) | FLAG_N | (F & FLAG_C));
+            if (repeat && (cpu->bc >> 8))
+            {
+                cpu->pc -= 2;
+                return 5;
+            }
+            break;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Run an instruction from the ED page.
+ */
+static uint32_t execute_ed (z80 *cpu)
+{
+    uint8_t opcode = fetch_opcode (cpu);
+    uint8_t x = opcode >> 6;
+    uint8_t y = (opcode >> 3) & 7;
+    uint8_t z = opcode & 7;
+    uint8_t p = y >> 1;
+    uint8_t q = y & 1;
+    uint8_t value;
+    uint16_t address;
+
+    if (x == 2 && z <= 3 && y >= 4)
+    {
+        return 16 + execute_block (cpu, opcode);
+    }
+    else if (x != 1)
+    {
+        /* Undefined, acts as two NOPs */
+        return 8;
+    }
+
+    switch (z)
+    {
+        case 0: /* IN r, (C) */
+            value = cpu->in (cpu->context, cpu->bc);
+            SET_F ((F & FLAG_C) | flags_sz53p [value]);
+            if (y != REG_MEMORY)
+            {
+                set_reg8 (cpu, y, INDEX_HL, value);
+            }
+            return 12;
+
+        case 1: /* OUT (C), r */
+            cpu->out (cpu->context, cpu->bc, (y == REG_MEMORY) ? 0 : get_reg8 (cpu, y, INDEX_HL));
+            return 12;
+
+        case 2: /* SBC / ADC HL, rr */
+            if (q == 0)
+            {
+                cpu->hl = sbc16 (cpu, cpu->hl, *reg16 (cpu, p, INDEX_HL, false));
+            }
+            else
+            {
+                cpu->hl = adc16 (cpu, cpu->hl, *reg16 (cpu, p, INDEX_HL, false));
+            }
+            return 15;
+
+        case 3: /* LD (nn), rr / LD rr, (nn) */
+            address = fetch16 (cpu);
+            if (q == 0)
+            {
+                write16 (cpu, address, *reg16 (cpu, p, INDEX_HL, false));
+            }
+            else
+            {
+                *reg16 (cpu, p, INDEX_HL, false) = read16 (cpu, address);
+            }
+            return 20;
+
+        case 4: /* NEG */
+            value = A;
+            SET_A (0);
+            alu8 (cpu, 2, value);
+            return 8;
+
+        case 5: /* RETN / RETI */
+            cpu->pc = pop16 (cpu);
+            cpu->iff1 = cpu->iff2;
+            return 14;
+
+        case 6: /* IM, including the undocumented IM 0/1 */
+        {
+            static const uint8_t modes [4] = { 0, 0, 1, 2 };
+            cpu->im = modes [y & 3];
+            return 8;
+        }
+
+        default:
+            switch (y)
+            {
+                case 0: /* LD I, A */
+                    cpu->i = A;
+                    return 9;
+
+                case 1: /* LD R, A */
+                    cpu->r = A;
+                    return 9;
+
+                case 2: /* LD A, I */
+                case 3: /* LD A, R */
+                    SET_A ((y == 2) ? cpu->i : cpu->r);
+                    SET_F ((F & FLAG_C) | (flags_sz53p [A] & ~FLAG_PV) | (cpu->iff2 ? FLAG_PV : 0));
+                    return 9;
+
+                case 4: /* RRD */
+                    value = read8 (cpu, cpu->hl);
+                    write8 (cpu, cpu->hl, (A << 4) | (value >> 4));
+                    SET_A ((A & 0xf0) | (value & 0x0f));
+                    SET_F ((F & FLAG_C) | flags_sz53p [A]);
+                    return 18;
+
+                case 5: /* RLD */
+                    value = read8 (cpu, cpu->hl);
+                    write8 (cpu, cpu->hl, (value << 4) | (A & 0x0f));
+                    SET_A ((A & 0xf0) | (value >> 4));
+                    SET_F ((F & FLAG_C) | flags_sz53p [A]);
+                    return 18;
+
+                default:
+                    return 8;
+            }
+    }
+}
+
+
+/*
+ * Reset the processor.
+ */
+void z80_reset (z80 *cpu)
+{
+    if (!flags_ready)
+    {
+        flags_init ();
+    }
+
+    cpu->af = 0xffff;
+    cpu->sp = 0xffff;
+    cpu->pc = 0x0000;
+    cpu->i = 0;
+    cpu->r = 0;
+    cpu->iff1 = false;
+    cpu->iff2 = false;
+    cpu->im = 0;
+    cpu->ei_pending = false;
+    cpu->halted = false;
+    cpu->cycles = 0;
+}
+
+
+/*
+ * Run one instruction, returning the number of T-states taken.
+ */
+uint32_t z80_step (z80 *cpu)
+{
+    uint8_t index = INDEX_HL;
+    uint32_t cycles = 0;
+    bool displaced = false;
+    uint8_t opcode;
+    uint8_t x, y, z, p, q;
+    uint16_t address = 0;
+    uint16_t *pair;
+    uint8_t value;
+
+    cpu->ei_pending = false;
+
+    if (cpu->halted)
+    {
+        /* Executes NOPs until an interrupt */
+        cpu->r = (cpu->r & 0x80) | ((cpu->r + 1) & 0x7f);
+        cpu->cycles += 4;
+        return 4;
+    }
+
+    /* Prefixes. Only the last DD or FD counts. */
+    opcode = fetch_opcode (cpu);
+    while (opcode == 0xdd || opcode == 0xfd)
+    {
+        index = (opcode == 0xdd) ? INDEX_IX : INDEX_IY;
+        cycles += 4;
+        opcode = fetch_opcode (cpu);
+    }
+
+    if (opcode == 0xed)
+    {
+        cycles += execute_ed (cpu);
+        cpu->cycles += cycles;
+        return cycles;
+    }
+    else if (opcode == 0xcb)
+    {
+        if (index != INDEX_HL)
+        {
+            address = *index_register (cpu, index) + (int8_t) fetch8 (cpu);
+            cycles -= 4; /* The prefix is included in the DDCB timings */
+        }
+        cycles += execute_cb (cpu, index, address);
+        cpu->cycles += cycles;
+        return cycles;
+    }
+
+    cycles += cycles_main [opcode];
+
+    x = opcode >> 6;
+    y = (opcode >> 3) & 7;
+    z = opcode & 7;
+    p = y >> 1;
+    q = y & 1;
+
+    /* Find the address of any (HL) or (IX+d) operand */
+    if ((x == 1 && (y == REG_MEMORY) != (z == REG_MEMORY)) ||
+        (x == 2 && z == REG_MEMORY) ||
+        (x == 0 && (z == 4 || z == 5 || z == 6) && y == REG_MEMORY))
+    {
+        if (index == INDEX_HL)
+        {
+            address = cpu->hl;
+        }
+        else
+        {
+            address = *index_register (cpu, index) + (int8_t) fetch8 (cpu);
+            displaced = true;
+        }
+    }
+
+    if (displaced)
+    {
+        /* LD (IX+d), n overlaps the displacement calculation with reading n */
+        cycles += (opcode == 0x36) ? 5 : 8;
+    }
+
+    switch (x)
+    {
+        case 0:
+            switch (z)
+            {
+                case 0:
+                    switch (y)
+                    {
+                        case 0: /* NOP */
+                            break;
+
+                        case 1: /* EX AF, AF' */
+                        {
+                            uint16_t temp = cpu->af;
+                            cpu->af = cpu->af_alt;
+                            cpu->af_alt = temp;
+                            break;
+                        }
+
+                        case 2: /* DJNZ */
+                        {
+                            int8_t offset = fetch8 (cpu);
+                            cpu->bc -= 0x100;
+                            if (cpu->bc >> 8)
+                            {
+                                cpu->pc += offset;
+                                cycles += 5;
+                            }
+                            break;
+                        }
+
+                        case 3: /* JR */
+                        {
+                            int8_t offset = fetch8 (cpu);
+                            cpu->pc += offset;
+                            break;
+                        }
+
+                        default: /* JR cc */
+                        {
+                            int8_t offset = fetch8 (cpu);
+                            if (condition (cpu, y - 4))
+                            {
+                                cpu->pc += offset;
+                                cycles += 5;
+                            }
+                            break;
+                        }
+                    }
+                    break;
+
+                case 1:
+                    pair = reg16 (cpu, p, index, false);
+                    if (q == 0) /* LD rr, nn */
+                    {
+                        *pair = fetch16 (cpu);
+                    }
+                    else /* ADD HL, rr */
+                    {
+                        uint16_t *hl = index_register (cpu, index);
+                        *hl = add16 (cpu, *hl, *pair);
+                    }
+                    break;
+
+                case 2:
+                    switch (y)
+                    {
+                        case 0: /* LD (BC), A */
+                            write8 (cpu, cpu->bc, A);
+                            break;
+                        case 1: /* LD A, (BC) */
+                            SET_A (read8 (cpu, cpu->bc));
+                            break;
+                        case 2: /* LD (DE), A */
+                            write8 (cpu, cpu->de, A);
+                            break;
+                        case 3: /* LD A, (DE) */
+                            SET_A (read8 (cpu, cpu->de));
+                            break;
+                        case 4: /* LD (nn), HL */
+                            write16 (cpu, fetch16 (cpu), *index_register (cpu, index));
+                            break;
+                        case 5: /* LD HL, (nn) */
+                            *index_register (cpu, index) = read16 (cpu, fetch16 (cpu));
+                            break;
+                        case 6: /* LD (nn), A */
+                            write8 (cpu, fetch16 (cpu), A);
+                            break;
+                        default: /* LD A, (nn) */
+                            SET_A (read8 (cpu, fetch16 (cpu)));
+                            break;
+                    }
+                    break;
+
+                case 3: /* INC rr / DEC rr */
+                    pair = reg16 (cpu, p, index, false);
+                    *pair += (q == 0) ? 1 : -1;
+                    break;
+
+                case 4: /* INC r */
+                    if (y == REG_MEMORY)
+                    {
+                        write8 (cpu, address, inc8 (cpu, read8 (cpu, address)));
+                    }
+                    else
+                    {
+                        set_reg8 (cpu, y, index, inc8 (cpu, get_reg8 (cpu, y, index)));
+                    }
+                    break;
+
+                case 5: /* DEC r */
+                    if (y == REG_MEMORY)
+                    {
+                        write8 (cpu, address, dec8 (cpu, read8 (cpu, address)));
+                    }
+                    else
+                    {
+                        set_reg8 (cpu, y, index, dec8 (cpu, get_reg8 (cpu, y, index)));
+                    }
+                    break;
+
+                case 6: /* LD r, n */
+                    value = fetch8 (cpu);
+                    if (y == REG_MEMORY)
+                    {
+                        write8 (cpu, address, value);
+                    }
+                    else
+                    {
+                        set_reg8 (cpu, y, index, value);
+                    }
+                    break;
+
+                default:
+                    switch (y)
+                    {
+                        case 0: /* RLCA */
+                            value = (A << 1) | (A >> 7);
+                            SET_A (value);
+                            SET_F ((F & (FLAG_S | FLAG_Z | FLAG_PV)) | (value & (FLAG_Y | FLAG_X | FLAG_C)));
+                            break;
+                        case 1: /* RRCA */
+                            value = A & 1;
+                            SET_A ((A >> 1) | (value << 7));
+                            SET_F ((F & (FLAG_S | FLAG_Z | FLAG_PV)) | (A & (FLAG_Y | FLAG_X)) | value);
+                            break;
+                        case 2: /* RLA */
+                            value = A >> 7;
+                            SET_A ((A << 1) | (F & FLAG_C));
+                            SET_F ((F & (FLAG_S | FLAG_Z | FLAG_PV)) | (A & (FLAG_Y | FLAG_X)) | value);
+                            break;
+                        case 3: /* RRA */
+                            value = A & 1;
+                            SET_A ((A >> 1) | ((F & FLAG_C) << 7));
+                            SET_F ((F & (FLAG_S | FLAG_Z | FLAG_PV)) | (A & (FLAG_Y | FLAG_X)) | value);
+                            break;
+                        case 4:
+                            daa (cpu);
+                            break;
+                        case 5: /* CPL */
+                            SET_A (~A);
+                            SET_F ((F & (FLAG_S | FLAG_Z | FLAG_PV | FLAG_C)) | FLAG_H | FLAG_N | (A & (FLAG_Y | FLAG_X)));
+                            break;
+                        case 6: /* SCF */
+                            SET_F ((F & (FLAG_S | FLAG_Z | FLAG_PV)) | (A & (FLAG_Y | FLAG_X)) | FLAG_C);
+                            break;
+                        default: /* CCF */
+                            SET_F (((F & (FLAG_S | FLAG_Z | FLAG_PV)) | (A & (FLAG_Y | FLAG_X)) |
+                                    ((F & FLAG_C) ? FLAG_H : FLAG_C)));
+                            break;
+                    }
+                    break;
+            }
+            break;
+
+        case 1:
+            if (opcode == 0x76) /* HALT */
+            {
+                cpu->halted = true;
+            }
+            else if (z == REG_MEMORY) /* LD r, (HL) uses the real H and L */
+            {
+                set_reg8 (cpu, y, INDEX_HL, read8 (cpu, address));
+            }
+            else if (y == REG_MEMORY) /* LD (HL), r */
+            {
+                write8 (cpu, address, get_reg8 (cpu, z, INDEX_HL));
+            }
+            else /* LD r, r */
+            {
+                set_reg8 (cpu, y, index, get_reg8 (cpu, z, index));
+            }
+            break;
+
+        case 2: /* ALU A, r */
+            value = (z == REG_MEMORY) ? read8 (cpu, address) : get_reg8 (cpu, z, index);
+            alu8 (cpu, y, value);
+            break;
+
+        default:
+            switch (z)
+            {
+                case 0: /* RET cc */
+                    if (condition (cpu, y))
+                    {
+                        cpu->pc = pop16 (cpu);
+                        cycles += 6;
+                    }
+                    break;
+
+                case 1:
+                    if (q == 0) /* POP rr */
+                    {
+                        *reg16 (cpu, p, index, true) = pop16 (cpu);
+                    }
+                    else if (p == 0) /* RET */
+                    {
+                        cpu->pc = pop16 (cpu);
+                    }
+                    else if (p == 1) /* EXX */
+                    {
+                        uint16_t temp;
+                        temp = cpu->bc; cpu->bc = cpu->bc_alt; cpu->bc_alt = temp;
+                        temp = cpu->de; cpu->de = cpu->de_alt; cpu->de_alt = temp;
+                        temp = cpu->hl; cpu->hl = cpu->hl_alt; cpu->hl_alt = temp;
+                    }
+                    else if (p == 2) /* JP (HL) */
+                    {
+                        cpu->pc = *index_register (cpu, index);
+                    }
+                    else /* LD SP, HL */
+                    {
+                        cpu->sp = *index_register (cpu, index);
+                    }
+                    break;
+
+                case 2: /* JP cc, nn */
+                    address = fetch16 (cpu);
+                    if (condition (cpu, y))
+                    {
+                        cpu->pc = address;
+                    }
+                    break;
+
+                case 3:
+                    switch (y)
+                    {
+                        case 0: /* JP nn */
+                            cpu->pc = fetch16 (cpu);
+                            break;
+
+                        case 2: /* OUT (n), A */
+                            value = fetch8 (cpu);
+                            cpu->out (cpu->context, (A << 8) | value, A);
+                            break;
+
+                        case 3: /* IN A, (n) */
+                            value = fetch8 (cpu);
+                            SET_A (cpu->in (cpu->context, (A << 8) | value));
+                            break;
+
+                        case 4: /* EX (SP), HL */
+                        {
+                            uint16_t *hl = index_register (cpu, index);
+                            uint16_t temp = read16 (cpu, cpu->sp);
+                            write16 (cpu, cpu->sp, *hl);
+                            *hl = temp;
+                            break;
+                        }
+
+                        case 5: /* EX DE, HL */
+                        {
+                            uint16_t temp = cpu->de;
+                            cpu->de = cpu->hl;
+                            cpu->hl = temp;
+                            break;
+                        }
+
+                        case 6: /* DI */
+                            cpu->iff1 = false;
+                            cpu->iff2 = false;
+                            break;
+
+                        default: /* EI */
+                            cpu->iff1 = true;
+                            cpu->iff2 = true;
+                            cpu->ei_pending = true;
+                            break;
+                    }
+                    break;
+
+                case 4: /* CALL cc, nn */
+                    address = fetch16 (cpu);
+                    if (condition (cpu, y))
+                    {
+                        push16 (cpu, cpu->pc);
+                        cpu->pc = address;
+                        cycles += 7;
+                    }
+                    break;
+
+                case 5:
+                    if (q == 0) /* PUSH rr */
+                    {
+                        push16 (cpu, *reg16 (cpu, p, index, true));
+                    }
+                    else /* CALL nn, the prefixes are handled above */
+                    {
+                        address = fetch16 (cpu);
+                        push16 (cpu, cpu->pc);
+                        cpu->pc = address;
+                    }
+                    break;
+
+                case 6: /* ALU A, n */
+                    alu8 (cpu, y, fetch8 (cpu));
+                    break;
+
+                default: /* RST */
+                    push16 (cpu, cpu->pc);
+                    cpu->pc = y << 3;
+                    break;
+            }
+            break;
+    }
+
+    cpu->cycles += cycles;
+    return cycles;
+}
+
+
+/*
+ * Raise a maskable interrupt.
+ *
+ * In mode 0 the bus value is taken to be an RST instruction,
+ * which is what the SG-1000 and SC-3000 provide (0xff, RST 38h).
+ */
+uint32_t z80_interrupt (z80 *cpu, uint8_t bus)
+{
+    uint32_t cycles;
+
+    if (!cpu->iff1 || cpu->ei_pending)
+    {
+        return 0;
+    }
+
+    cpu->iff1 = false;
+    cpu->iff2 = false;
+    cpu->halted = false;
+    cpu->r = (cpu->r & 0x80) | ((cpu->r + 1) & 0x7f);
+
+    push16 (cpu, cpu->pc);
+
+    switch (cpu->im)
+    {
+        case 2:
+            cpu->pc = read16 (cpu, (cpu->i << 8) | bus);
+            cycles = 19;
+            break;
+
+        case 1:
+            cpu->pc = 0x0038;
+            cycles = 13;
+            break;
+
+        default:
+            cpu->pc = bus & 0x38;
+            cycles = 13;
+            break;
+    }
+
+    cpu->cycles += cycles;
+    return cycles;
+}
@@ -0,0 +1,56 @@
+/* Z80 flags */
+#define Z80_FLAG_C      0x01
+#define Z80_FLAG_N      0x02
+#define Z80_FLAG_PV     0x04
+#define Z80_FLAG_X      0x08
+#define Z80_FLAG_H      0x10
+#define Z80_FLAG_Y      0x20
+#define Z80_FLAG_Z      0x40
+#define Z80_FLAG_S      0x80
+
+/* Z80 processor state, and the bus it is connected to */
+typedef struct z80_s
+{
+    /* Registers */
+    uint16_t af;
+    uint16_t bc;
+    uint16_t de;
+    uint16_t hl;
+    uint16_t af_alt;
+    uint16_t bc_alt;
+    uint16_t de_alt;
+    uint16_t hl_alt;
+    uint16_t ix;
+    uint16_t iy;
+    uint16_t sp;
+    uint16_t pc;
+    uint8_t i;
+    uint8_t r;
+
+    /* Interrupt state */
+    bool iff1;
+    bool iff2;
+    uint8_t im;
+    bool ei_pending;    /* Interrupts are not accepted until after the instruction following ei */
+    bool halted;
+
+    /* Total T-states executed */
+    uint64_t cycles;
+
+    /* Bus */
+    void *context;
+    uint8_t (*read) (void *context, uint16_t address);
+    void (*write) (void *context, uint16_t address, uint8_t value);
+    uint8_t (*in) (void *context, uint16_t port);
+    void (*out) (void *context, uint16_t port, uint8_t value);
+} z80;
+
+/* Reset the processor. */
+void z80_reset (z80 *cpu);
+
+/* Run one instruction, returning the number of T-states taken. */
+uint32_t z80_step (z80 *cpu);
+
+/* Raise a maskable interrupt, with the given value on the data bus.
+ * Returns the number of T-states taken, or 0 if not accepted. */
+uint32_t z80_interrupt (z80 *cpu, uint8_t bus);
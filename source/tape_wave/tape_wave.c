@@ -0,0 +1,221 @@
+/*
+ * tape_wave
+ *
+ * In-memory version of SC-TapeWave, to generate
+ * SC-3000 tape audio without intermediate files.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tape_wave.h"
+
+/* Note that samples in 8-bit wave files are unsigned. */
+#define WAVE_ZERO       "\xff\xff\xff\xff\x00\x00\x00\x00"
+#define WAVE_ONE        "\xff\xff\x00\x00\xff\xff\x00\x00"
+#define WAVE_SILENT     0x80
+
+#define WAVE_HEADER_SIZE    44
+#define SAMPLE_RATE         9600    /* 9.6 kHz, giving 8 samples per tape-bit */
+#define LEADER_BITS         3600
+
+static uint8_t *output = NULL;
+static uint32_t output_size = 0;
+static int8_t checksum = 0;
+
+
+/*
+ * Write a 16-bit or 32-bit value to the output, little-endian.
+ */
+static void write_u16 (uint16_t value)
+{
+    output [output_size++] = value & 0xff;
+    output [output_size++] = value >> 8;
+}
+
+static void write_u32 (uint32_t value)
+{
+    write_u16 (value & 0xffff);
+    write_u16 (value >> 16);
+}
+
+
+/*
+ * Write a specified length of silence to the output.
+ */
+static void write_silent_ms (uint32_t length)
+{
+    /* 9.6 samples per ms. */
+    int samples = length * 96 / 10;
+
+    memset (&output [output_size], WAVE_SILENT, samples);
+    output_size += samples;
+}
+
+
+/*
+ * Write a single bit to the output.
+ */
+static void write_bit (bool bit)
+{
+    /* Note: We have 8 samples per bit */
+    memcpy (&output [output_size], bit ? WAVE_ONE : WAVE_ZERO, 8);
+    output_size += 8;
+}
+
+
+/*
+ * Write a byte to the output.
+ */
+static void write_byte (uint8_t byte)
+{
+    /* Start bit */
+    write_bit (0);
+
+    /* Data bits */
+    for (int i = 0; i < 8; i++)
+    {
+        write_bit ((byte >> i) & 1);
+    }
+
+    /* Stop bits */
+    write_bit (1);
+    write_bit (1);
+
+    checksum += byte;
+}
+
+
+/*
+ * Write the tape to the output, in the same format as SC-TapeWave.
+ */
+static void write_tape (const char *name, uint16_t program_length, const uint8_t *program)
+{
+    int name_length = strlen (name);
+
+    /* Write a short silent section. */
+    write_silent_ms (10);
+
+    /* Write the first leader field */
+    for (int i = 0; i < LEADER_BITS; i++)
+    {
+        write_bit (1);
+    }
+
+    /* Write the header key-code */
+    write_byte (0x16);
+    checksum = 0;
+
+    /* Write the file-name */
+    for (int i = 0; i < 16; i++)
+    {
+        write_byte ((i < name_length) ? name [i] : ' ');
+    }
+
+    /* Write the program length */
+    write_byte (program_length >> 8);
+    write_byte (program_length & 0xff);
+
+    /* Write the parity byte */
+    write_byte (-checksum);
+
+    /* Write two bytes of dummy data */
+    write_byte (0x00);
+    write_byte (0x00);
+
+    /* One second of silence */
+    write_silent_ms (1000);
+
+    /* Write the second leader field */
+    for (int i = 0; i < LEADER_BITS; i++)
+    {
+        write_bit (1);
+    }
+
+    /* Write the program key-code */
+    write_byte (0x17);
+    checksum = 0;
+
+    /* Write the program */
+    for (int i = 0; i < program_length; i++)
+    {
+        write_byte (program [i]);
+    }
+
+    /* Write the parity byte */
+    write_byte (-checksum);
+
+    /* Write two bytes of dummy data */
+    write_byte (0x00);
+    write_byte (0x00);
+
+    /* Write a short silent section. */
+    write_silent_ms (10);
+}
+
+
+/*
+ * Generate a .wav file for loading a program from tape.
+ *
+ * On success, *wave is set to an allocated buffer which should
+ * be freed when no longer needed.
+ */
+int tape_wave (const char *name, const uint8_t *program, uint32_t program_length,
+               uint8_t **wave, uint32_t *wave_size)
+{
+    uint32_t samples;
+
+    /* Check that it will fit in the tape's 16-bit length field */
+    if (program_length > 65535)
+    {
+        fprintf (stderr, "Error: Program is too large for tape.\n");
+        return -1;
+    }
+
+    /* Samples: Silence, two leader fields, and 11 bits for each byte.
+     * There are 22 bytes in the header block, and 4 around the program. */
+    samples = (10 + 1000 + 10) * 96 / 10
+            + LEADER_BITS * 2 * 8
+            + (22 + 4 + program_length) * 11 * 8;
+
+    output = malloc (WAVE_HEADER_SIZE + samples);
+    if (output == NULL)
+    {
+        fprintf (stderr, "Error: Unable to allocate %d bytes of memory.\n", WAVE_HEADER_SIZE + samples);
+        return -1;
+    }
+    output_size = 0;
+
+    /* Write RIFF header. The size counts the bytes after the size field. */
+    memcpy (&output [output_size], "RIFF", 4);
+    output_size += 4;
+    write_u32 (WAVE_HEADER_SIZE + samples - 8);
+    memcpy (&output [output_size], "WAVE", 4);
+    output_size += 4;
+
+    /* Write WAVE format */
+    memcpy (&output [output_size], "fmt ", 4);
+    output_size += 4;
+    write_u32 (16);             /* Length of the format section in bytes */
+    write_u16 (1);              /* PCM */
+    write_u16 (1);              /* Mono */
+    write_u32 (SAMPLE_RATE);    /* Sample rate */
+    write_u32 (SAMPLE_RATE);    /* One byte per frame */
+    write_u16 (1);              /* Frames are one-byte aligned */
+    write_u16 (8);              /* 8-bit */
+
+    /* Write WAVE data */
+    memcpy (&output [output_size], "data", 4);
+    output_size += 4;
+    write_u32 (samples);
+    write_tape (name, program_length, program);
+
+    *wave = output;
+    *wave_size = output_size;
+    output = NULL;
+
+    return 0;
+}
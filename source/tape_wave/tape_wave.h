@@ -0,0 +1,4 @@
+
+/* Generate a .wav file for loading a program from tape. */
+int tape_wave (const char *name, const uint8_t *program, uint32_t program_length,
+               uint8_t **wave, uint32_t *wave_size);
@@ -0,0 +1,318 @@
+/*
+ * tapeplay
+ *
+ * Converts VGM files directly into an SG-1000 ROM and an
+ * SC-3000 tape .wav, using a pre-built player, without
+ * running any other tools or writing intermediate files.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tapeplay.h"
+
+#define TAPE_NAME       "VGM-TapePlay"
+#define LIST_LINE_MAX   4096
+
+static vgm_convert_options options = { .pal = false, .cycle_budget = 0, .raw = false, .checkpoint_seconds = 0, .sub_frames = 0,
+                                      .stream = false, .banked = false };
+static char *player_rom_ihx = NULL;
+static char *player_tape_ihx = NULL;
+
+
+/*
+ * Write a buffer to a file.
+ */
+static int write_file (const char *filename, const uint8_t *data, uint32_t size)
+{
+    FILE *output_file = fopen (filename, "wb");
+
+    if (output_file == NULL)
+    {
+        fprintf (stderr, "Error: Unable to open %s for writing.\n", filename);
+        return -1;
+    }
+
+    if (fwrite (data, 1, size, output_file) != size)
+    {
+        fprintf (stderr, "Error: Unable to write %d bytes to %s.\n", size, filename);
+        fclose (output_file);
+        return -1;
+    }
+
+    fclose (output_file);
+
+    return 0;
+}
+
+
+/*
+ * Read the pre-built ROM and tape players from a directory.
+ * Music laid out for banks only needs the banked ROM player.
+ */
+static int read_players (const char *player_dir)
+{
+    char filename [4096] = { 0 };
+    uint32_t size = 0;
+
+    if (options.banked)
+    {
+        snprintf (filename, sizeof (filename), "%s/VGM-TapePlay-banked.ihx", player_dir);
+        player_rom_ihx = (char *) read_file (filename, &size);
+
+        return (player_rom_ihx == NULL) ? -1 : 0;
+    }
+
+    snprintf (filename, sizeof (filename), "%s/VGM-TapePlay.ihx", player_dir);
+    player_rom_ihx = (char *) read_file (filename, &size);
+
+    snprintf (filename, sizeof (filename), "%s/VGM-TapePlay-tape.ihx", player_dir);
+    player_tape_ihx = (char *) read_file (filename, &size);
+
+    if (player_rom_ihx == NULL || player_tape_ihx == NULL)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Convert one song, made of one or more VGM files,
+ * into <output_name>.sg and <output_name>.wav.
+ * With banked music, only the .sg is made.
+ */
+static int convert_song (const char *output_name, int vgm_count, char **vgm_filenames)
+{
+    uint8_t *vgm_data [TRACK_COUNT_MAX] = { NULL };
+    uint32_t vgm_size [TRACK_COUNT_MAX] = { 0 };
+    uint8_t *music = NULL;
+    uint32_t music_size = 0;
+    uint8_t *rom = NULL;
+    uint32_t rom_size = 0;
+    uint8_t *tape = NULL;
+    uint32_t tape_size = 0;
+    uint8_t *wave = NULL;
+    uint32_t wave_size = 0;
+    char filename [4096] = { 0 };
+    int result = -1;
+
+    fprintf (stderr, "Converting %s...\n", output_name);
+
+    if (vgm_count > TRACK_COUNT_MAX)
+    {
+        fprintf (stderr, "Error: Too many VGM files, at most %d tracks are supported.\n", TRACK_COUNT_MAX);
+        return -1;
+    }
+
+    for (int i = 0; i < vgm_count; i++)
+    {
+        vgm_data [i] = read_file (vgm_filenames [i], &vgm_size [i]);
+        if (vgm_data [i] == NULL)
+        {
+            break;
+        }
+    }
+
+    /* Run each stage in turn, stopping at the first failure.
+     * Banked music is only for cartridges, so has no tape stages. */
+    if (vgm_data [vgm_count - 1] != NULL &&
+        vgm_convert (vgm_count, (const uint8_t *const *) vgm_data, vgm_size, &options, &music, &music_size) == 0 &&
+        vgm_check (music, music_size, vgm_count, (const uint8_t *const *) vgm_data, vgm_size, &options, 2) == 0 &&
+        vgm_inject (player_rom_ihx, music, music_size, true, &rom, &rom_size) == 0 &&
+        (options.banked ||
+         (vgm_inject (player_tape_ihx, music, music_size, false, &tape, &tape_size) == 0 &&
+          tape_wave (TAPE_NAME, tape, tape_size, &wave, &wave_size) == 0)))
+    {
+        snprintf (filename, sizeof (filename), "%s.sg", output_name);
+        result = write_file (filename, rom, rom_size);
+
+        snprintf (filename, sizeof (filename), "%s.wav", output_name);
+        if (result == 0 && !options.banked)
+        {
+            result = write_file (filename, wave, wave_size);
+        }
+
+        /* Sanity-check the size */
+        if (tape_size > 26624)
+        {
+            fprintf (stderr, "WARNING: Cassette too large for BASIC IIIa or BASIC IIIb.\n");
+        }
+        else if (tape_size > 12288)
+        {
+            fprintf (stderr, "WARNING: Cassette too large for BASIC IIIa. Okay for BASIC IIIb.\n");
+        }
+    }
+
+    for (int i = 0; i < vgm_count; i++)
+    {
+        free (vgm_data [i]);
+    }
+    free (music);
+    free (rom);
+    free (tape);
+    free (wave);
+
+    return result;
+}
+
+
+/*
+ * Convert each song listed in a file.
+ *
+ * Each line has an output name followed by one or more VGM
+ * files, separated by whitespace. Blank lines and lines
+ * starting with '#' are ignored.
+ */
+static int convert_list (const char *list_filename)
+{
+    FILE *list_file = NULL;
+    char line [LIST_LINE_MAX] = { 0 };
+    int failures = 0;
+
+    list_file = fopen (list_filename, "r");
+    if (list_file == NULL)
+    {
+        fprintf (stderr, "Error: Unable to open %s.\n", list_filename);
+        return -1;
+    }
+
+    while (fgets (line, sizeof (line), list_file) != NULL)
+    {
+        char *words [TRACK_COUNT_MAX + 2] = { NULL };
+        int word_count = 0;
+
+        for (char *word = strtok (line, " \t\r\n"); word != NULL; word = strtok (NULL, " \t\r\n"))
+        {
+            if (word_count == TRACK_COUNT_MAX + 2)
+            {
+                break;
+            }
+            words [word_count++] = word;
+        }
+
+        if (word_count == 0 || words [0][0] == '#')
+        {
+            continue;
+        }
+
+        if (word_count < 2 || convert_song (words [0], word_count - 1, &words [1]) != 0)
+        {
+            fprintf (stderr, "Error: Unable to convert %s.\n", words [0]);
+            failures++;
+        }
+    }
+
+    fclose (list_file);
+
+    if (failures)
+    {
+        fprintf (stderr, "%d songs failed to convert.\n", failures);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Entry point.
+ */
+int main (int argc, char **argv)
+{
+    bool batch = false;
+    int result;
+
+    /* Skip the program name */
+    argc--;
+    argv++;
+
+    while (argc > 0 && argv [0][0] == '-')
+    {
+        /* Option to generate data for PAL consoles */
+        if (strcmp (argv [0], "--pal") == 0)
+        {
+            options.pal = true;
+        }
+        /* Option to set the Z80 cycles available to each tick */
+        else if (strcmp (argv [0], "--cycle-budget") == 0 && argc >= 2)
+        {
+            options.cycle_budget = strtoul (argv [1], NULL, 0);
+            argc--;
+            argv++;
+        }
+        /* Option to store frames as raw PSG bytes, which take more
+         * of the frame data space shared by all of the tracks */
+        else if (strcmp (argv [0], "--raw") == 0)
+        {
+            options.raw = true;
+        }
+        /* Option to add seek checkpoints, every given number of seconds */
+        else if (strcmp (argv [0], "--checkpoints") == 0 && argc >= 2)
+        {
+            options.checkpoint_seconds = strtoul (argv [1], NULL, 0);
+            argc--;
+            argv++;
+        }
+        /* Option to play ticks at timed points within each frame */
+        else if (strcmp (argv [0], "--sub-frames") == 0 && argc >= 2)
+        {
+            options.sub_frames = strtoul (argv [1], NULL, 0);
+            argc--;
+            argv++;
+        }
+        /* Option to pack each track's indexes into a stream */
+        else if (strcmp (argv [0], "--stream") == 0)
+        {
+            options.stream = true;
+        }
+        /* Option to lay out the music for a banked cartridge */
+        else if (strcmp (argv [0], "--banked") == 0)
+        {
+            options.banked = true;
+        }
+        else if (strcmp (argv [0], "--batch") == 0)
+        {
+            batch = true;
+        }
+        else
+        {
+            fprintf (stderr, "Error: Unknown option %s.\n", argv [0]);
+            return EXIT_FAILURE;
+        }
+        argc--;
+        argv++;
+    }
+
+    if ((batch && argc != 2) || (!batch && argc < 3))
+    {
+        fprintf (stderr, "Usage: tapeplay [--pal] [--raw] [--cycle-budget <n>] [--checkpoints <s>] [--sub-frames <n>] [--stream] [--banked] <player-dir> <output-name> <input.vgm> [more.vgm ...]\n");
+        fprintf (stderr, "       tapeplay [--pal] [--raw] [--cycle-budget <n>] [--checkpoints <s>] [--sub-frames <n>] [--stream] [--banked] --batch <player-dir> <list-file>\n");
+        return EXIT_FAILURE;
+    }
+
+    if (read_players (argv [0]) != 0)
+    {
+        free (player_rom_ihx);
+        free (player_tape_ihx);
+        return EXIT_FAILURE;
+    }
+
+    if (batch)
+    {
+        result = convert_list (argv [1]);
+    }
+    else
+    {
+        result = convert_song (argv [1], argc - 2, &argv [2]);
+    }
+
+    free (player_rom_ihx);
+    free (player_tape_ihx);
+
+    return (result == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,17 @@
+
+/*
+ * VGM-TapePlay conversion pipeline.
+ *
+ * Each stage works on in-memory buffers:
+ *  - vgm_convert: VGM files to a music blob
+ *  - vgm_check:   Music blob checked against the VGM files, through a reference decoder
+ *  - vgm_inject:  Music blob and player image to a ROM or tape image
+ *  - tape_wave:   Tape image to a .wav file for loading in BASIC
+ */
+
+#include "../vgm_convert/vgm_read.h"
+#include "../vgm_convert/vgm_convert.h"
+#include "../vgm_check/vgm_decode.h"
+#include "../vgm_check/vgm_check.h"
+#include "../vgm_inject/vgm_inject.h"
+#include "../tape_wave/tape_wave.h"
@@ -0,0 +1,147 @@
+/*
+ * vgm_check
+ *
+ * Command line front-end for checking a music blob
+ * against the VGM files it was converted from.
+ *
+ * The converter's options are accepted so that the same options can be
+ * given to both. Only those that set the cycle budget change the check.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../vgm_convert/vgm_read.h"
+#include "../vgm_convert/vgm_convert.h"
+#include "vgm_check.h"
+
+
+/*
+ * Free the buffers holding the input files.
+ */
+static void free_vgm_data (uint8_t **vgm_data)
+{
+    for (int i = 0; i < TRACK_COUNT_MAX; i++)
+    {
+        free (vgm_data [i]);
+    }
+}
+
+
+/*
+ * Entry point.
+ */
+int main (int argc, char **argv)
+{
+    vgm_convert_options options = { .pal = false, .cycle_budget = 0, .raw = false, .checkpoint_seconds = 0, .sub_frames = 0,
+                                    .stream = false, .banked = false };
+    uint32_t loops = 2;
+    uint8_t *music = NULL;
+    uint32_t music_size = 0;
+    uint8_t *vgm_data [TRACK_COUNT_MAX] = { NULL };
+    uint32_t vgm_size [TRACK_COUNT_MAX] = { 0 };
+    int result;
+
+    /* Skip the program name */
+    argc--;
+    argv++;
+
+    while (argc > 0 && argv [0][0] == '-')
+    {
+        /* Music was generated for PAL consoles */
+        if (strcmp (argv [0], "--pal") == 0)
+        {
+            options.pal = true;
+        }
+        /* Z80 cycles the music was given for each tick */
+        else if (strcmp (argv [0], "--cycle-budget") == 0 && argc >= 2)
+        {
+            options.cycle_budget = strtoul (argv [1], NULL, 0);
+            argc--;
+            argv++;
+        }
+        /* Music was stored as raw PSG bytes */
+        else if (strcmp (argv [0], "--raw") == 0)
+        {
+            options.raw = true;
+        }
+        /* Music has seek checkpoints, every given number of seconds */
+        else if (strcmp (argv [0], "--checkpoints") == 0 && argc >= 2)
+        {
+            options.checkpoint_seconds = strtoul (argv [1], NULL, 0);
+            argc--;
+            argv++;
+        }
+        /* Music plays ticks at timed points within each frame */
+        else if (strcmp (argv [0], "--sub-frames") == 0 && argc >= 2)
+        {
+            options.sub_frames = strtoul (argv [1], NULL, 0);
+            argc--;
+            argv++;
+        }
+        /* Music has each track's indexes packed into a stream */
+        else if (strcmp (argv [0], "--stream") == 0)
+        {
+            options.stream = true;
+        }
+        /* Music was laid out for a banked cartridge */
+        else if (strcmp (argv [0], "--banked") == 0)
+        {
+            options.banked = true;
+        }
+        /* Number of times to play around the loop */
+        else if (strcmp (argv [0], "--loops") == 0 && argc >= 2)
+        {
+            loops = strtoul (argv [1], NULL, 0);
+            argc--;
+            argv++;
+        }
+        else
+        {
+            fprintf (stderr, "Error: Unknown option %s.\n", argv [0]);
+            return EXIT_FAILURE;
+        }
+        argc--;
+        argv++;
+    }
+
+    if (argc < 2)
+    {
+        fprintf (stderr, "Usage: vgm_check [--pal] [--raw] [--cycle-budget <n>] [--checkpoints <s>] [--sub-frames <n>] [--stream] [--banked]\n"
+                         "                 [--loops <n>] <music.bin> <input.vgm> [more.vgm ...]\n");
+        return EXIT_FAILURE;
+    }
+
+    if (argc - 1 > TRACK_COUNT_MAX)
+    {
+        fprintf (stderr, "Error: Too many VGM files, at most %d tracks are supported.\n", TRACK_COUNT_MAX);
+        return EXIT_FAILURE;
+    }
+
+    music = read_file (argv [0], &music_size);
+    if (music == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 1; i < argc; i++)
+    {
+        vgm_data [i - 1] = read_file (argv [i], &vgm_size [i - 1]);
+        if (vgm_data [i - 1] == NULL)
+        {
+            free_vgm_data (vgm_data);
+            free (music);
+            return EXIT_FAILURE;
+        }
+    }
+
+    result = vgm_check (music, music_size, argc - 1, (const uint8_t *const *) vgm_data, vgm_size, &options, loops);
+
+    free_vgm_data (vgm_data);
+    free (music);
+
+    return (result == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
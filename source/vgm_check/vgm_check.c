@@ -0,0 +1,528 @@
+/*
+ * vgm_check
+ *
+ * Checks a music blob against the VGM files it was converted from.
+ *
+ * Each VGM file is replayed to find the PSG register state at every
+ * tick, and the matching track is played through the reference
+ * decoder. The two are compared at every tick, through the end of
+ * the track and around the loop.
+ *
+ * Registers that cannot be heard are not compared, as the converter
+ * leaves these writes out. The converter may hold changes back by one
+ * tick when a frame would take the player too long to apply. A register
+ * may show its value from the tick before only when a frame was read on
+ * that tick, and the frame would go over the cycle budget if the change
+ * were added to it. The cost is estimated from the decoded frame, using
+ * the same model as the converter. These are counted separately from
+ * mismatches.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../vgm_convert/vgm_read.h"
+#include "../vgm_convert/vgm_convert.h"
+#include "vgm_decode.h"
+#include "vgm_check.h"
+
+#define FIELD_COUNT         8       /* Tone0-2, noise, and four volumes */
+#define MISMATCHES_SHOWN    10
+#define TICKS_MAX           (60 * 60 * 60)
+
+static const char *field_names [FIELD_COUNT] = {
+    "Tone0", "Tone1", "Tone2", "Noise", "Volume0", "Volume1", "Volume2", "Volume3"
+};
+
+/* A PSG write from the VGM file, at the tick the converter places it */
+typedef struct vgm_event_s
+{
+    uint32_t tick;
+    uint8_t data;
+} vgm_event;
+
+/* Timeline of one VGM file */
+static vgm_event *events = NULL;
+static uint32_t event_count = 0;
+static uint32_t loop_event = 0;     /* First event after the loop point */
+static uint32_t loop_tick = 0;
+static uint32_t end_tick = 0;
+
+/* Estimated Z80 cycles for the player to apply a frame. Must match the converter. */
+#define CYCLES_TICK         400
+#define CYCLES_FRAME        300
+#define CYCLES_NIBBLE       120
+#define CYCLES_PSG_WRITE    40
+#define CYCLES_BAR          250
+#define CYCLES_BAR_ROW      100
+#define CYCLES_METER_FLUSH  300
+#define CYCLES_METER_BYTE   26
+#define CYCLES_RAW_BYTE     21
+
+#define FIELD_TONES         0x07
+#define FIELD_NOISE         0x08
+#define FIELD_VOLUMES       0xf0
+
+static uint32_t cycle_budget = 0;
+
+
+/*
+ * Read one register from a state, as compared by the checker.
+ */
+static uint16_t state_field (const psg_state *state, uint8_t field)
+{
+    if (field < 3)
+    {
+        return state->tone [field];
+    }
+    else if (field == 3)
+    {
+        return state->noise & 0x07;
+    }
+    else
+    {
+        return state->volume [field - 4];
+    }
+}
+
+
+/*
+ * Check if a register can be heard, following the
+ * same rules as audible_changes () in the converter.
+ */
+static bool field_audible (const psg_state *state, uint8_t field)
+{
+    bool noise_audible = (state->volume [3] != 0x0f);
+
+    switch (field)
+    {
+        case 0:
+        case 1:
+            return state->volume [field] != 0x0f;
+
+        case 2:
+            return state->volume [2] != 0x0f || (noise_audible && (state->noise & 0x03) == 0x03);
+
+        case 3:
+            return noise_audible;
+
+        default:
+            return true;
+    }
+}
+
+
+/*
+ * Build the timeline of PSG writes for a VGM file.
+ *
+ * Writes are placed at ticks in the same way as the converter:
+ * time is counted in whole frames when a write follows a delay,
+ * with any remainder carried forward. With sub-frame slots, sample
+ * counts are scaled up by the number of slots.
+ */
+static int build_timeline (const uint8_t *buffer, uint32_t size, uint16_t frame_length, uint8_t sub_frames)
+{
+    uint32_t vgm_offset = 0x40;
+    uint32_t loop_offset = * (uint32_t *)(&buffer [0x1c]);
+    uint32_t samples_delay = 0;
+    uint32_t tick = 0;
+    bool ended = false;
+
+    if (* (uint32_t *)(&buffer [0x34]) != 0)
+    {
+        vgm_offset = 0x34 + * (uint32_t *)(&buffer [0x34]);
+    }
+    if (loop_offset != 0)
+    {
+        loop_offset += 0x1c;
+    }
+
+    /* At most one event per byte of input */
+    free (events);
+    events = malloc (size * sizeof (vgm_event));
+    if (events == NULL)
+    {
+        fprintf (stderr, "Error: Unable to allocate memory for the VGM timeline.\n");
+        return -1;
+    }
+    event_count = 0;
+    loop_event = 0;
+    loop_tick = 0;
+
+    for (uint32_t i = vgm_offset; i < size && !ended; i++)
+    {
+        if (i == loop_offset)
+        {
+            /* The converter ends the frame before the loop point. If there
+             * are writes in the current tick, that frame lasts at least one
+             * tick, as at the end of the track. */
+            if (samples_delay >= frame_length)
+            {
+                tick += samples_delay / frame_length;
+            }
+            else if (event_count > 0 && events [event_count - 1].tick == tick)
+            {
+                tick++;
+            }
+            samples_delay %= frame_length;
+            loop_event = event_count;
+            loop_tick = tick;
+        }
+
+        switch (buffer [i])
+        {
+            case 0x4f: /* Game Gear stereo */
+                i++;
+                break;
+
+            case 0x50: /* PSG */
+                tick += samples_delay / frame_length;
+                samples_delay %= frame_length;
+                events [event_count].tick = tick;
+                events [event_count].data = buffer [++i];
+                event_count++;
+                break;
+
+            case 0x61:
+                samples_delay += * (uint16_t *)(&buffer [i + 1]) * sub_frames;
+                i += 2;
+                break;
+
+            case 0x62:
+                samples_delay += 735 * sub_frames;
+                break;
+
+            case 0x63:
+                samples_delay += 882 * sub_frames;
+                break;
+
+            case 0x66: /* End of sound data, the final frame lasts at least one tick */
+                tick += (samples_delay >= frame_length) ? samples_delay / frame_length : 1;
+                ended = true;
+                break;
+
+            case 0x70: case 0x71: case 0x72: case 0x73:
+            case 0x74: case 0x75: case 0x76: case 0x77:
+            case 0x78: case 0x79: case 0x7a: case 0x7b:
+            case 0x7c: case 0x7d: case 0x7e: case 0x7f:
+                samples_delay += (1 + (buffer [i] & 0x0f)) * sub_frames;
+                break;
+
+            case 0xa0: /* AY8910 */
+                i += 2;
+                break;
+
+            case 0xd2: /* SCC */
+                i += 3;
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    end_tick = tick;
+
+    return 0;
+}
+
+
+/*
+ * Estimate the cycles the player takes to apply a frame, as the converter
+ * does. Fields are given as bits of (1 << field), and the volumes are
+ * taken from the states before and after the frame for drawing the meter.
+ */
+static uint32_t frame_cost (bool raw, uint8_t fields, uint8_t low_only, const psg_state *before, const psg_state *after)
+{
+    uint32_t cost = CYCLES_TICK + CYCLES_FRAME;
+    uint8_t dirty_first = 8;
+    uint8_t dirty_last = 0;
+
+    /* Extension nibble */
+    if (!raw && ((fields & FIELD_NOISE) || (fields & low_only)))
+    {
+        cost += CYCLES_NIBBLE;
+    }
+
+    for (uint8_t field = 0; field < FIELD_COUNT; field++)
+    {
+        uint8_t bit = 1 << field;
+
+        if (!(fields & bit))
+        {
+            continue;
+        }
+
+        if (bit & FIELD_TONES)
+        {
+            if (raw)
+            {
+                cost += (low_only & bit) ? CYCLES_RAW_BYTE : CYCLES_RAW_BYTE * 2;
+            }
+            else
+            {
+                cost += (low_only & bit) ? (CYCLES_NIBBLE + CYCLES_PSG_WRITE)
+                                         : (CYCLES_NIBBLE * 3 + CYCLES_PSG_WRITE * 2);
+            }
+        }
+        else if (bit == FIELD_NOISE)
+        {
+            cost += raw ? CYCLES_RAW_BYTE : CYCLES_PSG_WRITE;
+        }
+        else
+        {
+            /* Volumes also draw their bar into the meter shadow */
+            uint8_t value = after->volume [field - 4];
+            uint8_t previous = before->volume [field - 4];
+            uint8_t first = (((value < previous) ? value : previous) + 1) >> 1;
+            uint8_t last =  (((value > previous) ? value : previous) + 1) >> 1;
+
+            cost += raw ? CYCLES_RAW_BYTE : (CYCLES_NIBBLE + CYCLES_PSG_WRITE);
+            cost += CYCLES_BAR;
+
+            last = (last > 7) ? 7 : last;
+            if (first <= last)
+            {
+                cost += (last - first + 1) * CYCLES_BAR_ROW;
+                dirty_first = (first < dirty_first) ? first : dirty_first;
+                dirty_last = (last > dirty_last) ? last : dirty_last;
+            }
+        }
+    }
+
+    /* The dirty rows of the meter are sent to VRAM in one burst */
+    if (dirty_first <= dirty_last)
+    {
+        cost += CYCLES_METER_FLUSH + ((dirty_last - dirty_first) * 32 + 16) * CYCLES_METER_BYTE;
+    }
+
+    return cost;
+}
+
+
+/*
+ * Check if the converter could have held a change back from the frame
+ * read on this tick, which is only done when the change would take the
+ * frame over the cycle budget. Tones are taken as written in full, as
+ * the most the change could have cost.
+ */
+static bool change_over_budget (const vgm_decoder *decoder, uint8_t field, uint16_t wanted)
+{
+    psg_state after = decoder->state;
+    uint8_t bit = 1 << field;
+
+    if (!decoder->frame_read)
+    {
+        return false;
+    }
+
+    if (field >= 4)
+    {
+        after.volume [field - 4] = wanted;
+    }
+
+    return frame_cost (decoder->raw, decoder->frame_fields | bit, decoder->frame_low_only & ~bit,
+                       &decoder->frame_previous, &after) > cycle_budget;
+}
+
+
+/*
+ * Compare one track of the music blob with the timeline,
+ * through the end of the track and the given number of loops.
+ */
+static int check_track (vgm_decoder *decoder, uint8_t track, uint32_t loops)
+{
+    psg_state initial = { .volume = { 0x0f, 0x0f, 0x0f, 0x0f } };
+    psg_state expected = initial;
+    psg_state expected_previous = initial;  /* From the tick before */
+    uint8_t latch = 0;
+    uint32_t event = 0;
+    uint32_t pass = 1;
+    uint32_t pass_start = 0;        /* Decoder tick at which the current pass started */
+    uint32_t pass_offset = 0;       /* Timeline tick at which the current pass started */
+    uint32_t mismatches = 0;
+    uint32_t late = 0;
+    uint32_t sampled = 0;
+    uint32_t tick;
+
+    if (vgm_decoder_start (decoder, track) != 0)
+    {
+        return -1;
+    }
+
+    for (tick = 0; tick < TICKS_MAX; tick++)
+    {
+        uint32_t timeline_tick;
+
+        vgm_decoder_tick (decoder);
+
+        if (decoder->error)
+        {
+            fprintf (stderr, "Error: Track %d reads past the end of the music blob at tick %d.\n", track + 1, tick);
+            return -1;
+        }
+
+        /* Each loop replays the timeline from the loop point */
+        if (decoder->loop_frame)
+        {
+            if (pass == loops + 1)
+            {
+                break;
+            }
+
+            if (tick - pass_start + pass_offset != end_tick)
+            {
+                fprintf (stderr, "  Pass %d: track looped at tick %d, expected %d.\n", pass,
+                         tick - pass_start + pass_offset, end_tick);
+                mismatches++;
+            }
+
+            pass++;
+            pass_start = tick;
+            pass_offset = loop_tick;
+            event = loop_event;
+        }
+
+        timeline_tick = tick - pass_start + pass_offset;
+        expected_previous = expected;
+        while (event < event_count && events [event].tick <= timeline_tick)
+        {
+            psg_state_write (&expected, &latch, events [event].data);
+            event++;
+        }
+
+        for (uint8_t field = 0; field < FIELD_COUNT; field++)
+        {
+            uint16_t wanted = state_field (&expected, field);
+            uint16_t decoded = state_field (&decoder->state, field);
+
+            if (decoded == wanted)
+            {
+                continue;
+            }
+            if (!field_audible (&expected, field))
+            {
+                continue;
+            }
+
+            /* A sample's register changes faster than the ticks */
+            if (decoder->sample_ticks && field == 4 + decoder->sample_channel)
+            {
+                sampled++;
+                continue;
+            }
+
+            /* The change may be one tick late, if it did not fit in this tick's frame */
+            if (decoded == state_field (&expected_previous, field) && change_over_budget (decoder, field, wanted))
+            {
+                late++;
+                continue;
+            }
+
+            if (mismatches < MISMATCHES_SHOWN)
+            {
+                fprintf (stderr, "  Pass %d, tick %d: %s is 0x%03x, expected 0x%03x.\n",
+                         pass, timeline_tick, field_names [field], decoded, wanted);
+            }
+            mismatches++;
+        }
+    }
+
+    if (tick == TICKS_MAX)
+    {
+        fprintf (stderr, "  Track did not loop within %d ticks.\n", TICKS_MAX);
+        mismatches++;
+    }
+
+    fprintf (stderr, "Track %d: %d ticks checked, loop at %d, end at %d, %d mismatches.\n",
+             track + 1, tick, loop_tick, end_tick, mismatches);
+    if (late)
+    {
+        fprintf (stderr, "  %d register changes late by one tick, to fit the cycle budget.\n", late);
+    }
+    if (sampled)
+    {
+        fprintf (stderr, "  %d ticks of volume played by samples, not compared.\n", sampled);
+    }
+
+    return mismatches ? -1 : 0;
+}
+
+
+/*
+ * Check a music blob against the VGM files it was converted from.
+ * The options give the cycle budget the blob was converted with.
+ *
+ * Returns 0 if every track matches, through the given number of loops.
+ */
+int vgm_check (const uint8_t *music, uint32_t music_size,
+               uint8_t vgm_count, const uint8_t *const *vgm_data, const uint32_t *vgm_size,
+               const vgm_convert_options *options, uint32_t loops)
+{
+    vgm_decoder decoder;
+    vgm_convert_options budget_options = *options;
+    uint16_t frame_length = options->pal ? 882 : 735;
+    int failures = 0;
+
+    if (vgm_decoder_init (&decoder, music, music_size) != 0)
+    {
+        return -1;
+    }
+
+    if (decoder.pal != options->pal)
+    {
+        fprintf (stderr, "Error: Music blob has %s ticks, but %s was requested.\n",
+                 decoder.pal ? "PAL" : "NTSC", options->pal ? "PAL" : "NTSC");
+        return -1;
+    }
+
+    /* The budget depends on how the blob was built, which its header records */
+    budget_options.sub_frames = decoder.sub_frames;
+    budget_options.stream = decoder.stream;
+    cycle_budget = vgm_convert_cycle_budget (&budget_options);
+
+    if (decoder.track_count != vgm_count)
+    {
+        fprintf (stderr, "Error: Music blob has %d tracks, but %d VGM files were given.\n",
+                 decoder.track_count, vgm_count);
+        return -1;
+    }
+
+    for (int i = 0; i < vgm_count; i++)
+    {
+        uint8_t *buffer = NULL;
+        uint32_t size = 0;
+
+        buffer = read_vgm_buffer (vgm_data [i], vgm_size [i], &size);
+        if (buffer == NULL)
+        {
+            return -1;
+        }
+
+        if (build_timeline (buffer, size, frame_length, decoder.sub_frames) != 0)
+        {
+            free (buffer);
+            return -1;
+        }
+        free (buffer);
+
+        if (check_track (&decoder, i, loops) != 0)
+        {
+            failures++;
+        }
+    }
+
+    free (events);
+    events = NULL;
+
+    if (failures)
+    {
+        fprintf (stderr, "Error: %d of %d tracks do not match their VGM file.\n", failures, vgm_count);
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,4 @@
+/* Check a music blob against the VGM files it was converted from. */
+int vgm_check (const uint8_t *music, uint32_t music_size,
+               uint8_t vgm_count, const uint8_t *const *vgm_data, const uint32_t *vgm_size,
+               const vgm_convert_options *options, uint32_t loops);
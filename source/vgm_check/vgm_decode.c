@@ -0,0 +1,582 @@
+/*
+ * vgm_decode
+ *
+ * Host reference decoder for the music blob. This follows tick (),
+ * nibble_read () and track_start () in the player step for step,
+ * so that the converter's output can be checked without hardware.
+ * Any change to the player's decoding must be made here too.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "vgm_decode.h"
+
+/* Must match the player */
+#define TONE_0_BIT      0x01
+#define TONE_1_BIT      0x02
+#define TONE_2_BIT      0x04
+#define EXTEND_BIT      0x08
+#define VOLUME_0_BIT    0x10
+#define VOLUME_1_BIT    0x20
+#define VOLUME_2_BIT    0x40
+#define VOLUME_3_BIT    0x80
+
+#define EXTEND_LOW_ONLY 0x08
+
+#define REST_INDEX_MASK 0x0fc0
+#define SAMPLE_INDEX    0x0f80
+
+#define MUSIC_HEADER_SIZE   10
+#define TRACK_INFO_SIZE     10
+#define MUSIC_FLAG_RAW      0x01
+#define MUSIC_FLAG_PAL      0x02
+#define MUSIC_SLOTS_SHIFT   2
+#define MUSIC_FLAG_STREAM   0x10
+
+/* Z80 cycles for the player to write two samples, and the cycles
+ * added for each unit of a sample's period */
+#define CYCLES_SAMPLE_PAIR  203
+#define CYCLES_SAMPLE_DELAY 26
+#define Z80_CLOCK_NTSC      3579545
+#define Z80_CLOCK_PAL       3546893
+
+
+/*
+ * Apply a byte written to the PSG to a register state.
+ */
+void psg_state_write (psg_state *state, uint8_t *latch, uint8_t data)
+{
+    uint8_t reg;
+
+    if (data & 0x80)
+    {
+        *latch = (data >> 4) & 0x07;
+    }
+    reg = *latch;
+
+    switch (reg)
+    {
+        case 0: case 2: case 4: /* Tones */
+            if (data & 0x80)
+            {
+                state->tone [reg >> 1] = (state->tone [reg >> 1] & 0x3f0) | (data & 0x0f);
+            }
+            else
+            {
+                state->tone [reg >> 1] = (state->tone [reg >> 1] & 0x00f) | ((data & 0x3f) << 4);
+            }
+            break;
+
+        case 6: /* Noise */
+            state->noise = data & 0x07;
+            break;
+
+        default: /* Volumes */
+            state->volume [reg >> 1] = data & 0x0f;
+            break;
+    }
+}
+
+
+/*
+ * Read from the music blob, flagging reads past its end.
+ */
+static uint8_t music_read8 (vgm_decoder *decoder, uint32_t offset)
+{
+    if (offset >= decoder->music_size)
+    {
+        decoder->error = true;
+        return 0;
+    }
+
+    return decoder->music [offset];
+}
+
+static uint16_t music_read16 (vgm_decoder *decoder, uint32_t offset)
+{
+    return music_read8 (decoder, offset) | (music_read8 (decoder, offset + 1) << 8);
+}
+
+
+/*
+ * Equivalent of psg_write () in the player.
+ *
+ * The converter leaves a sample's register out of the frames while
+ * it plays, so a frame that writes it means the sample has ended.
+ */
+static void psg_write (vgm_decoder *decoder, uint8_t data)
+{
+    static const uint8_t latch_fields [8] = { TONE_0_BIT, VOLUME_0_BIT, TONE_1_BIT, VOLUME_1_BIT,
+                                              TONE_2_BIT, VOLUME_2_BIT, EXTEND_BIT, VOLUME_3_BIT };
+
+    psg_state_write (&decoder->state, &decoder->latch, data);
+
+    /* Note what the frame wrote, for checking it against the cycle budget */
+    decoder->frame_fields |= latch_fields [decoder->latch];
+    if (!(decoder->latch & 0x01) && decoder->latch != 6)
+    {
+        if (data & 0x80)
+        {
+            decoder->frame_low_only |= latch_fields [decoder->latch];
+        }
+        else
+        {
+            decoder->frame_low_only &= ~latch_fields [decoder->latch];
+        }
+    }
+
+    if (decoder->sample_ticks && decoder->latch == ((decoder->sample_channel << 1) | 1))
+    {
+        decoder->sample_ticks = 0;
+    }
+}
+
+
+/*
+ * Equivalent of nibble_read () in the player.
+ */
+static uint8_t nibble_read (vgm_decoder *decoder)
+{
+    uint32_t offset = decoder->frame_data + decoder->frame_index;
+
+    if (decoder->nibble_high)
+    {
+        decoder->nibble_high = false;
+        decoder->frame_index++;
+        return music_read8 (decoder, offset) >> 4;
+    }
+    else
+    {
+        decoder->nibble_high = true;
+        return music_read8 (decoder, offset) & 0x0f;
+    }
+}
+
+
+/*
+ * Equivalent of nibble_done () in the player.
+ */
+static void nibble_done (vgm_decoder *decoder)
+{
+    if (decoder->nibble_high)
+    {
+        decoder->nibble_high = false;
+        decoder->frame_index++;
+    }
+}
+
+
+/*
+ * Read one entry of index_data.
+ */
+static uint16_t index_read (vgm_decoder *decoder, uint16_t index)
+{
+    return music_read16 (decoder, decoder->index_data + index * 2);
+}
+
+
+/*
+ * Equivalent of stream_unpack () in the player.
+ */
+static void stream_unpack (vgm_decoder *decoder)
+{
+    uint8_t data;
+
+    if (decoder->stream_left == 0)
+    {
+        decoder->error = true;
+        return;
+    }
+
+    if (decoder->lz_literals == 0 && decoder->lz_match == 0)
+    {
+        uint8_t token = music_read8 (decoder, decoder->stream_in++);
+
+        if (token >= 0xc0)
+        {
+            decoder->lz_match = (token & 0x3f) + 4;
+            decoder->lz_copy = decoder->index_data + music_read16 (decoder, decoder->stream_in);
+            decoder->stream_in += 2;
+        }
+        else if (token & 0x80)
+        {
+            decoder->lz_match = (token & 0x3f) + 3;
+            decoder->lz_distance = music_read8 (decoder, decoder->stream_in++);
+            decoder->lz_copy = 0;
+        }
+        else
+        {
+            decoder->lz_literals = token + 1;
+        }
+    }
+
+    if (decoder->lz_literals)
+    {
+        data = music_read8 (decoder, decoder->stream_in++);
+        decoder->lz_literals--;
+    }
+    else if (decoder->lz_copy)
+    {
+        data = music_read8 (decoder, decoder->lz_copy++);
+        decoder->lz_match--;
+    }
+    else
+    {
+        data = decoder->stream_ring [(uint8_t) (decoder->ring_write - decoder->lz_distance)];
+        decoder->lz_match--;
+    }
+
+    decoder->stream_ring [decoder->ring_write++] = data;
+    decoder->stream_left--;
+}
+
+
+/*
+ * Equivalent of stream_word () in the player. Unpacking is only done
+ * here when the ring runs dry, rather than also a few bytes each tick as
+ * in the player, but the unpacked indexes are the same.
+ */
+static uint16_t stream_word (vgm_decoder *decoder)
+{
+    uint16_t word;
+
+    while ((uint8_t) (decoder->ring_write - decoder->ring_read) < 2 && !decoder->error)
+    {
+        stream_unpack (decoder);
+    }
+
+    word = decoder->stream_ring [decoder->ring_read++];
+    word |= decoder->stream_ring [decoder->ring_read++] << 8;
+    decoder->stream_words--;
+
+    return word;
+}
+
+
+/*
+ * Equivalent of stream_open () in the player.
+ */
+static void stream_open (vgm_decoder *decoder, bool loop)
+{
+    if (decoder->track_end == 0)
+    {
+        loop = true;
+    }
+
+    decoder->stream_looping = loop;
+    decoder->stream_in = loop ? decoder->loop_outer : decoder->track_start;
+    decoder->stream_words = loop ? decoder->loop_inner : decoder->track_end;
+    decoder->stream_left = decoder->stream_words << 1;
+    decoder->lz_literals = 0;
+    decoder->lz_match = 0;
+    decoder->ring_read = decoder->ring_write;
+
+    if (decoder->stream_words == 0)
+    {
+        decoder->error = true;
+    }
+}
+
+
+/*
+ * Equivalent of index_next () in the player.
+ */
+static uint16_t index_next (vgm_decoder *decoder)
+{
+    if (decoder->stream)
+    {
+        return stream_word (decoder);
+    }
+
+    if (decoder->inner_index == decoder->segment_end)
+    {
+        uint16_t element = index_read (decoder, decoder->outer_index++);
+
+        if (element & 0x8000)
+        {
+            /* Segment */
+            decoder->inner_index = element & 0x0fff;
+            decoder->segment_end = decoder->inner_index + ((element >> 12) & 0x0007) + 2;
+        }
+        else
+        {
+            /* Single index */
+            decoder->inner_index = decoder->outer_index - 1;
+            decoder->segment_end = decoder->outer_index;
+        }
+    }
+
+    return index_read (decoder, decoder->inner_index++);
+}
+
+
+/*
+ * Start a sample, as the player does when the slot that triggered it is
+ * sent. Its length in ticks is found from the player's cycle counts.
+ */
+static void sample_trigger (vgm_decoder *decoder, uint8_t number)
+{
+    uint32_t offset;
+    uint8_t period;
+    uint16_t length;
+    uint32_t cycles;
+    uint32_t tick_cycles;
+
+    if (decoder->sample_data == 0)
+    {
+        decoder->error = true;
+        return;
+    }
+
+    offset = music_read16 (decoder, decoder->sample_data + number * 2);
+    period = music_read8 (decoder, offset + 1);
+    length = music_read16 (decoder, offset + 2);
+    if (length == 0)
+    {
+        decoder->error = true;
+        return;
+    }
+
+    /* A sample that is still playing is cut short */
+    if (decoder->sample_ticks)
+    {
+        decoder->state.volume [decoder->sample_channel] = decoder->sample_final;
+    }
+
+    cycles = length * (CYCLES_SAMPLE_PAIR + CYCLES_SAMPLE_DELAY * period);
+    tick_cycles = (decoder->pal ? Z80_CLOCK_PAL / 50 : Z80_CLOCK_NTSC / 60) / decoder->sub_frames;
+
+    decoder->sample_channel = (music_read8 (decoder, offset) >> 5) & 0x03;
+    decoder->sample_final = music_read8 (decoder, offset + 4 + length - 1) >> 4;
+    decoder->sample_ticks = (cycles + tick_cycles - 1) / tick_cycles + 1;
+}
+
+
+/*
+ * Prepare to decode a music blob.
+ */
+int vgm_decoder_init (vgm_decoder *decoder, const uint8_t *music, uint32_t music_size)
+{
+    memset (decoder, 0, sizeof (vgm_decoder));
+    decoder->music = music;
+    decoder->music_size = music_size;
+
+    if (music_size < MUSIC_HEADER_SIZE)
+    {
+        fprintf (stderr, "Error: Music blob is too small.\n");
+        return -1;
+    }
+
+    decoder->track_count = music_read8 (decoder, 0);
+    decoder->raw = music_read8 (decoder, 1) & MUSIC_FLAG_RAW;
+    decoder->pal = music_read8 (decoder, 1) & MUSIC_FLAG_PAL;
+    decoder->sub_frames = ((music_read8 (decoder, 1) >> MUSIC_SLOTS_SHIFT) & 0x03) + 1;
+    decoder->stream = music_read8 (decoder, 1) & MUSIC_FLAG_STREAM;
+    decoder->frame_data = music_read16 (decoder, 2);
+    decoder->index_data = music_read16 (decoder, 4);
+    decoder->sample_data = music_read16 (decoder, 8);
+
+    if (MUSIC_HEADER_SIZE + (uint32_t) decoder->track_count * TRACK_INFO_SIZE > music_size ||
+        decoder->frame_data > music_size || decoder->index_data > music_size)
+    {
+        fprintf (stderr, "Error: Music blob header is invalid.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Start a track, as track_start () does in the player.
+ */
+int vgm_decoder_start (vgm_decoder *decoder, uint8_t track)
+{
+    uint32_t offset = MUSIC_HEADER_SIZE + track * TRACK_INFO_SIZE;
+
+    if (track >= decoder->track_count)
+    {
+        fprintf (stderr, "Error: Track %d not present in music blob.\n", track + 1);
+        return -1;
+    }
+
+    decoder->track_start      = music_read16 (decoder, offset + 0);
+    decoder->outer_index      = decoder->track_start;
+    decoder->track_end        = music_read16 (decoder, offset + 2);
+    decoder->loop_outer       = music_read16 (decoder, offset + 4);
+    decoder->loop_inner       = music_read16 (decoder, offset + 6);
+    decoder->loop_segment_end = music_read16 (decoder, offset + 8);
+
+    decoder->inner_index = 0;
+    decoder->segment_end = 0;
+    decoder->delay = 0;
+    decoder->nibble_high = false;
+    decoder->loop_taken = false;
+    decoder->sample_ticks = 0;
+
+    if (decoder->stream)
+    {
+        stream_open (decoder, false);
+    }
+
+    /* Set the register values the converter assumes at the start of a track */
+    psg_write (decoder, 0x80 | 0x00); psg_write (decoder, 0x00);
+    psg_write (decoder, 0x80 | 0x20); psg_write (decoder, 0x00);
+    psg_write (decoder, 0x80 | 0x40); psg_write (decoder, 0x00);
+    psg_write (decoder, 0x80 | 0x60);
+    psg_write (decoder, 0x80 | 0x1f);
+    psg_write (decoder, 0x80 | 0x3f);
+    psg_write (decoder, 0x80 | 0x5f);
+    psg_write (decoder, 0x80 | 0x7f);
+
+    return 0;
+}
+
+
+/*
+ * Apply a nibble-packed frame, as frame_play () does in the player.
+ */
+static void frame_play (vgm_decoder *decoder)
+{
+    uint8_t frame;
+    uint8_t low_only;
+    uint8_t data;
+
+    frame = music_read8 (decoder, decoder->frame_data + decoder->frame_index++);
+
+    low_only = 0;
+    if (frame & EXTEND_BIT)
+    {
+        data = nibble_read (decoder);
+        if (data & EXTEND_LOW_ONLY)
+        {
+            low_only = data;
+        }
+        else
+        {
+            psg_write (decoder, 0x80 | 0x60 | data);
+        }
+    }
+
+    for (uint8_t channel = 0; channel < 3; channel++)
+    {
+        if (frame & (TONE_0_BIT << channel))
+        {
+            data = nibble_read (decoder);
+            psg_write (decoder, 0x80 | (channel << 5) | data);
+
+            if (!(low_only & (TONE_0_BIT << channel)))
+            {
+                data = nibble_read (decoder);
+                data |= nibble_read (decoder) << 4;
+                psg_write (decoder, data);
+            }
+        }
+    }
+
+    for (uint8_t channel = 0; channel < 4; channel++)
+    {
+        if (frame & (VOLUME_0_BIT << channel))
+        {
+            data = nibble_read (decoder);
+            psg_write (decoder, 0x80 | (channel << 5) | 0x10 | data);
+        }
+    }
+
+    nibble_done (decoder);
+}
+
+
+/*
+ * Apply a raw frame, as frame_play_raw () does in the player.
+ */
+static void frame_play_raw (vgm_decoder *decoder)
+{
+    uint8_t frame = music_read8 (decoder, decoder->frame_data + decoder->frame_index++);
+
+    for (uint8_t i = 0; i < (frame & 0x0f); i++)
+    {
+        psg_write (decoder, music_read8 (decoder, decoder->frame_data + decoder->frame_index++));
+    }
+}
+
+
+/*
+ * Run one tick, as tick () does in the player.
+ */
+void vgm_decoder_tick (vgm_decoder *decoder)
+{
+    decoder->loop_frame = false;
+    decoder->frame_read = false;
+    decoder->frame_fields = 0;
+    decoder->frame_low_only = 0;
+
+    /* A sample that has played through leaves its last value in the register */
+    if (decoder->sample_ticks && --decoder->sample_ticks == 0)
+    {
+        decoder->state.volume [decoder->sample_channel] = decoder->sample_final;
+    }
+
+    /* Read and process the next frame */
+    if (decoder->delay == 0)
+    {
+        decoder->loop_frame = decoder->loop_taken;
+        decoder->loop_taken = false;
+
+        decoder->frame_index = index_next (decoder);
+        while ((decoder->frame_index & REST_INDEX_MASK) == SAMPLE_INDEX && !decoder->error)
+        {
+            sample_trigger (decoder, decoder->frame_index & 0x003f);
+            decoder->frame_index = index_next (decoder);
+        }
+
+        if ((decoder->frame_index & REST_INDEX_MASK) == REST_INDEX_MASK)
+        {
+            /* Long rest, nine bits of length. Play the empty frame. */
+            decoder->delay = (((decoder->frame_index >> 6) & 0x01c0) | (decoder->frame_index & 0x003f)) + 1;
+            decoder->frame_index = 0;
+        }
+        else
+        {
+            decoder->delay = ((decoder->frame_index >> 12) & 0x0007) + 1;
+            decoder->frame_index &= 0x0fff;
+        }
+
+        decoder->frame_read = true;
+        decoder->frame_previous = decoder->state;
+        if (decoder->raw)
+        {
+            frame_play_raw (decoder);
+        }
+        else
+        {
+            frame_play (decoder);
+        }
+    }
+
+    /* Check for end of data and loop, once the final segment has been played */
+    if (decoder->stream)
+    {
+        if (decoder->stream_words == 0)
+        {
+            decoder->loop_taken = decoder->stream_looping;
+            stream_open (decoder, true);
+        }
+    }
+    else if (decoder->outer_index == decoder->track_end && decoder->inner_index == decoder->segment_end)
+    {
+        decoder->outer_index = decoder->loop_outer;
+        decoder->inner_index = decoder->loop_inner;
+        decoder->segment_end = decoder->loop_segment_end;
+        decoder->loop_taken = true;
+    }
+
+    /* Decrement the delay counter */
+    if (decoder->delay > 0)
+    {
+        decoder->delay--;
+    }
+}
@@ -0,0 +1,81 @@
+/* PSG register state */
+typedef struct psg_state_s
+{
+    uint16_t tone [3];
+    uint8_t noise;
+    uint8_t volume [4];
+} psg_state;
+
+/* Reference decoder, with the same state as the player */
+typedef struct vgm_decoder_s
+{
+    const uint8_t *music;
+    uint32_t music_size;
+    uint16_t track_count;
+    uint16_t frame_data;
+    uint16_t index_data;
+    uint16_t sample_data;   /* Zero if there are no samples */
+    bool raw;               /* Frames are raw PSG bytes */
+    bool pal;               /* Ticks are 1/50s, rather than 1/60s */
+    uint8_t sub_frames;     /* Ticks in each frame */
+    bool stream;            /* Each track's indexes are packed into a stream */
+
+    /* Current track */
+    uint16_t track_start;
+    uint16_t track_end;
+    uint16_t loop_outer;
+    uint16_t loop_inner;
+    uint16_t loop_segment_end;
+
+    /* Playback state */
+    uint16_t outer_index;
+    uint16_t inner_index;
+    uint16_t segment_end;
+    uint16_t frame_index;
+    uint16_t delay;
+    bool nibble_high;
+    bool loop_taken;
+
+    /* Streamed indexes, unpacked into a ring as the player does */
+    uint8_t stream_ring [256];
+    uint8_t ring_write;
+    uint8_t ring_read;
+    uint32_t stream_in;
+    uint16_t stream_left;
+    uint16_t stream_words;
+    bool stream_looping;    /* The loop's indexes are being read */
+    uint8_t lz_literals;
+    uint8_t lz_match;
+    uint8_t lz_distance;
+    uint32_t lz_copy;       /* Source of a copy, or zero for a match from the ring */
+
+    /* Sample playing. Its register changes too quickly to follow tick by
+     * tick, so it is only given the sample's last value once it ends. */
+    uint8_t sample_channel;
+    uint8_t sample_final;
+    uint16_t sample_ticks;  /* Ticks until the sample ends, or zero if none is playing */
+
+    /* PSG */
+    uint8_t latch;
+    psg_state state;
+
+    /* Results of the most recent tick */
+    bool loop_frame;        /* The first frame after looping was read */
+    bool error;             /* Data was read from outside the music blob */
+    bool frame_read;        /* A frame was read */
+    uint8_t frame_fields;   /* Registers the frame wrote, as frame header bits, with noise as 0x08 */
+    uint8_t frame_low_only; /* Tones the frame wrote with only a latch byte */
+    psg_state frame_previous; /* Register state before the frame */
+} vgm_decoder;
+
+/* Apply a byte written to the PSG to a register state. */
+void psg_state_write (psg_state *state, uint8_t *latch, uint8_t data);
+
+/* Prepare to decode a music blob. */
+int vgm_decoder_init (vgm_decoder *decoder, const uint8_t *music, uint32_t music_size);
+
+/* Start a track, as track_start () does in the player. */
+int vgm_decoder_start (vgm_decoder *decoder, uint8_t track);
+
+/* Run one tick, as tick () does in the player. */
+void vgm_decoder_tick (vgm_decoder *decoder);
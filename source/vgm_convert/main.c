@@ -0,0 +1,226 @@
+/*
+ * vgm_convert
+ *
+ * Command line front-end for converting VGM files
+ * into a music blob for VGM-TapePlay.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vgm_read.h"
+#include "vgm_convert.h"
+
+
+/*
+ * Free the buffers holding the input files.
+ */
+static void free_vgm_data (uint8_t **vgm_data)
+{
+    for (int i = 0; i < TRACK_COUNT_MAX; i++)
+    {
+        free (vgm_data [i]);
+    }
+}
+
+
+/*
+ * Write the song profile as a header, for building a player
+ * with only the features that the song uses.
+ */
+static int write_profile (const char *filename, const vgm_song_profile *profile)
+{
+    FILE *profile_file = fopen (filename, "w");
+
+    if (profile_file == NULL)
+    {
+        fprintf (stderr, "Error: Unable to open %s for writing.\n", filename);
+        return -1;
+    }
+
+    fprintf (profile_file, "/* Song profile generated by vgm_convert */\n");
+    fprintf (profile_file, "#define SONG_TRACK_COUNT    %d\n", profile->track_count);
+    fprintf (profile_file, "#define SONG_RAW_FRAMES     %d\n", profile->raw);
+    fprintf (profile_file, "#define SONG_NIBBLE_FRAMES  %d\n", !profile->raw);
+    fprintf (profile_file, "#define SONG_USES_TONE_0    %d\n", (profile->fields & 0x01) != 0);
+    fprintf (profile_file, "#define SONG_USES_TONE_1    %d\n", (profile->fields & 0x02) != 0);
+    fprintf (profile_file, "#define SONG_USES_TONE_2    %d\n", (profile->fields & 0x04) != 0);
+    fprintf (profile_file, "#define SONG_USES_NOISE     %d\n", (profile->fields & 0x08) != 0);
+    fprintf (profile_file, "#define SONG_USES_VOLUME_0  %d\n", (profile->fields & 0x10) != 0);
+    fprintf (profile_file, "#define SONG_USES_VOLUME_1  %d\n", (profile->fields & 0x20) != 0);
+    fprintf (profile_file, "#define SONG_USES_VOLUME_2  %d\n", (profile->fields & 0x40) != 0);
+    fprintf (profile_file, "#define SONG_USES_VOLUME_3  %d\n", (profile->fields & 0x80) != 0);
+    fprintf (profile_file, "#define SONG_USES_LOW_ONLY  %d\n", profile->low_only);
+    fprintf (profile_file, "#define SONG_HEADER_MASK    0x%02x\n", profile->fields | (profile->low_only ? 0x08 : 0x00));
+    fprintf (profile_file, "#define SONG_FRAME_SIZE_MAX %d\n", profile->frame_size_max);
+    fprintf (profile_file, "#define SONG_CHECKPOINTS    %d\n", profile->checkpoints);
+    fprintf (profile_file, "#define SONG_SAMPLES        %d\n", profile->samples);
+    fprintf (profile_file, "#define SONG_STREAM         %d\n", profile->stream);
+
+    fclose (profile_file);
+
+    return 0;
+}
+
+
+/*
+ * Entry point.
+ *
+ * Converts each VGM file listed on the command
+ * line into a track, and writes the combined
+ * music blob for use with vgm_inject.
+ */
+int main (int argc, char **argv)
+{
+    char *output_filename = NULL;
+    char *profile_filename = NULL;
+    FILE *output_file = NULL;
+    vgm_convert_options options = { .pal = false, .cycle_budget = 0, .raw = false, .checkpoint_seconds = 0, .sub_frames = 0,
+                                     .stream = false, .banked = false };
+    uint8_t *vgm_data [TRACK_COUNT_MAX] = { NULL };
+    uint32_t vgm_size [TRACK_COUNT_MAX] = { 0 };
+    uint8_t *music = NULL;
+    uint32_t music_size = 0;
+
+    /* Skip the program name */
+    argc--;
+    argv++;
+
+    while (argc > 0 && argv [0][0] == '-')
+    {
+        /* Option to generate data for PAL consoles */
+        if (strcmp (argv [0], "--pal") == 0)
+        {
+            options.pal = true;
+            argc--;
+            argv++;
+        }
+        /* Option to store frames as raw PSG bytes, for faster playback. These take
+         * more of the 3968 bytes of frame data shared by all of the tracks. */
+        else if (strcmp (argv [0], "--raw") == 0)
+        {
+            options.raw = true;
+            argc--;
+            argv++;
+        }
+        /* Option to set the Z80 cycles available to each tick */
+        else if (strcmp (argv [0], "--cycle-budget") == 0 && argc >= 2)
+        {
+            options.cycle_budget = strtoul (argv [1], NULL, 0);
+            argc -= 2;
+            argv += 2;
+        }
+        /* Option to add seek checkpoints, every given number of seconds */
+        else if (strcmp (argv [0], "--checkpoints") == 0 && argc >= 2)
+        {
+            options.checkpoint_seconds = strtoul (argv [1], NULL, 0);
+            argc -= 2;
+            argv += 2;
+        }
+        /* Option to play ticks at timed points within each frame */
+        else if (strcmp (argv [0], "--sub-frames") == 0 && argc >= 2)
+        {
+            options.sub_frames = strtoul (argv [1], NULL, 0);
+            argc -= 2;
+            argv += 2;
+        }
+        /* Option to pack each track's indexes into a stream, for long songs */
+        else if (strcmp (argv [0], "--stream") == 0)
+        {
+            options.stream = true;
+            argc--;
+            argv++;
+        }
+        /* Option to lay out the music for a banked cartridge, allowing larger songs */
+        else if (strcmp (argv [0], "--banked") == 0)
+        {
+            options.banked = true;
+            argc--;
+            argv++;
+        }
+        else if (strcmp (argv [0], "--output") == 0 && argc >= 2)
+        {
+            output_filename = argv [1];
+            argc -= 2;
+            argv += 2;
+        }
+        /* Option to also write a profile of the features used by the song */
+        else if (strcmp (argv [0], "--profile") == 0 && argc >= 2)
+        {
+            profile_filename = argv [1];
+            argc -= 2;
+            argv += 2;
+        }
+        else
+        {
+            fprintf (stderr, "Error: Unknown option %s.\n", argv [0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (output_filename == NULL)
+    {
+        fprintf (stderr, "Error: No output file specified.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (argc > TRACK_COUNT_MAX)
+    {
+        fprintf (stderr, "Error: Too many VGM files, at most %d tracks are supported.\n", TRACK_COUNT_MAX);
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < argc; i++)
+    {
+        vgm_data [i] = read_file (argv [i], &vgm_size [i]);
+        if (vgm_data [i] == NULL)
+        {
+            free_vgm_data (vgm_data);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (vgm_convert (argc, (const uint8_t *const *) vgm_data, vgm_size, &options, &music, &music_size) != 0)
+    {
+        free_vgm_data (vgm_data);
+        return EXIT_FAILURE;
+    }
+
+    free_vgm_data (vgm_data);
+
+    if (profile_filename != NULL)
+    {
+        vgm_song_profile profile;
+
+        vgm_convert_profile (&profile);
+        if (write_profile (profile_filename, &profile) != 0)
+        {
+            free (music);
+            return EXIT_FAILURE;
+        }
+    }
+
+    output_file = fopen (output_filename, "wb");
+    if (output_file == NULL)
+    {
+        fprintf (stderr, "Error: Unable to open %s for writing.\n", output_filename);
+        free (music);
+        return EXIT_FAILURE;
+    }
+
+    if (fwrite (music, 1, music_size, output_file) != music_size)
+    {
+        fprintf (stderr, "Error: Unable to write %d bytes to %s.\n", music_size, output_filename);
+        fclose (output_file);
+        free (music);
+        return EXIT_FAILURE;
+    }
+
+    fclose (output_file);
+    free (music);
+
+    return EXIT_SUCCESS;
+}
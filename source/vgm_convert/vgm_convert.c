@@ -1,11 +1,17 @@
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "vgm_read.h"
+#include "vgm_convert.h"
+#include "../vgm_check/vgm_decode.h"
 
 #define OUTPUT_SIZE_MAX  32768      /*  32 KiB */
+#define BANKED_SIZE_MAX  61440      /*  60 KiB, for a banked cartridge, as blob offsets are 16 bits */
+#define BANK_SIZE        16384      /*  16 KiB, the Sega mapper's bank size */
+#define INDEX_COUNT_MAX  32768      /*  Indexes in one track, before compression */
 
 /* A struct to represent the psg registers */
 /* For now, just tones. Noise should be added later */
@@ -23,17 +29,34 @@ typedef struct psg_regs_s
 
 static uint16_t frame_length = 735;
 
+/* With sub-frame slots, each tick is a fraction of a frame. Sample
+ * counts are scaled up by the number of slots, so that frame_length
+ * stays a whole number. */
+static uint8_t sub_frames = 1;
+
 #define TONE_0_BIT      0x01
 #define TONE_1_BIT      0x02
 #define TONE_2_BIT      0x04
 #define NOISE_BIT       0x08
+#define EXTEND_BIT      0x08 /* Shares the noise bit in the frame header */
 #define VOLUME_0_BIT    0x10
 #define VOLUME_1_BIT    0x20
 #define VOLUME_2_BIT    0x40
 #define VOLUME_3_BIT    0x80
 
+#define EXTEND_LOW_ONLY 0x08
+
+/* Register state assumed by the player when a track starts */
+static const psg_regs initial_state = {
+    .volume_0 = 0x0f,
+    .volume_1 = 0x0f,
+    .volume_2 = 0x0f,
+    .volume_3 = 0x0f
+};
+
 /* State tracking */
 static psg_regs current_state = { 0 };
+static psg_regs previous_state = { 0 };
 static uint32_t samples_delay = 0;
 
 /* Unique frames. Note that:
@@ -41,45 +64,552 @@ static uint32_t samples_delay = 0;
  *  2. A zero-frame is pre-populated at the start for use with delay-only indexes. */
 static uint8_t  frame_data [OUTPUT_SIZE_MAX + 10] = { 0 };
 static uint32_t frame_data_size = 1;
+static bool frame_data_full = false;    /* A new frame would start where it cannot be indexed */
 
 /* Index of each unique frame to speed up matching. */
 static uint16_t frame_indexes [OUTPUT_SIZE_MAX + 10] = { 0 };
 static uint16_t frame_count = 1;
 
-/* Indexes into frame data to be used for playback. */
+/* Indexes into frame data to be used for playback, for the current track. */
 /* Note: two bytes per index is pretty big, we probably need ~12 bits.
  *       Consider:
  *        - nibble-packing.
  *        - Storing delay in the extra bits. */
-static uint16_t index_data [OUTPUT_SIZE_MAX + 10] = { 0 };
+static uint16_t index_data [INDEX_COUNT_MAX + 10] = { 0 };
 static uint16_t index_data_count = 0;
 static uint16_t loop_frame_index = 0;
 
-static uint16_t compressed_index_data [OUTPUT_SIZE_MAX + 10] = {};
+/* Frame indexes from 0xfc0 up are not used for frames, and instead
+ * encode a long rest of up to 512 frames in a single index. */
+#define REST_INDEX_MASK 0x0fc0
+#define REST_LENGTH_MAX 512
+
+/* Frame indexes from 0xf80 to 0xfbf trigger one of 64 samples. These
+ * take no time, and come before the frame for the same tick. */
+#define SAMPLE_INDEX    0x0f80
+
+/* Frames must start below the sample and rest indexes, which leaves
+ * 3968 bytes of frame data that can be indexed. */
+#define FRAME_DATA_INDEXABLE SAMPLE_INDEX
+
+/* Compressed indexes for all tracks, stored back-to-back.
+ * Segment references may point into earlier tracks. */
+static uint16_t compressed_index_data [BANKED_SIZE_MAX / 2 + INDEX_COUNT_MAX + 10] = {};
 static uint16_t compressed_index_data_count = 0;
-static uint16_t loop_frame_index_outer = 0;
-static uint16_t loop_frame_index_inner = 0;
-static uint16_t loop_frame_segment_end = 0;
 
-#define TOTAL_SIZE (frame_data_size + compressed_index_data_count * 2)
+/* Position of each track within compressed_index_data */
+typedef struct track_info_s
+{
+    uint16_t start;
+    uint16_t end;
+    uint16_t loop_outer;
+    uint16_t loop_inner;
+    uint16_t loop_segment_end;
+} track_info;
+
+static track_info tracks [TRACK_COUNT_MAX] = { };
+static uint8_t track_count = 0;
+
+/* Streamed indexes. Each track's indexes are stored flat, without segment
+ * references, and packed with a byte-oriented LZ that the player unpacks a
+ * few bytes at a time into a 256-byte ring. The indexes before the loop
+ * point and the loop itself are packed separately, so that the player can
+ * start the loop again with an empty window.
+ *
+ * As the packed streams stay in memory, repeats from further back than the
+ * ring are copied from any earlier bytes of the streams that match, which
+ * takes no more RAM.
+ *
+ * Token format:
+ *  0x00-0x7f - A run of token + 1 literal bytes, which follow
+ *  0x80-0xbf - A match of (token & 0x3f) + 3 bytes from the ring, followed
+ *              by a byte holding how far back it starts, 1-255
+ *  0xc0-0xff - A copy of (token & 0x3f) + 4 bytes from the packed streams,
+ *              followed by its 16-bit offset from the start of the streams
+ */
+#define STREAM_WINDOW       255
+#define STREAM_LITERAL_MAX  128
+#define STREAM_MATCH_MIN    3
+#define STREAM_COPY_MIN     4
+#define STREAM_LENGTH_MAX   64      /* Added to the minimum length */
+#define STREAM_FILL_BYTES   6       /* Unpacked by the player each tick */
+#define CYCLES_STREAM_BYTE  120     /* Unpacking one byte in stream_unpack () */
+static bool stream_indexes = false;
+static uint8_t  stream_bytes [(INDEX_COUNT_MAX + 10) * 2];
+static uint8_t  stream_data [BANKED_SIZE_MAX + (INDEX_COUNT_MAX + 10) * 3];
+static uint32_t stream_data_size = 0;
+
+/* Checkpoints, each holding the player's position and the PSG registers,
+ * so that the player can seek within a track without playing up to it. */
+#define CHECKPOINT_SIZE     17
+#define CHECKPOINT_MAX      255     /* For each track */
+#define CHECKPOINT_DATA_MAX (2 + TRACK_COUNT_MAX * (2 + 1 + CHECKPOINT_MAX * CHECKPOINT_SIZE))
+static uint16_t checkpoint_interval = 0;    /* In ticks, or zero for no checkpoints */
+static uint32_t checkpoint_count = 0;       /* For all tracks */
+static uint32_t checkpoint_data_size = 0;
+
+/* Samples. Some VGMs play PCM by writing a volume register thousands of
+ * times a second, which would be lost when the writes are gathered into
+ * frames. Each run of such writes is resampled into a block of 4-bit
+ * samples, which the player writes to the register at a fixed rate.
+ *
+ * Block format:
+ *  uint8_t    latch, 0x90 | channel << 5
+ *  uint8_t    period, delay loops between samples
+ *  uint16_t   length, in bytes
+ *  uint8_t    data [length], two samples per byte, low nibble first
+ */
+#define SAMPLE_COUNT_MAX    64
+#define SAMPLE_HEADER_SIZE  4
+#define SAMPLE_DATA_MAX     16384
+#define SAMPLE_GAP_MAX      44      /* Longest wait within a run, in 44.1 kHz samples, for 1 kHz */
+#define SAMPLE_WRITES_MIN   32      /* Fewest volume writes that make a run */
+#define SAMPLE_WRITES_MAX   8192    /* Most volume writes in one sample */
+#define SAMPLE_RUNS_MAX     1024    /* For each track */
+#define SAMPLE_NONE         0xff
+static uint8_t  sample_data [SAMPLE_DATA_MAX];
+static uint32_t sample_data_size = 0;
+static uint16_t sample_offsets [SAMPLE_COUNT_MAX];  /* Of each block within sample_data */
+static uint8_t  sample_count = 0;
+
+/* Z80 cycles for sample_play () in the player to write two samples, and the
+ * cycles added for each unit of the period. These must match the player. */
+#define CYCLES_SAMPLE_PAIR  203
+#define CYCLES_SAMPLE_DELAY 26
+#define SAMPLE_PERIOD_MAX   250
+#define Z80_CLOCK_NTSC      3579545
+#define Z80_CLOCK_PAL       3546893
+
+/* Runs of volume writes within the current track, to be played as samples */
+typedef struct sample_run_s
+{
+    uint32_t start;         /* Offset of the first write's command */
+    uint32_t end;           /* Offset of the last write's command */
+    uint8_t channel;
+    uint8_t sample;
+} sample_run;
+
+static sample_run sample_runs [SAMPLE_RUNS_MAX];
+static uint32_t sample_run_count = 0;
+static uint32_t sample_run_next = 0;            /* Next run to be reached */
+static const sample_run *sample_active = NULL;  /* Run being played as a sample */
+static uint8_t sample_pending = SAMPLE_NONE;    /* To trigger with the next frame written */
+
+/* Volume writes to each channel that may become a sample */
+static uint32_t candidate_times [4][SAMPLE_WRITES_MAX];
+static uint8_t  candidate_values [4][SAMPLE_WRITES_MAX];
+static uint32_t candidate_start [4];
+static uint32_t candidate_end [4];
+static uint32_t candidate_length [4];
+
+/* The music blob, as loaded by the player */
+#define MUSIC_HEADER_SIZE   10
+#define TRACK_INFO_SIZE     10
+#define MUSIC_FLAG_RAW      0x01    /* Frames are stored as raw PSG bytes */
+#define MUSIC_FLAG_PAL      0x02    /* Ticks are 1/50s, rather than 1/60s */
+#define MUSIC_SLOTS_SHIFT   2       /* Two bits of flags hold the sub-frame slots, less one */
+#define MUSIC_FLAG_STREAM   0x10    /* Indexes are packed into a stream for each track */
+static uint8_t music_blob [MUSIC_HEADER_SIZE + TRACK_COUNT_MAX * TRACK_INFO_SIZE + sizeof (frame_data) +
+                          sizeof (compressed_index_data) + sizeof (stream_data) +
+                          SAMPLE_COUNT_MAX * 2 + SAMPLE_DATA_MAX + CHECKPOINT_DATA_MAX + 4 * BANK_SIZE] = { 0 };
+
+/* For a banked cartridge, vgm_inject places the index data at the start
+ * of a 16 KiB bank, and the rest of the blob in the banks that follow.
+ * The header, track table, and frames stay in the fixed part of the ROM. */
+static bool banked_layout = false;
+static uint32_t output_size_max = OUTPUT_SIZE_MAX;
+
+#define TOTAL_SIZE (frame_data_size + compressed_index_data_count * 2 + stream_data_size + \
+                    sample_count * 2 + sample_data_size)
 
 /* Holding space for newly generated frame */
-#define FRAME_SIZE_MAX 8
+#define FRAME_SIZE_MAX 12
 static uint8_t new_frame [FRAME_SIZE_MAX] = { 0 };
 
+/* Register changes that could not be heard, indexed by channel, for tones 0-2 and noise */
+static uint32_t dead_writes [4] = { 0 };    /* Changes left out of a frame */
+static uint32_t deferred_writes [4] = { 0 }; /* Of those, changes written later when un-muted */
+static bool deferred_pending [4] = { false };
+static uint16_t deferred_value [4] = { 0 }; /* Latest change counted while pending */
+
+/* Tone changes stored as a low nibble only */
+static uint32_t low_only_writes = 0;
+
+/* Estimated Z80 cycles for the player to apply a frame. These approximate
+ * the sdcc output for tick () and bar_update (), and are used to keep the
+ * work done in each tick within the time available. */
+#define CYCLES_TICK         400     /* Index handling, done on every tick */
+#define CYCLES_FRAME        300     /* Reading and testing the frame header */
+#define CYCLES_NIBBLE       120     /* One call to nibble_read () */
+#define CYCLES_PSG_WRITE    40      /* Forming and writing one PSG byte */
+#define CYCLES_BAR          250     /* Calling bar_update () and finding the rows to draw */
+#define CYCLES_BAR_ROW      100     /* Writing one row of a bar into the meter shadow */
+#define CYCLES_METER_FLUSH  300     /* Setting up the single SG_loadTileMap () of the dirty rows */
+#define CYCLES_METER_BYTE   26      /* One byte of the meter shadow sent to VRAM */
+
+#define CYCLES_RAW_BYTE     21      /* One byte sent to the PSG with otir, for raw frames */
+
+/* Default budget: The vertical blanking period, 70 lines for NTSC
+ * or 121 lines for PAL, at 228 cycles per line. */
+#define CYCLE_BUDGET_NTSC   (70 * 228)
+#define CYCLE_BUDGET_PAL    (121 * 228)
+
+static uint32_t cycle_budget = CYCLE_BUDGET_NTSC;
+static bool raw_frames = false;             /* Store frames as ready-to-send PSG bytes */
+static bool pal_ticks = false;              /* Ticks are 1/50s, rather than 1/60s */
+
+/* Features used by the song, for building a player without the rest */
+static uint8_t profile_fields = 0;          /* Fields written, as frame header bits */
+static bool profile_low_only = false;       /* Low-only tone writes were used */
+static uint8_t profile_frame_size_max = 0;
+static bool budget_deferred = false;        /* Changes were left for the next tick */
+static uint8_t budget_held = 0;             /* Fields left out of the previous frame */
+static bool budget_late = false;            /* A field was left out of two frames in a row */
+static uint32_t budget_late_tick = 0;
+static uint32_t track_ticks = 0;            /* Ticks in the current track so far */
+static uint32_t frame_cost = 0;             /* Cost of the most recent frame */
+static uint32_t worst_frame_cost = 0;       /* For the current track */
+static uint32_t worst_song_cost = 0;        /* For all tracks */
+static uint32_t split_frames = 0;           /* Frames split across ticks to fit the budget */
+static uint32_t over_budget_frames = 0;     /* Frames that could not be split enough */
+
+/* Fields that have not been written since the loop point. When the track
+ * loops, the registers hold their values from the end of the track rather
+ * than from before the loop point, so the first write to each field after
+ * the loop point is kept even if it matches previous_state. The high bits
+ * of the tones are tracked separately, so that a latch-only write after the
+ * loop point keeps the high bits from the end of the track, as it would on
+ * a VGM player. */
+static const uint8_t latch_fields [8] = { TONE_0_BIT, VOLUME_0_BIT, TONE_1_BIT, VOLUME_1_BIT,
+                                          TONE_2_BIT, VOLUME_2_BIT, NOISE_BIT,  VOLUME_3_BIT };
+static uint8_t loop_untouched = 0;
+static uint8_t loop_high_untouched = 0;
+static uint8_t loop_first_write = 0;        /* Written since the loop point, but not yet output */
+static uint8_t loop_high_first_write = 0;   /* Tone high bits written since the loop point, but not yet output */
+static bool loop_flush = false;             /* Writing the frame before the loop point */
+
 /* TODO: For PAL music, perhaps define delay as multiples of 1/50, or have
  *       a shorter delay like 1/300 that can cleanly describe both PAL and
  *       NTSC timings. */
 
 
+/*
+ * Find which of the tone and noise register changes can be heard.
+ *
+ * A tone change on a muted channel, or a noise change with the noise
+ * channel muted, is left out of the frame. The player keeps the old
+ * value until the channel is un-muted, at which point the difference
+ * from previous_state causes the new value to be written. Changes that
+ * are overwritten or reverted before then are dropped entirely.
+ *
+ * Note that tone2 is also audible through the noise channel when the
+ * noise is clocked from tone2.
+ *
+ * After the loop point, a volume that has not been written yet holds its
+ * value from the end of the track on later passes, so until then the
+ * channel is treated as audible.
+ *
+ * The frame before the loop point writes out any change that is still
+ * held back. Otherwise it would be written after the loop point, where
+ * it would replace the values from the end of the track on later passes.
+ */
+static uint8_t audible_changes (void)
+{
+    uint8_t audible = 0;
+    bool noise_audible = (current_state.volume_3 != 0x0f || (loop_untouched & VOLUME_3_BIT));
+
+    if (loop_flush)
+    {
+        return TONE_0_BIT | TONE_1_BIT | TONE_2_BIT | NOISE_BIT;
+    }
+
+    if (current_state.volume_0 != 0x0f || (loop_untouched & VOLUME_0_BIT))
+    {
+        audible |= TONE_0_BIT;
+    }
+    if (current_state.volume_1 != 0x0f || (loop_untouched & VOLUME_1_BIT))
+    {
+        audible |= TONE_1_BIT;
+    }
+    if (current_state.volume_2 != 0x0f || (loop_untouched & VOLUME_2_BIT) ||
+        (noise_audible && (current_state.noise & 0x03) == 0x03))
+    {
+        audible |= TONE_2_BIT;
+    }
+    if (noise_audible)
+    {
+        audible |= NOISE_BIT;
+    }
+
+    return audible;
+}
+
+
+/*
+ * Update the dead-write statistics for one channel, given the value in the
+ * VGM and the value last written. A muted change stays different from the
+ * written value for every frame until it is heard, so each distinct value
+ * is only counted once. It is deferred if it is the value written when the
+ * channel is un-muted, and dropped otherwise.
+ */
+static void dead_write_count (uint8_t channel, uint16_t value, uint16_t written, bool audible)
+{
+    if (value != written && !audible)
+    {
+        if (!deferred_pending [channel] || value != deferred_value [channel])
+        {
+            dead_writes [channel]++;
+            deferred_value [channel] = value;
+            deferred_pending [channel] = true;
+        }
+    }
+    else if (value != written && deferred_pending [channel])
+    {
+        if (value == deferred_value [channel])
+        {
+            deferred_writes [channel]++;
+        }
+        deferred_pending [channel] = false;
+    }
+    else if (value == written)
+    {
+        deferred_pending [channel] = false;
+    }
+}
+
+
+/*
+ * Estimate the cycles taken by a call to bar_update ().
+ * The rows drawn match the fall-through in the player.
+ * The rows are added to the dirty range of the meter shadow.
+ */
+static uint32_t bar_cost (uint8_t value, uint8_t previous, uint8_t *dirty_first, uint8_t *dirty_last)
+{
+    uint8_t first = (((value < previous) ? value : previous) + 1) >> 1;
+    uint8_t last =  (((value > previous) ? value : previous) + 1) >> 1;
+
+    if (last > 7)
+    {
+        last = 7;
+    }
+
+    if (first > last)
+    {
+        return CYCLES_BAR;
+    }
+
+    if (first < *dirty_first)
+    {
+        *dirty_first = first;
+    }
+    if (last > *dirty_last)
+    {
+        *dirty_last = last;
+    }
+
+    return CYCLES_BAR + (last - first + 1) * CYCLES_BAR_ROW;
+}
+
+
+/*
+ * Estimate the cycles taken by meter_flush () to send the
+ * dirty rows of the meter shadow to VRAM in one burst.
+ */
+static uint32_t meter_flush_cost (uint8_t dirty_first, uint8_t dirty_last)
+{
+    if (dirty_first > dirty_last)
+    {
+        return 0;
+    }
+
+    return CYCLES_METER_FLUSH + ((dirty_last - dirty_first) * 32 + 16) * CYCLES_METER_BYTE;
+}
+
+
+/*
+ * Choose which of the changed fields fit within the cycle budget.
+ *
+ * Fields held back from the previous tick are taken first, then the
+ * rest, each in the order they appear in the frame. A field that does
+ * not fit is skipped, and a smaller one after it may still be taken.
+ * The first field is always taken, so that each tick makes progress.
+ * The estimated cost is left in frame_cost.
+ *
+ * A change may only be held back for one tick. If a field is left out
+ * of two frames in a row, budget_late is set and the conversion fails.
+ */
+static uint8_t budget_changes (uint8_t changes, uint8_t low_only)
+{
+    static const uint8_t field_order [8] = { NOISE_BIT, TONE_0_BIT, TONE_1_BIT, TONE_2_BIT,
+                                             VOLUME_0_BIT, VOLUME_1_BIT, VOLUME_2_BIT, VOLUME_3_BIT };
+    uint8_t volume [4] = { current_state.volume_0, current_state.volume_1,
+                           current_state.volume_2, current_state.volume_3 };
+    uint8_t previous_volume [4] = { previous_state.volume_0, previous_state.volume_1,
+                                    previous_state.volume_2, previous_state.volume_3 };
+    uint8_t dirty_first = 8;
+    uint8_t dirty_last = 0;
+    uint8_t selected = 0;
+
+    frame_cost = CYCLES_TICK + CYCLES_FRAME;
+
+    /* The first pass takes the held-back fields, and the second the rest */
+    for (int i = 0; i < 16; i++)
+    {
+        uint8_t field = field_order [i % 8];
+        uint8_t field_dirty_first = dirty_first;
+        uint8_t field_dirty_last = dirty_last;
+        uint32_t field_cost;
+
+        if (!(changes & field) || (i < 8) != ((budget_held & field) != 0))
+        {
+            continue;
+        }
+
+        if (raw_frames)
+        {
+            field_cost = ((field & (TONE_0_BIT | TONE_1_BIT | TONE_2_BIT)) && !(low_only & field)) ? CYCLES_RAW_BYTE * 2
+                                                                                                 : CYCLES_RAW_BYTE;
+        }
+        else if (field == NOISE_BIT)
+        {
+            field_cost = CYCLES_PSG_WRITE;
+        }
+        else if (field & (TONE_0_BIT | TONE_1_BIT | TONE_2_BIT))
+        {
+            field_cost = (low_only & field) ? (CYCLES_NIBBLE + CYCLES_PSG_WRITE)
+                                            : (CYCLES_NIBBLE * 3 + CYCLES_PSG_WRITE * 2);
+        }
+        else
+        {
+            field_cost = CYCLES_NIBBLE + CYCLES_PSG_WRITE;
+        }
+
+        /* The first field that needs the extension nibble also pays for reading it */
+        if (!raw_frames && (field == NOISE_BIT || (low_only & field)) && !(selected & (NOISE_BIT | low_only)))
+        {
+            field_cost += CYCLES_NIBBLE;
+        }
+
+        /* Volume changes also redraw the meter, widening the burst sent by meter_flush () */
+        if (field & (VOLUME_0_BIT | VOLUME_1_BIT | VOLUME_2_BIT | VOLUME_3_BIT))
+        {
+            field_cost += bar_cost (volume [i % 8 - 4], previous_volume [i % 8 - 4], &field_dirty_first, &field_dirty_last);
+            field_cost += meter_flush_cost (field_dirty_first, field_dirty_last) - meter_flush_cost (dirty_first, dirty_last);
+        }
+
+        if (selected && frame_cost + field_cost > cycle_budget)
+        {
+            continue;
+        }
+
+        selected |= field;
+        frame_cost += field_cost;
+        dirty_first = field_dirty_first;
+        dirty_last = field_dirty_last;
+    }
+
+    if (frame_cost > cycle_budget)
+    {
+        over_budget_frames++;
+    }
+    if ((budget_held & changes & ~selected) && !budget_late)
+    {
+        budget_late = true;
+        budget_late_tick = track_ticks;
+    }
+    budget_held = changes & ~selected;
+    if (frame_cost > worst_frame_cost)
+    {
+        worst_frame_cost = frame_cost;
+    }
+
+    return selected;
+}
+
+
+/*
+ * Convert the selected register changes into a raw frame,
+ * for players that send the frame straight to the PSG.
+ *
+ * Frame format:
+ *
+ *  Header: vvvv nnnn
+ *
+ *  nnnn -> Number of PSG bytes that follow, 0 to 11
+ *  vvvv -> Volumes written, using the same bits as nibble-packed
+ *          frames. The volume bytes are the last bytes of the
+ *          frame, in channel order, for updating the meters.
+ *
+ *  PSG bytes are in the order: noise, tone0-2, volume0-3.
+ *  Tones are a latch byte and data byte, or only the latch
+ *  byte if the high bits have not changed.
+ */
+static uint16_t generate_raw_frame (uint8_t selected, uint8_t low_only)
+{
+    uint16_t tone [3] = { current_state.tone_0, current_state.tone_1, current_state.tone_2 };
+    uint8_t volume [4] = { current_state.volume_0, current_state.volume_1,
+                           current_state.volume_2, current_state.volume_3 };
+    uint8_t frame_size = 1;
+
+    memset (new_frame, 0, sizeof (new_frame));
+
+    if (selected & NOISE_BIT)
+    {
+        new_frame [frame_size++] = 0x80 | 0x60 | (current_state.noise & 0x07);
+        previous_state.noise = current_state.noise;
+    }
+
+    for (uint8_t channel = 0; channel < 3; channel++)
+    {
+        if (selected & (TONE_0_BIT << channel))
+        {
+            new_frame [frame_size++] = 0x80 | (channel << 5) | (tone [channel] & 0x00f);
+            if (low_only & (TONE_0_BIT << channel))
+            {
+                low_only_writes++;
+            }
+            else
+            {
+                new_frame [frame_size++] = (tone [channel] & 0x3f0) >> 4;
+            }
+        }
+    }
+    previous_state.tone_0 = (selected & TONE_0_BIT) ? current_state.tone_0 : previous_state.tone_0;
+    previous_state.tone_1 = (selected & TONE_1_BIT) ? current_state.tone_1 : previous_state.tone_1;
+    previous_state.tone_2 = (selected & TONE_2_BIT) ? current_state.tone_2 : previous_state.tone_2;
+
+    for (uint8_t channel = 0; channel < 4; channel++)
+    {
+        if (selected & (VOLUME_0_BIT << channel))
+        {
+            new_frame [0] |= VOLUME_0_BIT << channel;
+            new_frame [frame_size++] = 0x80 | (channel << 5) | 0x10 | (volume [channel] & 0x0f);
+        }
+    }
+    previous_state.volume_0 = (selected & VOLUME_0_BIT) ? current_state.volume_0 : previous_state.volume_0;
+    previous_state.volume_1 = (selected & VOLUME_1_BIT) ? current_state.volume_1 : previous_state.volume_1;
+    previous_state.volume_2 = (selected & VOLUME_2_BIT) ? current_state.volume_2 : previous_state.volume_2;
+    previous_state.volume_3 = (selected & VOLUME_3_BIT) ? current_state.volume_3 : previous_state.volume_3;
+
+    new_frame [0] |= frame_size - 1;
+
+    return frame_size;
+}
+
+
 /*
  * Convert a collection of register writes into a
  * nibble-packed format for the micro controller.
+ *
+ * If the changes would take the player too long to apply in one
+ * tick, only the first part is written and budget_deferred is set.
  */
 uint16_t generate_frame (void)
 {
-    static psg_regs previous_state;
-
+    uint8_t audible = audible_changes ();
+    uint8_t changes = 0;
+    uint8_t selected = 0;
+    uint8_t low_only = 0;
     uint8_t frame_size = 1;
 
     uint8_t nibble [16] = { 0 };
@@ -90,16 +620,22 @@ uint16_t generate_frame (void)
 
     /* Frame format description:
      *
-     *  Bitfields: vvvv nttt
+     *  Bitfields: vvvv xttt
      *
-     *  nttt -> 0001: Tone0 nibbles follow (3)
-     *          0010: Tone1 nibbles follow (3)
-     *          0100: Tone2 nibbles follow (3)
-     *          1000: Noise nibble follows
+     *  xttt -> 0001: Tone0 nibbles follow (3, or 1 if low-only)
+     *          0010: Tone1 nibbles follow (3, or 1 if low-only)
+     *          0100: Tone2 nibbles follow (3, or 1 if low-only)
+     *          1000: Extension nibble follows
      *
      *          Nibbles are packed least-significant nibble first.
      *          Within an output bytes, the least-significant nibble comes first.
      *
+     *  Extension nibble, which comes before the tone nibbles:
+     *
+     *          0nnn: Noise register value
+     *          1ttt: Low-only flags, using the same bits as xttt.
+     *                Only the low nibble of these tones is stored, and
+     *                the player updates them with a single latch byte.
      *
      *  vvvv -> 0001: Tone0 volume nibble follows
      *       -> 0010: Tone1 volume nibble follows
@@ -111,65 +647,187 @@ uint16_t generate_frame (void)
      */
 
     /* Tone0 */
-    if (current_state.tone_0 != previous_state.tone_0)
+    dead_write_count (0, current_state.tone_0, previous_state.tone_0, audible & TONE_0_BIT);
+    if ((current_state.tone_0 != previous_state.tone_0 || ((loop_first_write | loop_high_first_write) & TONE_0_BIT)) &&
+        (audible & TONE_0_BIT))
+    {
+        changes |= TONE_0_BIT;
+        if (((current_state.tone_0 ^ previous_state.tone_0) & 0x3f0) == 0 && !(loop_high_first_write & TONE_0_BIT))
+        {
+            low_only |= TONE_0_BIT;
+        }
+    }
+
+    /* Tone1 */
+    dead_write_count (1, current_state.tone_1, previous_state.tone_1, audible & TONE_1_BIT);
+    if ((current_state.tone_1 != previous_state.tone_1 || ((loop_first_write | loop_high_first_write) & TONE_1_BIT)) &&
+        (audible & TONE_1_BIT))
+    {
+        changes |= TONE_1_BIT;
+        if (((current_state.tone_1 ^ previous_state.tone_1) & 0x3f0) == 0 && !(loop_high_first_write & TONE_1_BIT))
+        {
+            low_only |= TONE_1_BIT;
+        }
+    }
+
+    /* Tone2 */
+    dead_write_count (2, current_state.tone_2, previous_state.tone_2, audible & TONE_2_BIT);
+    if ((current_state.tone_2 != previous_state.tone_2 || ((loop_first_write | loop_high_first_write) & TONE_2_BIT)) &&
+        (audible & TONE_2_BIT))
+    {
+        changes |= TONE_2_BIT;
+        if (((current_state.tone_2 ^ previous_state.tone_2) & 0x3f0) == 0 && !(loop_high_first_write & TONE_2_BIT))
+        {
+            low_only |= TONE_2_BIT;
+        }
+    }
+
+    /* Noise */
+    dead_write_count (3, current_state.noise, previous_state.noise, audible & NOISE_BIT);
+    if ((current_state.noise != previous_state.noise || (loop_first_write & NOISE_BIT)) && (audible & NOISE_BIT))
+    {
+        changes |= NOISE_BIT;
+
+        /* The noise value takes priority over the low-only
+         * flags for the extension nibble, so tones are written
+         * in full when the noise changes */
+        if (!raw_frames)
+        {
+            low_only = 0;
+        }
+    }
+
+    /* Volumes */
+    if (current_state.volume_0 != previous_state.volume_0 || (loop_first_write & VOLUME_0_BIT))
+    {
+        changes |= VOLUME_0_BIT;
+    }
+    if (current_state.volume_1 != previous_state.volume_1 || (loop_first_write & VOLUME_1_BIT))
+    {
+        changes |= VOLUME_1_BIT;
+    }
+    if (current_state.volume_2 != previous_state.volume_2 || (loop_first_write & VOLUME_2_BIT))
+    {
+        changes |= VOLUME_2_BIT;
+    }
+    if (current_state.volume_3 != previous_state.volume_3 || (loop_first_write & VOLUME_3_BIT))
+    {
+        changes |= VOLUME_3_BIT;
+    }
+
+    /* Anything that does not fit in this tick is left in previous_state
+     * as unchanged, to be picked up by the next frame */
+    selected = budget_changes (changes, low_only);
+    budget_deferred = (selected != changes);
+    low_only &= selected;
+    loop_first_write &= ~selected;
+    loop_high_first_write &= ~selected;
+
+    profile_fields |= selected;
+    if (low_only)
+    {
+        profile_low_only = true;
+    }
+
+    if (raw_frames)
+    {
+        return generate_raw_frame (selected, low_only);
+    }
+
+    /* Extension nibble */
+    if (selected & NOISE_BIT)
+    {
+        new_frame [0] |= EXTEND_BIT;
+        nibble [nibble_count++] = current_state.noise & 0x07;
+        previous_state.noise = current_state.noise;
+    }
+    else if (low_only)
+    {
+        new_frame [0] |= EXTEND_BIT;
+        nibble [nibble_count++] = EXTEND_LOW_ONLY | low_only;
+    }
+
+    /* Tone0 */
+    if (selected & TONE_0_BIT)
     {
         new_frame [0] |= TONE_0_BIT;
         nibble [nibble_count++] = (current_state.tone_0 & 0x00f);
-        nibble [nibble_count++] = (current_state.tone_0 & 0x0f0) >> 4;
-        nibble [nibble_count++] = (current_state.tone_0 & 0x300) >> 8;
+        if (!(low_only & TONE_0_BIT))
+        {
+            nibble [nibble_count++] = (current_state.tone_0 & 0x0f0) >> 4;
+            nibble [nibble_count++] = (current_state.tone_0 & 0x300) >> 8;
+        }
+        else
+        {
+            low_only_writes++;
+        }
+        previous_state.tone_0 = current_state.tone_0;
     }
 
     /* Tone1 */
-    if (current_state.tone_1 != previous_state.tone_1)
+    if (selected & TONE_1_BIT)
     {
         new_frame [0] |= TONE_1_BIT;
         nibble [nibble_count++] = (current_state.tone_1 & 0x00f);
-        nibble [nibble_count++] = (current_state.tone_1 & 0x0f0) >> 4;
-        nibble [nibble_count++] = (current_state.tone_1 & 0x300) >> 8;
+        if (!(low_only & TONE_1_BIT))
+        {
+            nibble [nibble_count++] = (current_state.tone_1 & 0x0f0) >> 4;
+            nibble [nibble_count++] = (current_state.tone_1 & 0x300) >> 8;
+        }
+        else
+        {
+            low_only_writes++;
+        }
+        previous_state.tone_1 = current_state.tone_1;
     }
 
     /* Tone2 */
-    if (current_state.tone_2 != previous_state.tone_2)
+    if (selected & TONE_2_BIT)
     {
         new_frame [0] |= TONE_2_BIT;
         nibble [nibble_count++] = (current_state.tone_2 & 0x00f);
-        nibble [nibble_count++] = (current_state.tone_2 & 0x0f0) >> 4;
-        nibble [nibble_count++] = (current_state.tone_2 & 0x300) >> 8;
-    }
-
-    /* Noise */
-    if (current_state.noise != previous_state.noise)
-    {
-        new_frame [0] |= NOISE_BIT;
-        nibble [nibble_count++] = current_state.noise & 0x0f;
+        if (!(low_only & TONE_2_BIT))
+        {
+            nibble [nibble_count++] = (current_state.tone_2 & 0x0f0) >> 4;
+            nibble [nibble_count++] = (current_state.tone_2 & 0x300) >> 8;
+        }
+        else
+        {
+            low_only_writes++;
+        }
+        previous_state.tone_2 = current_state.tone_2;
     }
 
     /* Volume 0 */
-    if (current_state.volume_0 != previous_state.volume_0)
+    if (selected & VOLUME_0_BIT)
     {
         new_frame [0] |= VOLUME_0_BIT;
         nibble [nibble_count++] = current_state.volume_0 & 0x0f;
+        previous_state.volume_0 = current_state.volume_0;
     }
 
     /* Volume 1 */
-    if (current_state.volume_1 != previous_state.volume_1)
+    if (selected & VOLUME_1_BIT)
     {
         new_frame [0] |= VOLUME_1_BIT;
         nibble [nibble_count++] = current_state.volume_1 & 0x0f;
+        previous_state.volume_1 = current_state.volume_1;
     }
 
     /* Volume 2 */
-    if (current_state.volume_2 != previous_state.volume_2)
+    if (selected & VOLUME_2_BIT)
     {
         new_frame [0] |= VOLUME_2_BIT;
         nibble [nibble_count++] = current_state.volume_2 & 0x0f;
+        previous_state.volume_2 = current_state.volume_2;
     }
 
     /* Volume 3 */
-    if (current_state.volume_3 != previous_state.volume_3)
+    if (selected & VOLUME_3_BIT)
     {
         new_frame [0] |= VOLUME_3_BIT;
         nibble [nibble_count++] = current_state.volume_3 & 0x0f;
+        previous_state.volume_3 = current_state.volume_3;
     }
 
     /* Pack nibbles */
@@ -194,8 +852,6 @@ uint16_t generate_frame (void)
         frame_size++;
     }
 
-    memcpy (&previous_state, &current_state, sizeof (psg_regs));
-
     return frame_size;
 }
 
@@ -210,13 +866,23 @@ uint16_t generate_frame (void)
  *  [15]     - Always output 0, reserved for use by compression
  *  [14..12] - Delay, 1/60 to 8/60s
  *  [11..0]  - Index into frame data
+ *
+ * Long rest format, used for delays after the first 8/60s:
+ *  [15]     - Always output 0, reserved for use by compression
+ *  [14..12] - Rest length - 1, bits [8..6]
+ *  [11..6]  - Always 111111, marks the index as a rest
+ *  [5..0]   - Rest length - 1, bits [5..0]
  */
-void write_frame (void)
+static void add_frame (uint16_t new_frame_size, uint16_t frame_delay)
 {
     uint16_t index = 0xffff;
-    uint16_t new_frame_size = generate_frame ();
-    uint16_t frame_delay = samples_delay / frame_length;
-    samples_delay -= frame_delay * frame_length;
+
+    track_ticks += frame_delay;
+
+    if (new_frame_size > profile_frame_size_max)
+    {
+        profile_frame_size_max = new_frame_size;
+    }
 
     /* Check if the frame already exists */
     for (int i = 0; i < frame_count; i++)
@@ -232,10 +898,13 @@ void write_frame (void)
     /* If a matching index was not found, then this is a new unique frame. */
     if (index == 0xffff)
     {
-        /* Check there is space for a new frame, as we use 12 bits to index them */
-        if (frame_data_size >= 0x0fff)
+        /* Check there is space for a new frame, as we use 12 bits to index
+         * them, and the highest indexes are not frames. A frame placed there
+         * would be played as a sample or a rest, so conversion stops. */
+        if (frame_data_size >= FRAME_DATA_INDEXABLE)
         {
-            fprintf (stderr, "Warning: frame_data too large to index.\n");
+            frame_data_full = true;
+            return;
         }
 
         index = frame_data_size;
@@ -255,7 +924,7 @@ void write_frame (void)
     }
     else
     {
-        /* More than 16/60s delay requires multiple indexes */
+        /* More than 8/60s delay requires a rest after the frame */
         index_data [index_data_count++] = 0x7000 | index;
         frame_delay -= 8;
 
@@ -263,20 +932,68 @@ void write_frame (void)
         {
             if (frame_delay <= 8)
             {
+                /* Short rests use the empty frame, as these are more likely to be
+                 * matched by compress_indexes () */
                 uint16_t delay_bits = (frame_delay - 1) << 12;
                 index_data [index_data_count++] = delay_bits;
                 frame_delay = 0;
             }
             else
             {
-                index_data [index_data_count++] = 0x7000;
-                frame_delay -= 8;
+                uint16_t rest_length = (frame_delay < REST_LENGTH_MAX) ? frame_delay : REST_LENGTH_MAX;
+                uint16_t rest_bits = rest_length - 1;
+                index_data [index_data_count++] = ((rest_bits & 0x01c0) << 6) | REST_INDEX_MASK | (rest_bits & 0x003f);
+                frame_delay -= rest_length;
             }
         }
     }
 }
 
 
+
+/*
+ * Generate a frame from the current state, and add it to the output
+ * buffers with the delay that has built up since the previous frame.
+ *
+ * A frame that is over the cycle budget is split across consecutive
+ * ticks, taking one tick from the delay for each extra frame. If the
+ * delay is used up, the remaining changes are left for the next frame,
+ * unless this is the final frame of the track.
+ */
+void write_frame (bool final)
+{
+    uint16_t new_frame_size = generate_frame ();
+    uint16_t frame_delay = samples_delay / frame_length;
+    samples_delay -= frame_delay * frame_length;
+
+    /* A sample starting in this tick is triggered just before its frame */
+    if (sample_pending != SAMPLE_NONE)
+    {
+        index_data [index_data_count++] = SAMPLE_INDEX | sample_pending;
+        sample_pending = SAMPLE_NONE;
+    }
+
+    /* The final frame may be followed by less than a frame of delay */
+    if (frame_delay == 0)
+    {
+        frame_delay = 1;
+    }
+
+    while (budget_deferred && (frame_delay > 1 || final))
+    {
+        add_frame (new_frame_size, 1);
+        split_frames++;
+
+        if (frame_delay > 1)
+        {
+            frame_delay--;
+        }
+        new_frame_size = generate_frame ();
+    }
+
+    add_frame (new_frame_size, frame_delay);
+}
+
 /*
  * Find repeating segments within index_data and use
  * references to these to save space.
@@ -285,10 +1002,20 @@ void write_frame (void)
  *  [15]     - If 1, this entry refers to a sequence of previous indexes.
  *  [14..12] - Length of matching sequence, 2-9 words.
  *  [11..0]  - Index into compressed data.
+ *
+ * Long rests are ordinary indexes with bit 15 clear, so
+ * they can be matched and referenced like any other index.
+ *
+ * The compressed indexes are appended to compressed_index_data, after
+ * any previously compressed tracks, so that a track may reference
+ * segments from the tracks before it.
  */
-void compress_indexes (void)
+void compress_indexes (track_info *track)
 {
     uint16_t match_length = 0;
+    bool loop_found = false;
+
+    track->start = compressed_index_data_count;
 
     /* Iterate over non-compressed data, adding it to the compressed data */
     for (uint32_t i = 0; i < index_data_count; i += match_length)
@@ -297,8 +1024,9 @@ void compress_indexes (void)
         uint16_t longest_segment_length = 0;
         match_length = 0;
 
-        /* Iterate over compressed data, finding the longest matching segment */
-        for (uint32_t j = 0; j < compressed_index_data_count; j++)
+        /* Iterate over compressed data, finding the longest matching segment.
+         * Only the first 4096 entries can be referenced with 12 bits. */
+        for (uint32_t j = 0; j < compressed_index_data_count && j < 0x1000; j++)
         {
             /* Check the length of this match */
             for (uint32_t k = 0; i + k < index_data_count && j + k < compressed_index_data_count; k++)
@@ -318,62 +1046,500 @@ void compress_indexes (void)
             }
         }
 
-        if (longest_segment_length >= 2)
+        if (longest_segment_length >= 2)
+        {
+            /* Limit match length */
+            if (longest_segment_length > 9)
+            {
+                longest_segment_length = 9;
+            }
+
+            /* Emit reference - 3 bits of length, 12 bits of index */
+            compressed_index_data [compressed_index_data_count++] = 0x8000 | ((longest_segment_length - 2) << 12) | longest_segment_index;
+            match_length = longest_segment_length;
+        }
+        else
+        {
+            /* Emit index */
+            compressed_index_data [compressed_index_data_count++] = index_data [i];
+            match_length = 1;
+        }
+
+        if (!loop_found &&
+            i + (match_length - 1) >= loop_frame_index)
+        {
+            loop_found = true;
+
+            /* Outer index points at the next compressed element to play after this segment */
+            track->loop_outer = compressed_index_data_count;
+
+            /* Inner index points to the loop frame itself */
+            if (longest_segment_length >= 2)
+            {
+                uint8_t depth = loop_frame_index - i;
+                track->loop_inner = longest_segment_index + depth;
+                track->loop_segment_end = longest_segment_index + match_length;
+            }
+            else
+            {
+                track->loop_inner = track->loop_outer - 1;
+                track->loop_segment_end = track->loop_outer;
+            }
+        }
+    }
+
+    track->end = compressed_index_data_count;
+
+    fprintf (stderr, "Compressed indexes: %d bytes (%d indexes).\n",
+             (track->end - track->start) * 2, track->end - track->start);
+}
+
+
+/*
+ * Add a literal byte to the packed stream. Literals are written as soon as
+ * they are reached, so that later copies can be taken from them, with the
+ * token at the start of the run counting them as it grows. The open run's
+ * token is given as stream_literal_token.
+ */
+static uint32_t stream_literal_token = 0;
+static bool stream_literal_open = false;
+
+static void stream_literal (uint8_t byte)
+{
+    if (stream_literal_open && stream_data [stream_literal_token] == STREAM_LITERAL_MAX - 1)
+    {
+        stream_literal_open = false;
+    }
+
+    if (stream_literal_open)
+    {
+        stream_data [stream_literal_token]++;
+    }
+    else
+    {
+        stream_literal_token = stream_data_size;
+        stream_data [stream_data_size++] = 0;
+        stream_literal_open = true;
+    }
+
+    stream_data [stream_data_size++] = byte;
+}
+
+
+/*
+ * Find the longest copy of the bytes at the start of the given
+ * sequence, from the streams packed so far. The token of the open
+ * literal run may still change, so copies do not include it.
+ */
+static uint32_t stream_copy_find (const uint8_t *bytes, uint32_t length_max, uint32_t *copy_offset)
+{
+    uint32_t best_length = 0;
+
+    for (uint32_t source = 0; source < stream_data_size && source <= 0xffff; source++)
+    {
+        uint32_t length = 0;
+
+        while (length < length_max && source + length < stream_data_size &&
+               !(stream_literal_open && source + length == stream_literal_token) &&
+               stream_data [source + length] == bytes [length])
+        {
+            length++;
+        }
+
+        if (length > best_length)
+        {
+            best_length = length;
+            *copy_offset = source;
+        }
+    }
+
+    return best_length;
+}
+
+
+/*
+ * Pack a sequence of indexes into stream_data. At each point, the longest
+ * match within the window is compared with the longest copy from the
+ * streams packed so far, and the one saving the most bytes is taken.
+ * Matches may overlap the bytes they produce, as the player copies them
+ * one byte at a time.
+ *
+ * Only bytes stored as literals can be copied later, so short matches can
+ * cost more than they save. Matches shorter than match_min are not taken.
+ *
+ * Returns the offset of the packed indexes within stream_data.
+ */
+static uint32_t stream_pack (const uint16_t *indexes, uint32_t count, uint32_t match_min)
+{
+    uint32_t offset = stream_data_size;
+    uint32_t size = count * 2;
+    uint32_t i = 0;
+
+    for (uint32_t j = 0; j < count; j++)
+    {
+        stream_bytes [j * 2]     = indexes [j] & 0xff;
+        stream_bytes [j * 2 + 1] = indexes [j] >> 8;
+    }
+
+    stream_literal_open = false;
+
+    while (i < size)
+    {
+        uint32_t match_length = 0;
+        uint32_t match_distance = 0;
+        uint32_t copy_length = 0;
+        uint32_t copy_offset = 0;
+        uint32_t length_max = size - i;
+
+        for (uint32_t distance = 1; distance <= STREAM_WINDOW && distance <= i; distance++)
+        {
+            uint32_t length = 0;
+
+            while (length < length_max && length < STREAM_MATCH_MIN + STREAM_LENGTH_MAX - 1 &&
+                   stream_bytes [i + length - distance] == stream_bytes [i + length])
+            {
+                length++;
+            }
+
+            if (length > match_length)
+            {
+                match_length = length;
+                match_distance = distance;
+            }
+        }
+
+        if (length_max > STREAM_COPY_MIN + STREAM_LENGTH_MAX - 1)
+        {
+            length_max = STREAM_COPY_MIN + STREAM_LENGTH_MAX - 1;
+        }
+        copy_length = stream_copy_find (&stream_bytes [i], length_max, &copy_offset);
+
+        /* A match takes two bytes, and a copy three */
+        if (match_length >= match_min && match_length + 1 >= copy_length)
+        {
+            stream_data [stream_data_size++] = 0x80 | (match_length - STREAM_MATCH_MIN);
+            stream_data [stream_data_size++] = match_distance;
+            stream_literal_open = false;
+            i += match_length;
+        }
+        else if (copy_length >= STREAM_COPY_MIN)
+        {
+            stream_data [stream_data_size++] = 0xc0 | (copy_length - STREAM_COPY_MIN);
+            stream_data [stream_data_size++] = copy_offset & 0xff;
+            stream_data [stream_data_size++] = copy_offset >> 8;
+            stream_literal_open = false;
+            i += copy_length;
+        }
+        else
+        {
+            stream_literal (stream_bytes [i++]);
+        }
+    }
+
+    return offset;
+}
+
+
+/*
+ * Pack a sequence of indexes with each of a few minimum match
+ * lengths, keeping whichever gives the smallest stream.
+ */
+static uint32_t stream_pack_best (const uint16_t *indexes, uint32_t count)
+{
+    static const uint8_t match_mins [] = { STREAM_MATCH_MIN, 6, 12 };
+    uint32_t offset = stream_data_size;
+    uint32_t best_size = UINT32_MAX;
+    uint32_t best_min = STREAM_MATCH_MIN;
+
+    for (uint32_t i = 0; i < sizeof (match_mins); i++)
+    {
+        stream_pack (indexes, count, match_mins [i]);
+        if (stream_data_size - offset < best_size)
+        {
+            best_size = stream_data_size - offset;
+            best_min = match_mins [i];
+        }
+        stream_data_size = offset;
+    }
+
+    return stream_pack (indexes, count, best_min);
+}
+
+
+/*
+ * Pack the track's indexes into streams, one for before the loop point
+ * and one for the loop. The track_info fields are used as:
+ *  start            - Offset of the indexes before the loop point
+ *  end              - Number of indexes before the loop point
+ *  loop_outer       - Offset of the loop's indexes
+ *  loop_inner       - Number of indexes in the loop
+ *  loop_segment_end - Unused
+ */
+static void stream_track (track_info *track)
+{
+    uint32_t start_size = stream_data_size;
+
+    /* A loop point at the very end plays the whole track again */
+    if (loop_frame_index >= index_data_count)
+    {
+        loop_frame_index = 0;
+    }
+
+    track->start = stream_pack_best (index_data, loop_frame_index);
+    track->end = loop_frame_index;
+    track->loop_outer = stream_pack_best (&index_data [loop_frame_index], index_data_count - loop_frame_index);
+    track->loop_inner = index_data_count - loop_frame_index;
+    track->loop_segment_end = 0;
+
+    fprintf (stderr, "Streamed indexes: %d bytes (%d indexes).\n",
+             stream_data_size - start_size, index_data_count);
+}
+
+
+/*
+ * Find the volume register of a channel within a register state.
+ */
+static uint8_t *state_volume (psg_regs *state, uint8_t channel)
+{
+    switch (channel)
+    {
+    case 0:
+        return &state->volume_0;
+    case 1:
+        return &state->volume_1;
+    case 2:
+        return &state->volume_2;
+    default:
+        return &state->volume_3;
+    }
+}
+
+
+/*
+ * Resample a run of volume writes into a sample block, at the nearest rate
+ * that the player can write them. An identical block is shared.
+ *
+ * Returns the number of the sample, or SAMPLE_NONE if there is no room.
+ */
+static uint8_t sample_add (uint8_t channel, const uint32_t *times, const uint8_t *values, uint32_t count)
+{
+    double vgm_cycles = (pal_ticks ? Z80_CLOCK_PAL : Z80_CLOCK_NTSC) / 44100.0;
+    uint32_t duration = times [count - 1] - times [0];
+    double gap = (double) duration / (count - 1);
+    double period = (gap * vgm_cycles * 2 - CYCLES_SAMPLE_PAIR) / CYCLES_SAMPLE_DELAY;
+    uint8_t period_loops = (period < 1.0) ? 1 : (period > SAMPLE_PERIOD_MAX) ? SAMPLE_PERIOD_MAX : (uint8_t) (period + 0.5);
+    double interval = (CYCLES_SAMPLE_PAIR + CYCLES_SAMPLE_DELAY * period_loops) / (vgm_cycles * 2);
+    uint32_t samples = ((uint32_t) (duration / interval) + 2) & ~1;
+    uint32_t length = samples / 2;
+    uint8_t *block = &sample_data [sample_data_size];
+    uint32_t write = 0;
+
+    if (sample_count == SAMPLE_COUNT_MAX || sample_data_size + SAMPLE_HEADER_SIZE + length > SAMPLE_DATA_MAX)
+    {
+        fprintf (stderr, "Warning: No room for another sample, playing it as frames.\n");
+        return SAMPLE_NONE;
+    }
+
+    block [0] = 0x90 | (channel << 5);
+    block [1] = period_loops;
+    block [2] = length & 0xff;
+    block [3] = length >> 8;
+
+    for (uint32_t i = 0; i < samples; i++)
+    {
+        double time = times [0] + i * interval;
+        uint8_t value;
+
+        while (write + 1 < count && times [write + 1] <= time)
+        {
+            write++;
+        }
+
+        /* The run's last value is left in the register when the sample ends */
+        value = (i == samples - 1) ? values [count - 1] : values [write];
+
+        if (i & 1)
+        {
+            block [SAMPLE_HEADER_SIZE + (i >> 1)] |= value << 4;
+        }
+        else
+        {
+            block [SAMPLE_HEADER_SIZE + (i >> 1)] = value;
+        }
+    }
+
+    for (uint8_t i = 0; i < sample_count; i++)
+    {
+        if (memcmp (&sample_data [sample_offsets [i]], block, SAMPLE_HEADER_SIZE + length) == 0)
+        {
+            return i;
+        }
+    }
+
+    fprintf (stderr, "Sample %d: channel %d, %d samples at %d Hz.\n", sample_count, channel, samples,
+             (int) (44100.0 / interval + 0.5));
+
+    sample_offsets [sample_count] = sample_data_size;
+    sample_data_size += SAMPLE_HEADER_SIZE + length;
+
+    return sample_count++;
+}
+
+
+/*
+ * End the candidate run of volume writes for a channel. If it is long
+ * enough, and does not overlap a run already found, it becomes a sample.
+ * Only one sample plays at a time, so an overlapping run is left as frames.
+ */
+static void candidate_close (uint8_t channel)
+{
+    uint32_t start = candidate_start [channel];
+    uint32_t end = candidate_end [channel];
+    uint32_t length = candidate_length [channel];
+    uint8_t sample;
+
+    candidate_length [channel] = 0;
+
+    if (length < SAMPLE_WRITES_MIN || sample_run_count == SAMPLE_RUNS_MAX)
+    {
+        return;
+    }
+
+    for (uint32_t i = 0; i < sample_run_count; i++)
+    {
+        if (start <= sample_runs [i].end && end >= sample_runs [i].start)
+        {
+            return;
+        }
+    }
+
+    sample = sample_add (channel, candidate_times [channel], candidate_values [channel], length);
+    if (sample == SAMPLE_NONE)
+    {
+        return;
+    }
+
+    /* Keep the runs in the order they are reached */
+    uint32_t i = sample_run_count++;
+    while (i > 0 && sample_runs [i - 1].start > start)
+    {
+        sample_runs [i] = sample_runs [i - 1];
+        i--;
+    }
+    sample_runs [i].start = start;
+    sample_runs [i].end = end;
+    sample_runs [i].channel = channel;
+    sample_runs [i].sample = sample;
+}
+
+
+/*
+ * Find the runs of volume writes within a VGM file that are fast enough to
+ * be PCM, with no more than SAMPLE_GAP_MAX between writes. Runs do not
+ * continue across the loop point.
+ */
+static void find_sample_runs (const uint8_t *buffer, uint32_t size, uint32_t vgm_offset, uint32_t loop_offset)
+{
+    uint32_t time = 0;
+
+    sample_run_count = 0;
+    memset (candidate_length, 0, sizeof (candidate_length));
+
+    for (uint32_t i = vgm_offset; i < size; i++)
+    {
+        if (i == loop_offset)
         {
-            /* Limit match length */
-            if (longest_segment_length > 9)
+            for (uint8_t channel = 0; channel < 4; channel++)
             {
-                longest_segment_length = 9;
+                candidate_close (channel);
             }
-
-            /* Emit reference - 3 bits of length, 12 bits of index */
-            compressed_index_data [compressed_index_data_count++] = 0x8000 | ((longest_segment_length - 2) << 12) | longest_segment_index;
-            match_length = longest_segment_length;
-        }
-        else
-        {
-            /* Emit index */
-            compressed_index_data [compressed_index_data_count++] = index_data [i];
-            match_length = 1;
         }
 
-        if (loop_frame_index_outer == 0 &&
-            i + (match_length - 1) >= loop_frame_index)
+        switch (buffer [i])
         {
-            /* Outer index points at the next compressed element to play after this segment */
-            loop_frame_index_outer = compressed_index_data_count;
+        case 0x4f:
+            i++;
+            break;
 
-            /* Inner index points to the loop frame itself */
-            if (longest_segment_length >= 2)
-            {
-                uint8_t depth = loop_frame_index - i;
-                loop_frame_index_inner = longest_segment_index + depth;
-                loop_frame_segment_end = longest_segment_index + match_length;
-            }
-            else
+        case 0x50:
+            /* Volume latch */
+            if ((buffer [i + 1] & 0x90) == 0x90)
             {
-                loop_frame_index_inner = loop_frame_index_outer - 1;
-                loop_frame_segment_end = loop_frame_index_outer;
+                uint8_t channel = (buffer [i + 1] >> 5) & 0x03;
+                uint32_t length = candidate_length [channel];
+
+                if (length && (time - candidate_times [channel][length - 1] > SAMPLE_GAP_MAX ||
+                               length == SAMPLE_WRITES_MAX))
+                {
+                    candidate_close (channel);
+                    length = 0;
+                }
+
+                if (length == 0)
+                {
+                    candidate_start [channel] = i;
+                }
+                candidate_end [channel] = i;
+                candidate_times [channel][length] = time;
+                candidate_values [channel][length] = buffer [i + 1] & 0x0f;
+                candidate_length [channel]++;
             }
-            uint16_t depth = i + match_length - loop_frame_index;
+            i++;
+            break;
+
+        case 0x61:
+            time += * (uint16_t *)(&buffer [i + 1]);
+            i += 2;
+            break;
+
+        case 0x62:
+            time += 735;
+            break;
+
+        case 0x63:
+            time += 882;
+            break;
+
+        case 0x66:
+            i = size;
+            break;
+
+        case 0x70: case 0x71: case 0x72: case 0x73:
+        case 0x74: case 0x75: case 0x76: case 0x77:
+        case 0x78: case 0x79: case 0x7a: case 0x7b:
+        case 0x7c: case 0x7d: case 0x7e: case 0x7f:
+            time += 1 + (buffer [i] & 0x0f);
+            break;
+
+        case 0xa0:
+            i += 2;
+            break;
+
+        case 0xd2:
+            i += 3;
+            break;
+
+        default:
+            break;
         }
     }
 
-    fprintf (stderr, "Compressed indexes: %d bytes (%d indexes).\n", compressed_index_data_count * 2, compressed_index_data_count);
+    for (uint8_t channel = 0; channel < 4; channel++)
+    {
+        candidate_close (channel);
+    }
 }
 
 
 /*
- * Entry point.
+ * Convert a single VGM file into a track.
  *
- * Currently contains the parser for VGM commands
- * and generator for the output text.
+ * Unique frames are added to the shared frame_data, and
+ * the track's compressed indexes are appended to the
+ * shared compressed_index_data.
  */
-int main (int argc, char **argv)
+static int convert_track (const uint8_t *buffer, uint32_t size, track_info *track)
 {
-    /* File I/O */
-    char *filename = NULL;
-    uint8_t *buffer = NULL;
     uint32_t vgm_offset = 0;
 
     /* PSG */
@@ -381,29 +1547,10 @@ int main (int argc, char **argv)
     uint8_t data = 0;
     uint16_t data_low = 0;
     uint16_t data_high = 0;
+    bool sample_last = false;
+    bool writes_pending = false;    /* PSG writes since the last frame was written */
 
-    /* Option to generate data for PAL consoles */
-    if (argc == 3 && strcmp (argv [1], "--pal") == 0)
-    {
-        frame_length = 882;
-        argc--;
-        argv++;
-    }
-
-    if (argc != 2)
-    {
-        fprintf (stderr, "Error: No VGM file specified.\n");
-        return EXIT_FAILURE;
-    }
-
-    filename = argv [1];
-    buffer = read_vgm (filename);
-
-    if (buffer == NULL)
-    {
-        /* read_vgm should already have output an error message */
-        return EXIT_FAILURE;
-    }
+    fprintf (stderr, "Track %d:\n", track_count + 1);
 
     fprintf (stderr, "Version: %x.\n",       * (uint32_t *)(&buffer [0x08]));
     fprintf (stderr, "Clock rate: %d Hz.\n", * (uint32_t *)(&buffer [0x0c]));
@@ -430,11 +1577,50 @@ int main (int argc, char **argv)
     }
 
 
-    for (uint32_t i = vgm_offset; (i < SOURCE_SIZE_MAX) && (TOTAL_SIZE < OUTPUT_SIZE_MAX); i++)
+    /* Each track starts from the state set up by the player */
+    memcpy (&current_state, &initial_state, sizeof (psg_regs));
+    memcpy (&previous_state, &initial_state, sizeof (psg_regs));
+    samples_delay = 0;
+    index_data_count = 0;
+    loop_frame_index = 0;
+    track_ticks = 0;
+    memset (dead_writes, 0, sizeof (dead_writes));
+    memset (deferred_writes, 0, sizeof (deferred_writes));
+    memset (deferred_pending, 0, sizeof (deferred_pending));
+    low_only_writes = 0;
+    find_sample_runs (buffer, size, vgm_offset, loop_offset);
+    sample_run_next = 0;
+    sample_active = NULL;
+    sample_pending = SAMPLE_NONE;
+    loop_untouched = (loop_offset == 0) ? 0xff : 0;
+    loop_high_untouched = (loop_offset == 0) ? (TONE_0_BIT | TONE_1_BIT | TONE_2_BIT) : 0;
+    loop_first_write = 0;
+    loop_high_first_write = 0;
+    worst_frame_cost = 0;
+    split_frames = 0;
+    over_budget_frames = 0;
+    budget_held = 0;
+    budget_late = false;
+
+    for (uint32_t i = vgm_offset; (i < size) && (TOTAL_SIZE < output_size_max) && (index_data_count < INDEX_COUNT_MAX) &&
+                                  !frame_data_full; i++)
     {
         if (i == loop_offset)
         {
+            /* Writes before the loop point belong to the frame before the loop,
+             * even if less than a tick has passed since they were made. The
+             * frame then lasts one tick, and the remaining delay is carried
+             * into the loop. */
+            if (writes_pending || samples_delay >= frame_length)
+            {
+                loop_flush = true;
+                write_frame (false);
+                loop_flush = false;
+                writes_pending = false;
+            }
             loop_frame_index = index_data_count;
+            loop_untouched = 0xff;
+            loop_high_untouched = TONE_0_BIT | TONE_1_BIT | TONE_2_BIT;
             fprintf (stderr, "Loop frame index: %d.\n", loop_frame_index);
         }
 
@@ -447,8 +1633,18 @@ int main (int argc, char **argv)
         case 0x50: /* PSG Data */
             if (samples_delay >= frame_length)
             {
-                write_frame ();
+                write_frame (false);
             }
+            writes_pending = true;
+
+            /* The start of a run of writes to be played as a sample */
+            if (sample_run_next < sample_run_count && i == sample_runs [sample_run_next].start)
+            {
+                sample_active = &sample_runs [sample_run_next++];
+                sample_pending = sample_active->sample;
+            }
+            sample_last = (sample_active != NULL && i == sample_active->end);
+
             data = buffer[++i];
             data_low  = data & 0x0f;
             data_high = data << 0x04;
@@ -543,24 +1739,49 @@ int main (int argc, char **argv)
                     break;
                 }
             }
+
+            /* Note the first write to each field after the loop point */
+            if (!(data & 0x80) && (latch_fields [latch >> 4] & loop_high_untouched))
+            {
+                loop_high_untouched &= ~latch_fields [latch >> 4];
+                loop_high_first_write |= latch_fields [latch >> 4];
+            }
+            else if ((data & 0x80) && (latch_fields [latch >> 4] & loop_untouched))
+            {
+                loop_untouched &= ~latch_fields [latch >> 4];
+                loop_first_write |= latch_fields [latch >> 4];
+            }
+
+            /* While a sample plays, its register is left out of the frames,
+             * and holds the run's last value once the sample ends */
+            if (sample_active != NULL)
+            {
+                *state_volume (&previous_state, sample_active->channel) =
+                    *state_volume (&current_state, sample_active->channel);
+                loop_first_write &= ~(VOLUME_0_BIT << sample_active->channel);
+                if (sample_last)
+                {
+                    sample_active = NULL;
+                }
+            }
             break;
 
         case 0x61: /* Wait n 44.1 KHz samples */
-            samples_delay += * (uint16_t *)(&buffer [i+1]);
+            samples_delay += * (uint16_t *)(&buffer [i+1]) * sub_frames;
             i += 2;
             break;
 
         case 0x62: /* Wait 1/60 of a second */
-            samples_delay += 735;
+            samples_delay += 735 * sub_frames;
             break;
 
         case 0x63: /* Wait 1/50 of a second */
-            samples_delay += 882;
+            samples_delay += 882 * sub_frames;
             break;
 
         case 0x66: /* End of sound data */
-            write_frame ();
-            i = SOURCE_SIZE_MAX;
+            write_frame (true);
+            i = size;
             break;
 
         /* 0x7n: Wait n+1 samples */
@@ -568,7 +1789,7 @@ int main (int argc, char **argv)
         case 0x74: case 0x75: case 0x76: case 0x77:
         case 0x78: case 0x79: case 0x7a: case 0x7b:
         case 0x7c: case 0x7d: case 0x7e: case 0x7f:
-            samples_delay += 1 + (buffer [i] & 0x0f);
+            samples_delay += (1 + (buffer [i] & 0x0f)) * sub_frames;
             break;
 
         case 0xa0: /* AY8910 - Ignore */
@@ -585,63 +1806,464 @@ int main (int argc, char **argv)
         }
     }
 
-    compress_indexes ();
+    if (frame_data_full)
+    {
+        fprintf (stderr, "Error: Frame data is over the %d bytes that can be indexed, as indexes from 0x%03x are samples and rests.\n",
+                 FRAME_DATA_INDEXABLE, SAMPLE_INDEX);
+        if (raw_frames)
+        {
+            fprintf (stderr, "       Raw frames take more space. Convert without --raw, or with fewer tracks.\n");
+        }
+        return -1;
+    }
+    if (budget_late)
+    {
+        fprintf (stderr, "Error: Changes were held back for more than one tick to fit the cycle budget, at tick %d.\n",
+                 budget_late_tick);
+        return -1;
+    }
+
+    fprintf (stderr, "Inaudible writes left out: Tone0 %d, Tone1 %d, Tone2 %d, Noise %d.\n",
+             dead_writes [0], dead_writes [1], dead_writes [2], dead_writes [3]);
+    fprintf (stderr, "  of which dropped: Tone0 %d, Tone1 %d, Tone2 %d, Noise %d.\n",
+             dead_writes [0] - deferred_writes [0], dead_writes [1] - deferred_writes [1],
+             dead_writes [2] - deferred_writes [2], dead_writes [3] - deferred_writes [3]);
+
+    fprintf (stderr, "Low-only tone writes: %d.\n", low_only_writes);
+
+    fprintf (stderr, "Worst-case frame cost: %d cycles, of a %d cycle budget.\n", worst_frame_cost, cycle_budget);
+    if (split_frames)
+    {
+        fprintf (stderr, "  %d frames split across ticks to fit the budget.\n", split_frames);
+    }
+    if (over_budget_frames)
+    {
+        fprintf (stderr, "Warning: %d frames are over the cycle budget.\n", over_budget_frames);
+    }
+    if (worst_frame_cost > worst_song_cost)
+    {
+        worst_song_cost = worst_frame_cost;
+    }
+
+    if (stream_indexes)
+    {
+        stream_track (track);
+    }
+    else
+    {
+        compress_indexes (track);
+    }
+
+    return 0;
+}
+
+
+/*
+ * Write a 16-bit value into the music blob, little-endian for the Z80.
+ */
+static void blob_write_u16 (uint8_t *blob, uint32_t offset, uint16_t value)
+{
+    blob [offset]     = value & 0xff;
+    blob [offset + 1] = value >> 8;
+}
+
+
+/*
+ * Find where an item of the given length can start, at or after an
+ * offset. With a banked layout, an item that would cross from one
+ * 16 KiB bank into the next is moved to the start of the next, so that
+ * the player can read it with a single bank mapped. Banks are counted
+ * from the start of the index data.
+ */
+static uint32_t bank_fit (uint32_t bank_start, uint32_t offset, uint32_t length)
+{
+    uint32_t bank_end = bank_start + ((offset - bank_start) / BANK_SIZE + 1) * BANK_SIZE;
+
+    if (banked_layout && offset + length > bank_end)
+    {
+        return bank_end;
+    }
+
+    return offset;
+}
+
+
+/*
+ * Add padding to the music blob, up to the given offset.
+ * Returns the new size of the blob.
+ */
+static uint32_t blob_pad (uint8_t *blob, uint32_t size, uint32_t offset)
+{
+    memset (&blob [size], 0, offset - size);
+
+    return offset;
+}
+
+
+/*
+ * Assemble the converted tracks into a music blob.
+ *
+ * Format, with all offsets relative to the start of the blob:
+ *  uint8_t    track_count
+ *  uint8_t    flags
+ *  uint16_t   frame_data offset
+ *  uint16_t   index_data offset
+ *  uint16_t   checkpoint_data offset, or zero if there are none
+ *  uint16_t   sample_data offset, or zero if there are none
+ *  track_info track_table [track_count]
+ *  uint8_t    frame_data [...]
+ *  uint16_t   index_data [...]
+ *  uint16_t   sample_table [sample_count], offsets of each sample block
+ *  uint8_t    sample blocks [...]
+ *
+ * With MUSIC_FLAG_STREAM, the index_data offset instead points at the
+ * packed streams, and the track_info fields are as set by stream_track ().
+ *
+ * With a banked layout, the sample table and each sample block may be
+ * preceded by padding, so that none of them cross a bank boundary.
+ *
+ * The checkpoint data is added by build_checkpoints ().
+ *
+ * Returns the size of the blob.
+ */
+static uint32_t build_music_blob (uint8_t *blob)
+{
+    uint32_t frame_data_offset = MUSIC_HEADER_SIZE + track_count * TRACK_INFO_SIZE;
+    uint32_t index_data_offset = frame_data_offset + frame_data_size;
+    uint32_t size = index_data_offset + compressed_index_data_count * 2 + stream_data_size;
+    uint16_t stream_offset = stream_indexes ? index_data_offset : 0;
+
+    blob [0] = track_count;
+    blob [1] = (raw_frames ? MUSIC_FLAG_RAW : 0) | (pal_ticks ? MUSIC_FLAG_PAL : 0) |
+               ((sub_frames - 1) << MUSIC_SLOTS_SHIFT) | (stream_indexes ? MUSIC_FLAG_STREAM : 0);
+    blob_write_u16 (blob, 2, frame_data_offset);
+    blob_write_u16 (blob, 4, index_data_offset);
+    blob_write_u16 (blob, 6, 0);
+    blob_write_u16 (blob, 8, 0);
+
+    for (int i = 0; i < track_count; i++)
+    {
+        uint32_t offset = MUSIC_HEADER_SIZE + i * TRACK_INFO_SIZE;
+        blob_write_u16 (blob, offset + 0, tracks [i].start + stream_offset);
+        blob_write_u16 (blob, offset + 2, tracks [i].end);
+        blob_write_u16 (blob, offset + 4, tracks [i].loop_outer + stream_offset);
+        blob_write_u16 (blob, offset + 6, tracks [i].loop_inner);
+        blob_write_u16 (blob, offset + 8, tracks [i].loop_segment_end);
+    }
 
-    printf ("#define LOOP_FRAME_INDEX_INNER %d\n", loop_frame_index_inner);
-    printf ("#define LOOP_FRAME_INDEX_OUTER %d\n", loop_frame_index_outer);
-    printf ("#define LOOP_FRAME_SEGMENT_END %d\n", loop_frame_segment_end);
-    printf ("#define END_FRAME_INDEX %d\n\n", compressed_index_data_count);
+    memcpy (&blob [frame_data_offset], frame_data, frame_data_size);
+
+    for (int i = 0; i < compressed_index_data_count; i++)
+    {
+        blob_write_u16 (blob, index_data_offset + i * 2, compressed_index_data [i]);
+    }
+    memcpy (&blob [index_data_offset], stream_data, stream_data_size);
 
-    printf ("static const uint8_t frame_data [] = {\n");
-    for (int i = 0; i < frame_data_size; i++)
+    if (sample_count)
     {
-        if (i % 16 == 0)
+        uint32_t sample_table_offset = bank_fit (index_data_offset, size, sample_count * 2);
+
+        size = blob_pad (blob, size, sample_table_offset);
+        blob_write_u16 (blob, 8, sample_table_offset);
+        size += sample_count * 2;
+
+        for (int i = 0; i < sample_count; i++)
         {
-            printf ("    ");
+            const uint8_t *block = &sample_data [sample_offsets [i]];
+            uint32_t block_size = SAMPLE_HEADER_SIZE + (block [2] | (block [3] << 8));
+
+            size = blob_pad (blob, size, bank_fit (index_data_offset, size, block_size));
+            blob_write_u16 (blob, sample_table_offset + i * 2, size);
+            memcpy (&blob [size], block, block_size);
+            size += block_size;
         }
-        printf ("0x%02x%s", frame_data [i], i == (frame_data_size - 1) ? "\n" : ",");
-        if (i == (frame_data_size - 1))
+    }
+
+    return size;
+}
+
+
+/*
+ * Append the checkpoint data to the music blob.
+ *
+ * Each track is played through the reference decoder, and its state is
+ * recorded every checkpoint_interval ticks, up until the track first
+ * loops. The state after n ticks is stored, so that the player can write
+ * the registers, take on the position, and continue with tick n + 1.
+ *
+ * Format:
+ *  uint16_t   interval, in ticks
+ *  uint16_t   track_checkpoints [track_count], offsets from the start of the blob
+ *  For each track:
+ *      uint8_t    count
+ *      checkpoint checkpoints [count], for ticks interval, 2 * interval, ...
+ *
+ * Checkpoint format:
+ *  uint16_t   outer_index, inner_index, segment_end, delay
+ *  uint16_t   tone [3]
+ *  uint8_t    noise
+ *  uint8_t    volume [2], two volumes per byte, low nibble first
+ *
+ * With a banked layout, the interval and table, and each track's
+ * checkpoints, may be preceded by padding so that none of them cross
+ * a bank boundary.
+ *
+ * Returns the new size of the blob, or 0 on error.
+ */
+static uint32_t build_checkpoints (uint8_t *blob, uint32_t size)
+{
+    vgm_decoder decoder;
+    uint32_t index_data_offset = blob [4] | (blob [5] << 8);
+    uint32_t checkpoint_data_offset;
+
+    if (vgm_decoder_init (&decoder, blob, size) != 0)
+    {
+        return 0;
+    }
+
+    checkpoint_data_offset = bank_fit (index_data_offset, size, 2 + track_count * 2);
+    size = blob_pad (blob, size, checkpoint_data_offset);
+    blob_write_u16 (blob, 6, checkpoint_data_offset);
+    blob_write_u16 (blob, size, checkpoint_interval);
+    size += 2 + track_count * 2;
+
+    for (int i = 0; i < track_count; i++)
+    {
+        uint32_t count_offset = size;
+        uint32_t list_offset;
+        uint32_t list_size;
+        uint8_t count = 0;
+
+        blob_write_u16 (blob, checkpoint_data_offset + 2 + i * 2, count_offset);
+        size += 1;
+
+        if (vgm_decoder_start (&decoder, i) != 0)
         {
-            break;
+            return 0;
         }
-        if (i % 16 == 15)
+
+        for (uint32_t tick = 1; count < CHECKPOINT_MAX; tick++)
         {
-            printf ("\n");
+            vgm_decoder_tick (&decoder);
+
+            if (decoder.error)
+            {
+                fprintf (stderr, "Error: Track %d could not be decoded to build checkpoints.\n", i + 1);
+                return 0;
+            }
+            if (decoder.loop_taken)
+            {
+                break;
+            }
+
+            if (tick % checkpoint_interval == 0)
+            {
+                blob_write_u16 (blob, size +  0, decoder.outer_index);
+                blob_write_u16 (blob, size +  2, decoder.inner_index);
+                blob_write_u16 (blob, size +  4, decoder.segment_end);
+                blob_write_u16 (blob, size +  6, decoder.delay);
+                blob_write_u16 (blob, size +  8, decoder.state.tone [0]);
+                blob_write_u16 (blob, size + 10, decoder.state.tone [1]);
+                blob_write_u16 (blob, size + 12, decoder.state.tone [2]);
+                blob [size + 14] = decoder.state.noise;
+                blob [size + 15] = decoder.state.volume [0] | (decoder.state.volume [1] << 4);
+                blob [size + 16] = decoder.state.volume [2] | (decoder.state.volume [3] << 4);
+                size += CHECKPOINT_SIZE;
+                count++;
+            }
         }
-        else
+
+        blob [count_offset] = count;
+        checkpoint_count += count;
+
+        /* Only now is the length known, to move them to the next bank if needed */
+        list_size = size - count_offset;
+        list_offset = bank_fit (index_data_offset, count_offset, list_size);
+        if (list_offset != count_offset)
         {
-            printf (" ");
+            memmove (&blob [list_offset], &blob [count_offset], list_size);
+            blob_pad (blob, count_offset, list_offset);
+            blob_write_u16 (blob, checkpoint_data_offset + 2 + i * 2, list_offset);
+            size = list_offset + list_size;
         }
     }
-    printf ("};\n\n");
 
-    printf ("static const uint16_t index_data [] = {\n");
-    for (int i = 0; i < compressed_index_data_count; i++)
+    checkpoint_data_size = size - checkpoint_data_offset;
+
+    return size;
+}
+
+
+/*
+ * Convert VGM files into a music blob for the player.
+ *
+ * Each VGM file becomes one track, and may be gzip compressed.
+ * Frames that are estimated to take longer than the cycle budget
+ * to play are split across consecutive ticks.
+ * On success, *music is set to an allocated buffer which should
+ * be freed when no longer needed.
+ */
+int vgm_convert (uint8_t vgm_count, const uint8_t *const *vgm_data, const uint32_t *vgm_size,
+                 const vgm_convert_options *options, uint8_t **music, uint32_t *music_size)
+{
+    if (vgm_count < 1)
     {
-        if (i % 8 == 0)
-        {
-            printf ("    ");
-        }
-        printf ("0x%04x%s", compressed_index_data [i], i == (compressed_index_data_count - 1) ? "\n" : ",");
-        if (i == (compressed_index_data_count - 1))
+        fprintf (stderr, "Error: No VGM file specified.\n");
+        return -1;
+    }
+
+    if (vgm_count > TRACK_COUNT_MAX)
+    {
+        fprintf (stderr, "Error: Too many VGM files, at most %d tracks are supported.\n", TRACK_COUNT_MAX);
+        return -1;
+    }
+
+    if (options->sub_frames > SUB_FRAMES_MAX)
+    {
+        fprintf (stderr, "Error: At most %d sub-frame slots are supported.\n", SUB_FRAMES_MAX);
+        return -1;
+    }
+
+    if (options->stream && options->checkpoint_seconds != 0)
+    {
+        fprintf (stderr, "Error: Checkpoints cannot be used with streamed indexes.\n");
+        return -1;
+    }
+
+    /* Start from empty buffers, with only the zero-frame */
+    frame_length = options->pal ? 882 : 735;
+    raw_frames = options->raw;
+    pal_ticks = options->pal;
+    sub_frames = (options->sub_frames > 1) ? options->sub_frames : 1;
+    cycle_budget = vgm_convert_cycle_budget (options);
+    stream_indexes = options->stream;
+    banked_layout = options->banked;
+    output_size_max = banked_layout ? BANKED_SIZE_MAX : OUTPUT_SIZE_MAX;
+    worst_song_cost = 0;
+    profile_fields = 0;
+    profile_low_only = false;
+    profile_frame_size_max = 0;
+    memset (frame_data, 0, sizeof (frame_data));
+    frame_data_size = 1;
+    memset (frame_indexes, 0, sizeof (frame_indexes));
+    frame_count = 1;
+    frame_data_full = false;
+    compressed_index_data_count = 0;
+    track_count = 0;
+    sample_data_size = 0;
+    sample_count = 0;
+    stream_data_size = 0;
+    checkpoint_interval = options->checkpoint_seconds * (options->pal ? 50 : 60) * sub_frames;
+    checkpoint_count = 0;
+    checkpoint_data_size = 0;
+
+    for (int i = 0; i < vgm_count; i++)
+    {
+        uint8_t *buffer = NULL;
+        uint32_t size = 0;
+
+        buffer = read_vgm_buffer (vgm_data [i], vgm_size [i], &size);
+        if (buffer == NULL)
         {
-            break;
+            /* read_vgm_buffer should already have output an error message */
+            return -1;
         }
-        if (i % 8 == 7)
+
+        if (convert_track (buffer, size, &tracks [track_count]) != 0)
         {
-            printf ("\n");
+            free (buffer);
+            return -1;
         }
-        else
+        track_count++;
+
+        free (buffer);
+    }
+
+    *music_size = build_music_blob (music_blob);
+    if (checkpoint_interval != 0 && *music_size <= 0x10000)
+    {
+        *music_size = build_checkpoints (music_blob, *music_size);
+        if (*music_size == 0)
         {
-            printf (" ");
+            return -1;
         }
     }
-    printf ("};\n");
+
+    if (*music_size > 0x10000)
+    {
+        fprintf (stderr, "Error: Music is %d bytes, more than the 64 KiB that can be addressed.\n", *music_size);
+        return -1;
+    }
+
+    *music = malloc (*music_size);
+    if (*music == NULL)
+    {
+        fprintf (stderr, "Error: Unable to allocate %d bytes of memory.\n", *music_size);
+        return -1;
+    }
+    memcpy (*music, music_blob, *music_size);
 
     fprintf (stderr, "Done.\n");
     fprintf (stderr, " - %d bytes of frame data. (%d unique frames)\n", frame_data_size, frame_count);
-    fprintf (stderr, " - %d bytes of index data.\n", compressed_index_data_count * 2);
-    fprintf (stderr, " - %d bytes total.\n", TOTAL_SIZE);
+    if (stream_indexes)
+    {
+        fprintf (stderr, " - %d bytes of streamed index data.\n", stream_data_size);
+    }
+    else
+    {
+        fprintf (stderr, " - %d bytes of index data.\n", compressed_index_data_count * 2);
+    }
+    fprintf (stderr, " - %d bytes of header and track table.\n", MUSIC_HEADER_SIZE + track_count * TRACK_INFO_SIZE);
+    if (sample_count != 0)
+    {
+        fprintf (stderr, " - %d bytes of sample data. (%d samples)\n", sample_count * 2 + sample_data_size, sample_count);
+    }
+    if (checkpoint_interval != 0)
+    {
+        fprintf (stderr, " - %d bytes of checkpoint data. (%d checkpoints)\n",
+                 checkpoint_data_size, checkpoint_count);
+    }
+    fprintf (stderr, " - %d bytes total.\n", *music_size);
+    fprintf (stderr, " - %d cycles worst-case frame cost.\n", worst_song_cost);
+
+    return 0;
+}
+
+
+/*
+ * Describe the features used by the most recent conversion.
+ */
+void vgm_convert_profile (vgm_song_profile *profile)
+{
+    profile->track_count = track_count;
+    profile->raw = raw_frames;
+    profile->fields = profile_fields;
+    profile->low_only = profile_low_only;
+    profile->frame_size_max = profile_frame_size_max;
+    profile->checkpoints = (checkpoint_interval != 0);
+    profile->samples = (sample_count != 0);
+    profile->stream = stream_indexes;
+}
+
+
+/*
+ * Find the Z80 cycles available to each tick for the given options.
+ */
+uint32_t vgm_convert_cycle_budget (const vgm_convert_options *options)
+{
+    uint32_t budget = options->cycle_budget;
+
+    if (budget == 0)
+    {
+        /* With sub-frame slots, every tick in a frame is decoded together */
+        budget = (options->pal ? CYCLE_BUDGET_PAL : CYCLE_BUDGET_NTSC) / ((options->sub_frames > 1) ? options->sub_frames : 1);
+    }
+
+    /* Each tick also unpacks some of the stream */
+    if (options->stream)
+    {
+        budget -= STREAM_FILL_BYTES * CYCLES_STREAM_BYTE;
+    }
 
-    free (buffer);
+    return budget;
 }
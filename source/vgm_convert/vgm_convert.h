@@ -0,0 +1,38 @@
+
+#define TRACK_COUNT_MAX  8
+#define SUB_FRAMES_MAX   4
+
+/* Conversion settings */
+typedef struct vgm_convert_options_s
+{
+    bool pal;                   /* Generate data for PAL consoles */
+    uint32_t cycle_budget;      /* Z80 cycles per tick, or 0 for the length of vblank */
+    bool raw;                   /* Store frames as ready-to-send PSG bytes, for faster playback */
+    uint32_t checkpoint_seconds; /* Time between seek checkpoints, or 0 for none */
+    uint8_t sub_frames;         /* Ticks in each frame, played at timed points, or 0 for one */
+    bool stream;                /* Pack each track's indexes into a stream, unpacked during playback */
+    bool banked;                /* Lay out the music for a banked cartridge, allowing up to 60 KiB */
+} vgm_convert_options;
+
+/* Convert VGM files into a music blob for the player. */
+int vgm_convert (uint8_t vgm_count, const uint8_t *const *vgm_data, const uint32_t *vgm_size,
+                 const vgm_convert_options *options, uint8_t **music, uint32_t *music_size);
+
+/* Features used by a converted song */
+typedef struct vgm_song_profile_s
+{
+    uint8_t track_count;
+    bool raw;                   /* Frames are raw PSG bytes */
+    uint8_t fields;             /* Fields written, as bits of the nibble-packed frame header */
+    bool low_only;              /* Some tones were written as the low nibble only */
+    uint8_t frame_size_max;     /* Largest frame, in bytes */
+    bool checkpoints;           /* Checkpoints are present for seeking */
+    bool samples;               /* Sample blocks are played */
+    bool stream;                /* Indexes are packed into streams */
+} vgm_song_profile;
+
+/* Describe the features used by the most recent conversion. */
+void vgm_convert_profile (vgm_song_profile *profile);
+
+/* Z80 cycles available to each tick for the given options. */
+uint32_t vgm_convert_cycle_budget (const vgm_convert_options *options);
@@ -11,139 +11,172 @@ const uint8_t gzip_magic [3] = { 0x1f, 0x8b, 0x08 };
 
 
 /*
- * Read a compressed .vgm file into an allocated buffer.
+ * Decompress an in-memory .vgz file into an allocated buffer.
  * The buffer should be freed when no longer needed.
  */
-static uint8_t *read_vgz (char *filename)
+static uint8_t *read_vgz_buffer (const uint8_t *data, uint32_t size, uint32_t *vgm_size)
 {
-    gzFile source_vgz = NULL;
-    uint8_t file_magic [4] = { 0 };
-    uint8_t scratch [128] = { 0 };
+    z_stream stream = { 0 };
     uint8_t *buffer = NULL;
-    uint32_t filesize = 0;
+    int result;
 
-    source_vgz = gzopen (filename, "rb");
-    if (source_vgz == NULL)
+    /* Allocate a buffer, with zeroed padding in case a truncated command is read */
+    buffer = calloc (SOURCE_SIZE_MAX + SOURCE_PADDING, 1);
+    if (buffer == NULL)
     {
-        fprintf (stderr, "Error: Unable to open vgz %s.\n", filename);
+        fprintf (stderr, "Error: Unable to allocate %d bytes of memory.\n", SOURCE_SIZE_MAX);
         return NULL;
     }
 
-    gzread (source_vgz, file_magic, 4);
-    gzrewind (source_vgz);
-
-    /* Check the magic bytes are valid */
-    if (memcmp (file_magic, vgm_magic, 4) != 0)
+    /* Adding 16 to the window bits selects the gzip format */
+    if (inflateInit2 (&stream, 16 + MAX_WBITS) != Z_OK)
     {
-        fprintf (stderr, "Error: File is not a valid VGM.\n");
-        gzclose (source_vgz);
+        fprintf (stderr, "Error: Unable to initialise zlib.\n");
+        free (buffer);
         return NULL;
     }
 
-    /* Get the uncompressed filesize by reading the contents */
-    while (gzread (source_vgz, scratch, 128) == 128);
-    filesize = gztell (source_vgz);
-    gzrewind (source_vgz);
+    stream.next_in = (uint8_t *) data;
+    stream.avail_in = size;
+    stream.next_out = buffer;
+    stream.avail_out = SOURCE_SIZE_MAX;
+
+    result = inflate (&stream, Z_FINISH);
+    *vgm_size = stream.total_out;
+    inflateEnd (&stream);
 
-    if (filesize > SOURCE_SIZE_MAX)
+    if (result != Z_STREAM_END && stream.avail_out == 0)
     {
         fprintf (stderr, "Error: Source file (uncompressed) larger than 512 KiB.\n");
-        gzclose (source_vgz);
+        free (buffer);
         return NULL;
     }
-
-    /* Allocate a buffer */
-    buffer = malloc (filesize);
-    if (buffer == NULL)
+    else if (result != Z_STREAM_END)
     {
-        fprintf (stderr, "Error: Unable to allocate %d bytes of memory.\n", filesize);
-        gzclose (source_vgz);
+        fprintf (stderr, "Error: Unable to decompress vgz.\n");
+        free (buffer);
         return NULL;
     }
 
-    /* Read the file */
-    if (gzread (source_vgz, buffer, filesize) != filesize)
+    /* Check the magic bytes are valid */
+    if (*vgm_size < 0x40 || memcmp (buffer, vgm_magic, 4) != 0)
     {
-        fprintf (stderr, "Error: Unable to read %d bytes from file.\n", filesize);
-        gzclose (source_vgz);
+        fprintf (stderr, "Error: File is not a valid VGM.\n");
         free (buffer);
         return NULL;
     }
 
-    gzclose (source_vgz);
-
     return buffer;
 }
 
 
 /*
- * Read a .vgm file into an allocated buffer.
+ * Copy an in-memory .vgm or .vgz file into an allocated buffer,
+ * decompressing it if needed.
  * The buffer should be freed when no longer needed.
  */
-uint8_t *read_vgm (char *filename)
+uint8_t *read_vgm_buffer (const uint8_t *data, uint32_t size, uint32_t *vgm_size)
 {
-    FILE *source_vgm = NULL;
-    uint8_t file_magic [4] = { 0 };
     uint8_t *buffer = NULL;
-    uint32_t filesize = 0;
 
-    source_vgm = fopen (filename, "rb");
-    if (source_vgm == NULL)
+    /* First, check if we should be using the vgz path instead */
+    if (size >= 3 && memcmp (data, gzip_magic, 3) == 0)
     {
-        fprintf (stderr, "Error: Unable to open %s.\n", filename);
-        return NULL;
+        return read_vgz_buffer (data, size, vgm_size);
     }
 
-    fread (file_magic, sizeof (uint8_t), 4, source_vgm);
-    rewind (source_vgm);
-
-    /* First, check if we should be using the vgz path instead */
-    if (memcmp (file_magic, gzip_magic, 3) == 0)
+    if (size < 0x40 || memcmp (data, vgm_magic, 4) != 0)
     {
-        fclose (source_vgm);
+        fprintf (stderr, "Error: File is not a valid VGM.\n");
+        return NULL;
+    }
 
-        return read_vgz (filename);
+    if (size > SOURCE_SIZE_MAX)
+    {
+        fprintf (stderr, "Error: Source file larger than 512 KiB.\n");
+        return NULL;
     }
 
-    if (memcmp (file_magic, vgm_magic, 4) != 0)
+    /* Allocate a buffer, with zeroed padding in case a truncated command is read */
+    buffer = calloc (size + SOURCE_PADDING, 1);
+    if (buffer == NULL)
     {
-        fclose (source_vgm);
-        fprintf (stderr, "Error: File is not a valid VGM.\n");
+        fprintf (stderr, "Error: Unable to allocate %d bytes of memory.\n", size);
         return NULL;
     }
 
-    /* Get the filesize */
-    fseek (source_vgm, 0, SEEK_END);
-    filesize = ftell (source_vgm);
+    memcpy (buffer, data, size);
+    *vgm_size = size;
 
-    rewind (source_vgm);
+    return buffer;
+}
+
+
+/*
+ * Read a file into an allocated buffer.
+ * The buffer should be freed when no longer needed.
+ */
+uint8_t *read_file (const char *filename, uint32_t *size)
+{
+    FILE *source_file = NULL;
+    uint8_t *buffer = NULL;
 
-    if (filesize > SOURCE_SIZE_MAX)
+    source_file = fopen (filename, "rb");
+    if (source_file == NULL)
     {
-        fprintf (stderr, "Error: Source file larger than 512 KiB.\n");
-        fclose (source_vgm);
+        fprintf (stderr, "Error: Unable to open %s.\n", filename);
         return NULL;
     }
 
-    /* Allocate a buffer */
-    buffer = malloc (filesize);
+    /* Get the filesize */
+    fseek (source_file, 0, SEEK_END);
+    *size = ftell (source_file);
+
+    rewind (source_file);
+
+    /* Allocate a buffer, with space for a terminator when reading text */
+    buffer = malloc (*size + 1);
     if (buffer == NULL)
     {
-        fprintf (stderr, "Error: Unable to allocate %d bytes of memory.\n", filesize);
-        fclose (source_vgm);
+        fprintf (stderr, "Error: Unable to allocate %d bytes of memory.\n", *size);
+        fclose (source_file);
         return NULL;
     }
 
     /* Read the file */
-    if (fread (buffer, sizeof (uint8_t), filesize, source_vgm) != filesize)
+    if (fread (buffer, sizeof (uint8_t), *size, source_file) != *size)
     {
-        fprintf (stderr, "Error: Unable to read %d bytes from file.\n", filesize);
-        fclose (source_vgm);
+        fprintf (stderr, "Error: Unable to read %d bytes from file.\n", *size);
+        fclose (source_file);
         free (buffer);
         return NULL;
     }
+    buffer [*size] = '\0';
+
+    fclose (source_file);
+
+    return buffer;
+}
+
+
+/*
+ * Read a .vgm or .vgz file into an allocated buffer.
+ * The buffer should be freed when no longer needed.
+ */
+uint8_t *read_vgm (const char *filename, uint32_t *vgm_size)
+{
+    uint8_t *file_buffer = NULL;
+    uint8_t *buffer = NULL;
+    uint32_t file_size = 0;
+
+    file_buffer = read_file (filename, &file_size);
+    if (file_buffer == NULL)
+    {
+        return NULL;
+    }
 
-    fclose (source_vgm);
+    buffer = read_vgm_buffer (file_buffer, file_size, vgm_size);
+    free (file_buffer);
 
     return buffer;
 }
@@ -1,5 +1,12 @@
 
 #define SOURCE_SIZE_MAX 524288      /* 512 KiB */
+#define SOURCE_PADDING  4           /* Zero bytes after the end of a read VGM */
+
+/* Copy an in-memory .vgm or .vgz file into an allocated buffer. */
+uint8_t *read_vgm_buffer (const uint8_t *data, uint32_t size, uint32_t *vgm_size);
+
+/* Read a file into an allocated buffer. */
+uint8_t *read_file (const char *filename, uint32_t *size);
 
 /* Read a .vgm file into an allocated buffer. */
-uint8_t *read_vgm (char *filename);
+uint8_t *read_vgm (const char *filename, uint32_t *vgm_size);
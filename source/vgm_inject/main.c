@@ -0,0 +1,89 @@
+/*
+ * vgm_inject
+ *
+ * Command line front-end for placing a music blob
+ * into a pre-built VGM-TapePlay player image.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../vgm_convert/vgm_read.h"
+#include "vgm_inject.h"
+
+
+/*
+ * Entry point.
+ */
+int main (int argc, char **argv)
+{
+    bool rom_mode = false;
+    char *player_ihx = NULL;
+    uint32_t player_ihx_size = 0;
+    uint8_t *music = NULL;
+    uint32_t music_size = 0;
+    uint8_t *output = NULL;
+    uint32_t output_size = 0;
+    FILE *output_file = NULL;
+
+    /* Option to output a cartridge ROM, starting from address zero */
+    if (argc == 5 && strcmp (argv [1], "--rom") == 0)
+    {
+        rom_mode = true;
+        argc--;
+        argv++;
+    }
+
+    if (argc != 4)
+    {
+        fprintf (stderr, "Usage: vgm_inject [--rom] <player.ihx> <music.bin> <output.bin>\n");
+        return EXIT_FAILURE;
+    }
+
+    player_ihx = (char *) read_file (argv [1], &player_ihx_size);
+    if (player_ihx == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+
+    music = read_file (argv [2], &music_size);
+    if (music == NULL)
+    {
+        free (player_ihx);
+        return EXIT_FAILURE;
+    }
+
+    if (vgm_inject (player_ihx, music, music_size, rom_mode, &output, &output_size) != 0)
+    {
+        free (player_ihx);
+        free (music);
+        return EXIT_FAILURE;
+    }
+
+    free (player_ihx);
+    free (music);
+
+    output_file = fopen (argv [3], "wb");
+    if (output_file == NULL)
+    {
+        fprintf (stderr, "Error: Unable to open %s for writing.\n", argv [3]);
+        free (output);
+        return EXIT_FAILURE;
+    }
+
+    if (fwrite (output, 1, output_size, output_file) != output_size)
+    {
+        fprintf (stderr, "Error: Unable to write to %s.\n", argv [3]);
+        fclose (output_file);
+        free (output);
+        return EXIT_FAILURE;
+    }
+
+    fclose (output_file);
+    free (output);
+
+    return EXIT_SUCCESS;
+}
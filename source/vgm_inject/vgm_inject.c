@@ -0,0 +1,466 @@
+/*
+ * vgm_inject
+ *
+ * Places a music blob from vgm_convert into a pre-built
+ * VGM-TapePlay player image, so that the player does not
+ * need to be recompiled for each song.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vgm_inject.h"
+
+#define IMAGE_SIZE          65536
+#define ROM_BANK_SIZE       8192
+#define MAPPER_BANK_SIZE    16384
+
+/* Must match music_descriptor in the player */
+#define DESCRIPTOR_SIZE     18
+
+/* Must match music_header in the player */
+#define MUSIC_HEADER_SIZE   10
+static const uint8_t descriptor_magic [6] = { 'V', 'G', 'M', 'T', 'P', 5 };
+
+/* Must match music_unpack () in the player */
+#define PACK_LITERAL_MAX    128
+#define PACK_MATCH_MIN      4
+#define PACK_MATCH_MAX      131
+
+/* Player memory image, and which addresses the player uses */
+static uint8_t image [IMAGE_SIZE] = { 0 };
+static bool image_used [IMAGE_SIZE] = { false };
+
+/* Music blob, with its end packed */
+static uint8_t packed_music [IMAGE_SIZE] = { 0 };
+
+
+/*
+ * Convert a string of hex digits into a value.
+ */
+static uint32_t hex_value (const char *string, int digits)
+{
+    char buffer [9] = { 0 };
+
+    memcpy (buffer, string, digits);
+
+    return strtoul (buffer, NULL, 16);
+}
+
+
+/*
+ * Read one Intel hex record into the image.
+ * Returns 1 for the end-of-file record, 0 to continue, or -1 on error.
+ */
+static int read_ihx_record (const char *line, uint32_t line_length)
+{
+    uint8_t length;
+    uint16_t address;
+    uint8_t type;
+
+    if (line_length < 11)
+    {
+        fprintf (stderr, "Error: Truncated record in player image.\n");
+        return -1;
+    }
+
+    length  = hex_value (&line [1], 2);
+    address = hex_value (&line [3], 4);
+    type    = hex_value (&line [7], 2);
+
+    if (type == 0x01)
+    {
+        /* End of file */
+        return 1;
+    }
+    else if (type != 0x00)
+    {
+        fprintf (stderr, "Error: Unsupported record type %02x in player image.\n", type);
+        return -1;
+    }
+
+    if (line_length < 11 + (uint32_t) length * 2)
+    {
+        fprintf (stderr, "Error: Truncated record in player image.\n");
+        return -1;
+    }
+
+    for (int i = 0; i < length; i++)
+    {
+        uint16_t byte_address = (address + i) & 0xffff;
+        image [byte_address] = hex_value (&line [9 + i * 2], 2);
+        image_used [byte_address] = true;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Read Intel hex text, as produced by sdcc, into the image.
+ */
+static int read_ihx (const char *ihx)
+{
+    const char *line = ihx;
+
+    memset (image, 0, sizeof (image));
+    memset (image_used, 0, sizeof (image_used));
+
+    while (*line != '\0')
+    {
+        uint32_t line_length = strcspn (line, "\r\n");
+
+        if (line [0] == ':')
+        {
+            int result = read_ihx_record (line, line_length);
+
+            if (result < 0)
+            {
+                return -1;
+            }
+            else if (result == 1)
+            {
+                break;
+            }
+        }
+
+        /* Move on to the next line */
+        line += line_length;
+        line += strspn (line, "\r\n");
+    }
+
+    return 0;
+}
+
+
+/*
+ * Find the music descriptor within the player image.
+ * Returns the address, or -1 if not found.
+ */
+static int32_t find_descriptor (void)
+{
+    for (uint32_t address = 0; address + DESCRIPTOR_SIZE <= IMAGE_SIZE; address++)
+    {
+        if (image_used [address] && memcmp (&image [address], descriptor_magic, sizeof (descriptor_magic)) == 0)
+        {
+            return address;
+        }
+    }
+
+    return -1;
+}
+
+
+/*
+ * Add a run of literal bytes to the packed data.
+ * Returns the new size of the packed data.
+ */
+static uint32_t pack_literals (const uint8_t *bytes, uint32_t count, uint8_t *packed, uint32_t packed_size)
+{
+    while (count)
+    {
+        uint32_t run = (count < PACK_LITERAL_MAX) ? count : PACK_LITERAL_MAX;
+
+        packed [packed_size++] = run - 1;
+        memcpy (&packed [packed_size], bytes, run);
+        packed_size += run;
+        bytes += run;
+        count -= run;
+    }
+
+    return packed_size;
+}
+
+
+/*
+ * Pack data for music_unpack () in the player, taking the
+ * longest match at each point. Matches may overlap the bytes they
+ * produce, as the player copies them one byte at a time.
+ *
+ * Returns the size of the packed data.
+ */
+static uint32_t music_pack (const uint8_t *data, uint32_t size, uint8_t *packed)
+{
+    uint32_t packed_size = 0;
+    uint32_t literal_start = 0;
+    uint32_t i = 0;
+
+    while (i < size)
+    {
+        uint32_t best_length = 0;
+        uint32_t best_distance = 0;
+
+        for (uint32_t distance = 1; distance <= i; distance++)
+        {
+            uint32_t length = 0;
+
+            while (i + length < size && length < PACK_MATCH_MAX &&
+                   data [i + length - distance] == data [i + length])
+            {
+                length++;
+            }
+
+            if (length > best_length)
+            {
+                best_length = length;
+                best_distance = distance;
+            }
+        }
+
+        if (best_length >= PACK_MATCH_MIN)
+        {
+            packed_size = pack_literals (&data [literal_start], i - literal_start, packed, packed_size);
+            packed [packed_size++] = 0x80 | (best_length - PACK_MATCH_MIN);
+            packed [packed_size++] = best_distance & 0xff;
+            packed [packed_size++] = best_distance >> 8;
+            i += best_length;
+            literal_start = i;
+        }
+        else
+        {
+            i++;
+        }
+    }
+
+    return pack_literals (&data [literal_start], i - literal_start, packed, packed_size);
+}
+
+
+/*
+ * Pack the end of a music blob into packed_music, for the player to unpack
+ * into RAM of the given size. The packed end starts from the earliest
+ * section of the blob that fits into the RAM, and that takes less space
+ * once packed. It is preceded by its unpacked size.
+ *
+ * Returns the offset of the packed end, or zero if nothing was packed.
+ */
+static uint32_t music_pack_end (const uint8_t *music, uint32_t music_size, uint32_t ram_size, uint32_t *packed_size)
+{
+    /* Where each section's offset is found in the blob header, in
+     * the order of the sections: frames, indexes, samples, checkpoints */
+    static const uint8_t section_offsets [4] = { 2, 4, 8, 6 };
+
+    for (uint32_t i = 0; i < 4; i++)
+    {
+        uint32_t offset = music [section_offsets [i]] | (music [section_offsets [i] + 1] << 8);
+        uint32_t size = music_size - offset;
+
+        /* Sections that are not present have an offset of zero */
+        if (offset < MUSIC_HEADER_SIZE || offset > music_size || size > ram_size)
+        {
+            continue;
+        }
+
+        *packed_size = music_pack (&music [offset], size, &packed_music [offset + 2]) + 2;
+        if (*packed_size < size)
+        {
+            memcpy (packed_music, music, offset);
+            packed_music [offset]     = size & 0xff;
+            packed_music [offset + 1] = size >> 8;
+            return offset;
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+ * Place a music blob into a player image.
+ *
+ * player_ihx is the Intel hex text of the player, as built by sdcc.
+ * If rom is set, the output starts from address zero and is padded
+ * to a whole number of 8 KiB banks, otherwise it starts from the
+ * lowest address used by the player.
+ *
+ * If the player has RAM outside of the image, the end of the blob may be
+ * packed in the image, and the player unpacks it into that RAM when it
+ * starts, leaving more of the image for music.
+ *
+ * If the player maps ROM banks in to a bank window, only the header, track
+ * table, and frames are placed in the image. The rest of the blob, from its
+ * index data on, follows in the 16 KiB banks starting at the bank window's
+ * own address, and the ROM is padded to a whole number of these banks.
+ *
+ * On success, *output is set to an allocated buffer which should
+ * be freed when no longer needed.
+ */
+int vgm_inject (const char *player_ihx, const uint8_t *music, uint32_t music_size,
+                bool rom, uint8_t **output, uint32_t *output_size)
+{
+    int32_t descriptor = 0;
+    uint32_t music_address = 0;
+    uint32_t music_limit = 0;
+    uint32_t ram_window = 0;
+    uint32_t ram_window_limit = 0;
+    uint32_t unpack_offset = 0;
+    uint32_t unpacked_size = 0;
+    uint32_t packed_size = 0;
+    uint32_t bank_window = 0;
+    const uint8_t *banked_music = NULL;
+    uint32_t banked_size = 0;
+    uint32_t output_start = IMAGE_SIZE;
+    uint32_t output_end = 0;
+
+    if (read_ihx (player_ihx) != 0)
+    {
+        return -1;
+    }
+
+    descriptor = find_descriptor ();
+    if (descriptor < 0)
+    {
+        fprintf (stderr, "Error: No music descriptor found in player image.\n");
+        return -1;
+    }
+    music_limit = image [descriptor + 8] | (image [descriptor + 9] << 8);
+    ram_window = image [descriptor + 10] | (image [descriptor + 11] << 8);
+    ram_window_limit = image [descriptor + 12] | (image [descriptor + 13] << 8);
+    bank_window = image [descriptor + 16] | (image [descriptor + 17] << 8);
+
+    if (music_size < MUSIC_HEADER_SIZE)
+    {
+        fprintf (stderr, "Error: Music blob is too small.\n");
+        return -1;
+    }
+
+    /* Split the blob at its index data, for the rest to go in the banks */
+    if (bank_window != 0)
+    {
+        uint32_t index_data_offset = music [4] | (music [5] << 8);
+
+        if (!rom)
+        {
+            fprintf (stderr, "Error: A banked player can only be used for a cartridge.\n");
+            return -1;
+        }
+
+        for (uint32_t address = bank_window; address < bank_window + MAPPER_BANK_SIZE; address++)
+        {
+            if (image_used [address])
+            {
+                fprintf (stderr, "Error: Player image overlaps the bank window at 0x%04x.\n", bank_window);
+                return -1;
+            }
+        }
+
+        banked_music = music + index_data_offset;
+        banked_size = music_size - index_data_offset;
+        music_size = index_data_offset;
+    }
+
+    /* Pack the end of the blob, to be unpacked into the player's RAM window */
+    if (ram_window != 0)
+    {
+        unpack_offset = music_pack_end (music, music_size, ram_window_limit - ram_window, &packed_size);
+    }
+    if (unpack_offset != 0)
+    {
+        unpacked_size = music_size - unpack_offset;
+        music = packed_music;
+        music_size = unpack_offset + packed_size;
+        image [descriptor + 14] = unpack_offset & 0xff;
+        image [descriptor + 15] = unpack_offset >> 8;
+    }
+
+    /* The music goes after the last byte of the player that
+     * is below the limit, not counting the descriptor itself */
+    for (uint32_t address = 0; address < music_limit; address++)
+    {
+        if (image_used [address] && (address < (uint32_t) descriptor || address >= (uint32_t) descriptor + DESCRIPTOR_SIZE))
+        {
+            music_address = address + 1;
+        }
+    }
+
+    if (music_address + music_size > music_limit)
+    {
+        fprintf (stderr, "Error: Music is %d bytes too large for the player image.\n",
+                 music_address + music_size - music_limit);
+        return -1;
+    }
+
+    /* Place the music and fill in the descriptor */
+    memcpy (&image [music_address], music, music_size);
+    memset (&image_used [music_address], true, music_size);
+    image [descriptor + 6] = music_address & 0xff;
+    image [descriptor + 7] = music_address >> 8;
+
+    /* Find the range of addresses to output */
+    for (uint32_t address = 0; address < IMAGE_SIZE; address++)
+    {
+        if (image_used [address])
+        {
+            if (address < output_start)
+            {
+                output_start = address;
+            }
+            output_end = address + 1;
+        }
+    }
+
+    /* The banks follow on from the bank window's address, after the image */
+    if (banked_music != NULL)
+    {
+        output_start = 0;
+        output_end = bank_window + ((banked_size + MAPPER_BANK_SIZE - 1) & ~(MAPPER_BANK_SIZE - 1));
+    }
+
+    /* Cartridges start from zero, and are padded to a whole number of banks */
+    else if (rom)
+    {
+        output_start = 0;
+        output_end = (output_end + ROM_BANK_SIZE - 1) & ~(ROM_BANK_SIZE - 1);
+        for (uint32_t address = 0; address < output_end; address++)
+        {
+            if (!image_used [address])
+            {
+                image [address] = 0xff;
+            }
+        }
+    }
+
+    *output_size = output_end - output_start;
+    *output = malloc (*output_size);
+    if (*output == NULL)
+    {
+        fprintf (stderr, "Error: Unable to allocate %d bytes of memory.\n", *output_size);
+        return -1;
+    }
+    if (banked_music != NULL)
+    {
+        for (uint32_t address = 0; address < bank_window; address++)
+        {
+            (*output) [address] = image_used [address] ? image [address] : 0xff;
+        }
+        memset (&(*output) [bank_window], 0xff, *output_size - bank_window);
+        memcpy (&(*output) [bank_window], banked_music, banked_size);
+    }
+    else
+    {
+        memcpy (*output, &image [output_start], *output_size);
+    }
+
+    fprintf (stderr, "Music placed at 0x%04x, %d bytes free.\n",
+             music_address, music_limit - (music_address + music_size));
+    if (banked_music != NULL)
+    {
+        fprintf (stderr, "Last %d bytes of music placed in %d banks from bank %d, %d bytes free.\n",
+                 banked_size, (*output_size - bank_window) / MAPPER_BANK_SIZE, bank_window / MAPPER_BANK_SIZE,
+                 *output_size - (bank_window + banked_size));
+    }
+    if (unpack_offset != 0)
+    {
+        fprintf (stderr, "Last %d bytes of music packed into %d bytes, unpacked at 0x%04x, %d bytes free.\n",
+                 unpacked_size, packed_size, ram_window, ram_window_limit - (ram_window + unpacked_size));
+    }
+    else if (ram_window != 0)
+    {
+        fprintf (stderr, "RAM at 0x%04x not used, %d bytes free.\n", ram_window, ram_window_limit - ram_window);
+    }
+
+    return 0;
+}
@@ -0,0 +1,4 @@
+
+/* Place a music blob into a player image. */
+int vgm_inject (const char *player_ihx, const uint8_t *music, uint32_t music_size,
+                bool rom, uint8_t **output, uint32_t *output_size);